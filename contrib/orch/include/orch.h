@@ -33,6 +33,9 @@ size_t strlcat(char * __restrict, const char * __restrict, size_t);
     defined(__NetBSD__)
 int tcsetsid(int, int);
 #endif
+#if defined(__linux__) || defined(__APPLE__)
+void closefrom(int);
+#endif
 
 /* orch_lua.c */
 int luaopen_orch_core(lua_State *);
@@ -0,0 +1,437 @@
+/*-
+ * Copyright (c) 2024 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/param.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "orch.h"
+#include "orch_lib.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#define	ORCHLUA_MULTIMATCHHANDLE	"orchlua_multimatch"
+
+/*
+ * A multimatch is an Aho-Corasick automaton over a set of literal patterns,
+ * used to match all of the alternatives of a one() block in a single pass over
+ * the output.  The automaton is compiled down to a full transition table, so
+ * scanning is a single table lookup per byte.  We scan each byte of the match
+ * buffer exactly once and record where each pattern first completed; the
+ * caller decides which of those it prefers.
+ */
+#define	AC_NOSTATE	(-1)
+#define	AC_ROOT		0
+#define	AC_NSYMBOLS	(UCHAR_MAX + 1)
+
+struct orch_ac_state {
+	int32_t			 next[AC_NSYMBOLS];
+	int32_t			 fail;
+	int32_t			 out;		/* First pattern ending here */
+	int32_t			 outlink;	/* Next state with output */
+};
+
+struct orch_ac_pattern {
+	size_t			 len;
+	uint64_t		 end;		/* Absolute offset of first match */
+	int32_t			 chain;		/* Next pattern, same state */
+	bool			 matched;
+};
+
+struct orch_ac {
+	struct orch_ac_state	*states;
+	struct orch_ac_pattern	*patterns;
+	size_t			 nstates;
+	size_t			 statecap;
+	size_t			 npatterns;
+	size_t			 nmatched;
+
+	/* Streaming state */
+	const struct orch_matchbuf	*buffer;
+	uint64_t		 base;
+	uint64_t		 scanned;
+	int32_t			 cur;
+};
+
+static int32_t
+orch_ac_newstate(struct orch_ac *ac)
+{
+	struct orch_ac_state *state;
+
+	if (ac->nstates == ac->statecap) {
+		struct orch_ac_state *states;
+		size_t newcap;
+
+		newcap = MAX(ac->statecap * 2, 16);
+		if (newcap > INT32_MAX) {
+			errno = ENOMEM;
+			return (AC_NOSTATE);
+		}
+
+		states = realloc(ac->states, newcap * sizeof(*states));
+		if (states == NULL)
+			return (AC_NOSTATE);
+
+		ac->states = states;
+		ac->statecap = newcap;
+	}
+
+	state = &ac->states[ac->nstates];
+	for (size_t i = 0; i < AC_NSYMBOLS; i++)
+		state->next[i] = AC_NOSTATE;
+	state->fail = AC_ROOT;
+	state->out = AC_NOSTATE;
+	state->outlink = AC_NOSTATE;
+
+	return (ac->nstates++);
+}
+
+static int
+orch_ac_insert(struct orch_ac *ac, int32_t idx, const char *pattern,
+    size_t len)
+{
+	int32_t cur, next;
+
+	ac->patterns[idx].len = len;
+	ac->patterns[idx].chain = AC_NOSTATE;
+
+	/* Handled at reset, rather than giving the root state an output. */
+	if (len == 0)
+		return (0);
+
+	cur = AC_ROOT;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char ch = pattern[i];
+
+		next = ac->states[cur].next[ch];
+		if (next == AC_NOSTATE) {
+			next = orch_ac_newstate(ac);
+			if (next == AC_NOSTATE)
+				return (-1);
+			ac->states[cur].next[ch] = next;
+		}
+
+		cur = next;
+	}
+
+	ac->patterns[idx].chain = ac->states[cur].out;
+	ac->states[cur].out = idx;
+	return (0);
+}
+
+/*
+ * Fill in the failure links breadth-first, and fill in the missing transitions
+ * from them as we go so that scanning never needs to follow a failure link.
+ */
+static int
+orch_ac_link(struct orch_ac *ac)
+{
+	int32_t *queue;
+	size_t qhead, qtail;
+
+	queue = malloc(ac->nstates * sizeof(*queue));
+	if (queue == NULL)
+		return (-1);
+
+	qhead = qtail = 0;
+	for (size_t ch = 0; ch < AC_NSYMBOLS; ch++) {
+		int32_t next = ac->states[AC_ROOT].next[ch];
+
+		if (next == AC_NOSTATE) {
+			ac->states[AC_ROOT].next[ch] = AC_ROOT;
+			continue;
+		}
+
+		ac->states[next].fail = AC_ROOT;
+		queue[qtail++] = next;
+	}
+
+	while (qhead < qtail) {
+		struct orch_ac_state *state;
+		int32_t cur;
+
+		cur = queue[qhead++];
+		state = &ac->states[cur];
+
+		if (ac->states[state->fail].out != AC_NOSTATE)
+			state->outlink = state->fail;
+		else
+			state->outlink = ac->states[state->fail].outlink;
+
+		for (size_t ch = 0; ch < AC_NSYMBOLS; ch++) {
+			int32_t fallback, next = state->next[ch];
+
+			fallback = ac->states[state->fail].next[ch];
+			if (next == AC_NOSTATE) {
+				state->next[ch] = fallback;
+				continue;
+			}
+
+			ac->states[next].fail = fallback;
+			queue[qtail++] = next;
+		}
+	}
+
+	free(queue);
+	return (0);
+}
+
+static void
+orch_ac_reset(struct orch_ac *ac, const struct orch_matchbuf *buffer)
+{
+
+	ac->buffer = buffer;
+	ac->base = ac->scanned = (buffer != NULL ? buffer->base : 0);
+	ac->cur = AC_ROOT;
+	ac->nmatched = 0;
+
+	for (size_t i = 0; i < ac->npatterns; i++) {
+		struct orch_ac_pattern *pattern = &ac->patterns[i];
+
+		/* The empty pattern matches immediately, as with find(). */
+		pattern->matched = pattern->len == 0;
+		pattern->end = ac->base;
+		if (pattern->matched)
+			ac->nmatched++;
+	}
+}
+
+static void
+orch_ac_record(struct orch_ac *ac, int32_t state, uint64_t end)
+{
+
+	for (; state != AC_NOSTATE; state = ac->states[state].outlink) {
+		for (int32_t idx = ac->states[state].out; idx != AC_NOSTATE;
+		    idx = ac->patterns[idx].chain) {
+			struct orch_ac_pattern *pattern = &ac->patterns[idx];
+
+			if (pattern->matched)
+				continue;
+
+			pattern->matched = true;
+			pattern->end = end;
+			ac->nmatched++;
+		}
+	}
+}
+
+/*
+ * Scan whatever has arrived in `buffer` since we last looked at it.  If the
+ * buffer has been swapped out or consumed from underneath us, then our previous
+ * results are stale and we need to start over from its current head.
+ */
+static void
+orch_ac_scan(struct orch_ac *ac, const struct orch_matchbuf *buffer)
+{
+	const unsigned char *data;
+	size_t len, off;
+	int32_t cur;
+
+	if (ac->buffer != buffer || ac->base != buffer->base)
+		orch_ac_reset(ac, buffer);
+
+	data = (const unsigned char *)orch_matchbuf_data(buffer, &len);
+	off = ac->scanned - ac->base;
+	cur = ac->cur;
+
+	for (; off < len && ac->nmatched < ac->npatterns; off++) {
+		cur = ac->states[cur].next[data[off]];
+		if (ac->states[cur].out != AC_NOSTATE ||
+		    ac->states[cur].outlink != AC_NOSTATE)
+			orch_ac_record(ac, cur, ac->base + off + 1);
+	}
+
+	/*
+	 * If everything has matched, there's nothing left to look for until
+	 * we're reset; just mark the rest as scanned.
+	 */
+	ac->scanned = ac->base + len;
+	ac->cur = cur;
+}
+
+static void
+orch_ac_free(struct orch_ac *ac)
+{
+
+	free(ac->states);
+	free(ac->patterns);
+	ac->states = NULL;
+	ac->patterns = NULL;
+	ac->nstates = ac->statecap = ac->npatterns = 0;
+	ac->buffer = NULL;
+}
+
+/*
+ * multimatch(patterns) -- compile the array of literal `patterns` into a single
+ * automaton.
+ */
+static int
+orchlua_multimatch(lua_State *L)
+{
+	struct orch_ac *ac;
+	int npatterns;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	npatterns = luaL_len(L, 1);
+
+	ac = lua_newuserdata(L, sizeof(*ac));
+	memset(ac, 0, sizeof(*ac));
+	luaL_setmetatable(L, ORCHLUA_MULTIMATCHHANDLE);
+
+	if (npatterns > 0) {
+		ac->patterns = calloc(npatterns, sizeof(*ac->patterns));
+		if (ac->patterns == NULL)
+			goto err;
+	}
+
+	ac->npatterns = npatterns;
+	if (orch_ac_newstate(ac) == AC_NOSTATE)
+		goto err;
+
+	for (int i = 1; i <= npatterns; i++) {
+		const char *pattern;
+		size_t patternsz;
+
+		lua_rawgeti(L, 1, i);
+		pattern = lua_tolstring(L, -1, &patternsz);
+		if (pattern == NULL) {
+			orch_ac_free(ac);
+
+			luaL_pushfail(L);
+			lua_pushfstring(L, "pattern %d is not a string", i);
+			return (2);
+		}
+
+		if (orch_ac_insert(ac, i - 1, pattern, patternsz) != 0)
+			goto err;
+
+		lua_pop(L, 1);
+	}
+
+	if (orch_ac_link(ac) != 0)
+		goto err;
+
+	orch_ac_reset(ac, NULL);
+	return (1);
+err:
+	orch_ac_free(ac);
+
+	luaL_pushfail(L);
+	lua_pushstring(L, strerror(ENOMEM));
+	return (2);
+}
+
+/*
+ * reset() -- forget any progress, to be used before scanning a new buffer.
+ */
+static int
+orchlua_multimatch_reset(lua_State *L)
+{
+	struct orch_ac *self;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_MULTIMATCHHANDLE);
+
+	orch_ac_reset(self, NULL);
+	return (0);
+}
+
+/*
+ * scan(buffer) -- scan any output in the match buffer `buffer` that hasn't yet
+ * been scanned.
+ */
+static int
+orchlua_multimatch_scan(lua_State *L)
+{
+	struct orch_ac *self;
+	struct orch_matchbuf *buffer;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_MULTIMATCHHANDLE);
+	buffer = luaL_checkudata(L, 2, ORCHLUA_MATCHBUFHANDLE);
+
+	orch_ac_scan(self, buffer);
+
+	lua_pushinteger(L, self->nmatched);
+	return (1);
+}
+
+/*
+ * match(idx) -- returns the first and last indices of the first match of the
+ * pattern at `idx` in the scanned buffer, like string.find(), or nil if it
+ * hasn't matched.
+ */
+static int
+orchlua_multimatch_match(lua_State *L)
+{
+	struct orch_ac *self;
+	struct orch_ac_pattern *pattern;
+	lua_Integer idx;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_MULTIMATCHHANDLE);
+	idx = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, idx >= 1 && (size_t)idx <= self->npatterns, 2,
+	    "pattern index out of bounds");
+
+	pattern = &self->patterns[idx - 1];
+	if (!pattern->matched) {
+		lua_pushnil(L);
+		return (1);
+	}
+
+	lua_pushinteger(L, pattern->end - pattern->len - self->base + 1);
+	lua_pushinteger(L, pattern->end - self->base);
+	return (2);
+}
+
+static int
+orchlua_multimatch_close(lua_State *L)
+{
+	struct orch_ac *self;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_MULTIMATCHHANDLE);
+	orch_ac_free(self);
+	return (0);
+}
+
+#define	MULTIMATCH_SIMPLE(n)	{ #n, orchlua_multimatch_ ## n }
+static const luaL_Reg orchlua_multimatch_methods[] = {
+	MULTIMATCH_SIMPLE(match),
+	MULTIMATCH_SIMPLE(reset),
+	MULTIMATCH_SIMPLE(scan),
+	{ NULL, NULL },
+};
+
+static const luaL_Reg orchlua_multimatch_meta[] = {
+	{ "__index", NULL },	/* Set during registration */
+	{ "__gc", orchlua_multimatch_close },
+	{ "__close", orchlua_multimatch_close },
+	{ NULL, NULL },
+};
+
+int
+orchlua_setup_multimatch(lua_State *L)
+{
+
+	/* Module is on the stack. */
+	lua_pushcfunction(L, orchlua_multimatch);
+	lua_setfield(L, -2, "multimatch");
+
+	luaL_newmetatable(L, ORCHLUA_MULTIMATCHHANDLE);
+	luaL_setfuncs(L, orchlua_multimatch_meta, 0);
+
+	luaL_newlibtable(L, orchlua_multimatch_methods);
+	luaL_setfuncs(L, orchlua_multimatch_methods, 0);
+	lua_setfield(L, -2, "__index");
+
+	lua_pop(L, 1);
+
+	return (1);
+}
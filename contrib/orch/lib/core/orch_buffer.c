@@ -0,0 +1,409 @@
+/*-
+ * Copyright (c) 2024 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "orch.h"
+#include "orch_lib.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+
+/*
+ * The match buffer holds process output that hasn't been matched yet.  It's a
+ * single contiguous allocation so that matchers can operate on it directly;
+ * bytes are appended at the tail, and consuming a match just advances the head.
+ * The live region is only moved back to the front of the allocation when we
+ * need the space, so trimming is O(1) and appending is amortized O(n) in the
+ * size of the data appended, rather than the size of the data retained.
+ */
+
+int
+orch_matchbuf_reserve(struct orch_matchbuf *buf, size_t need, char **otail)
+{
+	char *newdata;
+	size_t len, newcap;
+
+	len = buf->tail - buf->head;
+	if (buf->cap - buf->tail >= need)
+		goto out;
+
+	/*
+	 * Sliding the live region down is cheaper than growing if it frees up
+	 * enough space and the live region is no bigger than what we'd reclaim.
+	 */
+	if (buf->head != 0 && buf->cap - len >= need && len <= buf->head) {
+		memmove(buf->data, &buf->data[buf->head], len);
+		buf->head = 0;
+		buf->tail = len;
+		goto out;
+	}
+
+	newcap = MAX(buf->cap, LINE_MAX);
+	while (newcap - len < need) {
+		if (newcap > SIZE_MAX / 2) {
+			errno = ENOMEM;
+			return (-1);
+		}
+
+		newcap *= 2;
+	}
+
+	if (buf->head != 0) {
+		memmove(buf->data, &buf->data[buf->head], len);
+		buf->head = 0;
+		buf->tail = len;
+	}
+
+	newdata = realloc(buf->data, newcap);
+	if (newdata == NULL)
+		return (-1);
+
+	buf->data = newdata;
+	buf->cap = newcap;
+out:
+	if (otail != NULL)
+		*otail = &buf->data[buf->tail];
+	return (0);
+}
+
+/*
+ * Returns the space available at the tail of the buffer without moving or
+ * growing it.
+ */
+size_t
+orch_matchbuf_space(const struct orch_matchbuf *buf)
+{
+
+	return (buf->cap - buf->tail);
+}
+
+void
+orch_matchbuf_commit(struct orch_matchbuf *buf, size_t len)
+{
+
+	assert(len <= buf->cap - buf->tail);
+	buf->tail += len;
+}
+
+int
+orch_matchbuf_append(struct orch_matchbuf *buf, const char *data, size_t len)
+{
+	char *tail;
+
+	if (orch_matchbuf_reserve(buf, len, &tail) != 0)
+		return (-1);
+
+	memcpy(tail, data, len);
+	orch_matchbuf_commit(buf, len);
+	return (0);
+}
+
+void
+orch_matchbuf_consume(struct orch_matchbuf *buf, size_t len)
+{
+
+	assert(len <= buf->tail - buf->head);
+	buf->head += len;
+	buf->base += len;
+
+	/* Cheap to reset when we've consumed everything. */
+	if (buf->head == buf->tail)
+		buf->head = buf->tail = 0;
+}
+
+/*
+ * Discard the oldest bytes in the buffer so that no more than `keep` remain,
+ * returning the number discarded.  This is just a consume() as far as matchers
+ * are concerned.
+ */
+size_t
+orch_matchbuf_trim(struct orch_matchbuf *buf, size_t keep)
+{
+	size_t len;
+
+	len = buf->tail - buf->head;
+	if (len <= keep)
+		return (0);
+
+	orch_matchbuf_consume(buf, len - keep);
+	return (len - keep);
+}
+
+const char *
+orch_matchbuf_data(const struct orch_matchbuf *buf, size_t *olen)
+{
+
+	if (olen != NULL)
+		*olen = buf->tail - buf->head;
+	if (buf->data == NULL)
+		return ("");
+	return (&buf->data[buf->head]);
+}
+
+void
+orch_matchbuf_free(struct orch_matchbuf *buf)
+{
+
+	free(buf->data);
+	buf->data = NULL;
+	buf->head = buf->tail = buf->cap = 0;
+	buf->base = 0;
+}
+
+struct orch_matchbuf *
+orchlua_matchbuf_alloc(lua_State *L)
+{
+	struct orch_matchbuf *buf;
+
+	buf = lua_newuserdata(L, sizeof(*buf));
+	memset(buf, 0, sizeof(*buf));
+
+	luaL_setmetatable(L, ORCHLUA_MATCHBUFHANDLE);
+	return (buf);
+}
+
+/*
+ * Converts an optional Lua string index (1-based, negative from the end) at
+ * `idx` into an offset into a subject of length `len`, clamped to [0, len].
+ */
+size_t
+orchlua_optindex(lua_State *L, int idx, size_t len)
+{
+	lua_Integer pos;
+
+	pos = luaL_optinteger(L, idx, 1);
+	if (pos > 0)
+		return (MIN((size_t)pos - 1, len));
+	else if (pos == 0 || (size_t)-pos > len)
+		return (0);
+	return (len + pos);
+}
+
+/*
+ * Fetch the subject at `idx` for matching; it may either be a string or a
+ * match buffer.  Match buffers are used in-place, so the returned pointer is
+ * only valid until the buffer is next modified.
+ */
+const char *
+orchlua_checksubject(lua_State *L, int idx, size_t *olen)
+{
+	struct orch_matchbuf *buf;
+
+	buf = luaL_testudata(L, idx, ORCHLUA_MATCHBUFHANDLE);
+	if (buf != NULL)
+		return (orch_matchbuf_data(buf, olen));
+
+	return (luaL_checklstring(L, idx, olen));
+}
+
+/*
+ * matchbuf() -- create a new, empty match buffer.
+ */
+int
+orchlua_matchbuf(lua_State *L)
+{
+
+	(void)orchlua_matchbuf_alloc(L);
+	return (1);
+}
+
+/*
+ * append(data) -- append the string `data` to the buffer.
+ */
+static int
+orchlua_matchbuf_append(lua_State *L)
+{
+	struct orch_matchbuf *self;
+	const char *data;
+	size_t datasz;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_MATCHBUFHANDLE);
+	data = luaL_checklstring(L, 2, &datasz);
+
+	if (orch_matchbuf_append(self, data, datasz) != 0) {
+		int serr = errno;
+
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(serr));
+		return (2);
+	}
+
+	lua_pushboolean(L, 1);
+	return (1);
+}
+
+/*
+ * consume(last) -- discard everything up to and including index `last`, as
+ * returned by a matcher.
+ */
+static int
+orchlua_matchbuf_consume(lua_State *L)
+{
+	struct orch_matchbuf *self;
+	lua_Integer last;
+	size_t len;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_MATCHBUFHANDLE);
+	last = luaL_checkinteger(L, 2);
+
+	(void)orch_matchbuf_data(self, &len);
+	luaL_argcheck(L, last >= 0 && (size_t)last <= len, 2,
+	    "offset out of bounds");
+
+	orch_matchbuf_consume(self, last);
+
+	lua_pushboolean(L, 1);
+	return (1);
+}
+
+/*
+ * contents([init]) -- return the contents of the buffer as a string, starting
+ * at index `init` if specified.
+ */
+static int
+orchlua_matchbuf_contents(lua_State *L)
+{
+	struct orch_matchbuf *self;
+	const char *data;
+	size_t len, start;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_MATCHBUFHANDLE);
+	data = orch_matchbuf_data(self, &len);
+	start = orchlua_optindex(L, 2, len);
+
+	lua_pushlstring(L, &data[start], len - start);
+	return (1);
+}
+
+static int
+orchlua_matchbuf_empty(lua_State *L)
+{
+	struct orch_matchbuf *self;
+	size_t len;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_MATCHBUFHANDLE);
+	(void)orch_matchbuf_data(self, &len);
+
+	lua_pushboolean(L, len == 0);
+	return (1);
+}
+
+/*
+ * find(literal[, init]) -- find the first occurrence of `literal` in the
+ * buffer, starting at index `init`.  Returns the first and last indices of the
+ * match like string.find(), or nil if it's not present.
+ */
+static int
+orchlua_matchbuf_find(lua_State *L)
+{
+	struct orch_matchbuf *self;
+	const char *data, *found, *needle;
+	size_t len, needlesz, start;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_MATCHBUFHANDLE);
+	needle = luaL_checklstring(L, 2, &needlesz);
+	data = orch_matchbuf_data(self, &len);
+	start = orchlua_optindex(L, 3, len);
+
+	if (needlesz == 0) {
+		lua_pushinteger(L, start + 1);
+		lua_pushinteger(L, start);
+		return (2);
+	}
+
+	found = memmem(&data[start], len - start, needle, needlesz);
+	if (found == NULL) {
+		lua_pushnil(L);
+		return (1);
+	}
+
+	lua_pushinteger(L, found - data + 1);
+	lua_pushinteger(L, found - data + needlesz);
+	return (2);
+}
+
+static int
+orchlua_matchbuf_len(lua_State *L)
+{
+	struct orch_matchbuf *self;
+	size_t len;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_MATCHBUFHANDLE);
+	(void)orch_matchbuf_data(self, &len);
+
+	lua_pushinteger(L, len);
+	return (1);
+}
+
+/*
+ * offset() -- returns the absolute offset of the start of the buffer, i.e., the
+ * number of bytes that have been consumed from it over its lifetime.  Matchers
+ * use this to track how much of the buffer they've already examined across
+ * consume() calls.
+ */
+static int
+orchlua_matchbuf_offset(lua_State *L)
+{
+	struct orch_matchbuf *self;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_MATCHBUFHANDLE);
+
+	lua_pushinteger(L, self->base);
+	return (1);
+}
+
+static int
+orchlua_matchbuf_close(lua_State *L)
+{
+	struct orch_matchbuf *self;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_MATCHBUFHANDLE);
+	orch_matchbuf_free(self);
+	return (0);
+}
+
+#define	MATCHBUF_SIMPLE(n)	{ #n, orchlua_matchbuf_ ## n }
+static const luaL_Reg orchlua_matchbuf_methods[] = {
+	MATCHBUF_SIMPLE(append),
+	MATCHBUF_SIMPLE(consume),
+	MATCHBUF_SIMPLE(contents),
+	MATCHBUF_SIMPLE(empty),
+	MATCHBUF_SIMPLE(find),
+	MATCHBUF_SIMPLE(len),
+	MATCHBUF_SIMPLE(offset),
+	{ NULL, NULL },
+};
+
+static const luaL_Reg orchlua_matchbuf_meta[] = {
+	{ "__index", NULL },	/* Set during registration */
+	{ "__gc", orchlua_matchbuf_close },
+	{ "__close", orchlua_matchbuf_close },
+	{ "__len", orchlua_matchbuf_len },
+	{ NULL, NULL },
+};
+
+int
+orchlua_setup_matchbuf(lua_State *L)
+{
+
+	luaL_newmetatable(L, ORCHLUA_MATCHBUFHANDLE);
+	luaL_setfuncs(L, orchlua_matchbuf_meta, 0);
+
+	luaL_newlibtable(L, orchlua_matchbuf_methods);
+	luaL_setfuncs(L, orchlua_matchbuf_methods, 0);
+	lua_setfield(L, -2, "__index");
+
+	lua_pop(L, 1);
+
+	return (1);
+}
@@ -0,0 +1,127 @@
+/*-
+ * Copyright (c) 2024 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "orch.h"
+#include "orch_lib.h"
+
+/*
+ * All of our timeouts are measured against the monotonic clock, so that wall
+ * clock adjustments can neither fire them early nor starve them.  Operations
+ * compute a single absolute deadline up front and derive whatever relative
+ * timeouts they need from it as they go.
+ */
+void
+orch_clock_now(struct timespec *now)
+{
+	int error __unused;
+
+	error = clock_gettime(CLOCK_MONOTONIC, now);
+	assert(error == 0);
+}
+
+double
+orch_clock_seconds(void)
+{
+	struct timespec now;
+
+	orch_clock_now(&now);
+	return (now.tv_sec + now.tv_nsec / 1000000000.0);
+}
+
+/*
+ * Advance `ts` by `seconds`, for building schedules out of a fixed start time
+ * without accumulating drift.
+ */
+void
+orch_clock_add(struct timespec *ts, double seconds)
+{
+	double whole;
+
+	assert(seconds >= 0);
+
+	whole = floor(seconds);
+	ts->tv_sec += whole;
+	ts->tv_nsec += 1000000000 * (seconds - whole);
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+void
+orch_deadline_init(struct timespec *deadline, double timeout)
+{
+
+	orch_clock_now(deadline);
+	orch_clock_add(deadline, timeout);
+}
+
+/*
+ * Returns the time remaining until `deadline` in seconds, clamped to 0.
+ */
+double
+orch_deadline_remaining(const struct timespec *deadline)
+{
+	struct timespec now;
+	double remaining;
+
+	orch_clock_now(&now);
+	remaining = (deadline->tv_sec - now.tv_sec) +
+	    (deadline->tv_nsec - now.tv_nsec) / 1000000000.0;
+
+	return (MAX(remaining, 0));
+}
+
+/*
+ * Returns whichever of two optional deadlines comes first.
+ */
+const struct timespec *
+orch_deadline_min(const struct timespec *a, const struct timespec *b)
+{
+
+	if (a == NULL)
+		return (b);
+	if (b == NULL)
+		return (a);
+	if (a->tv_sec != b->tv_sec)
+		return (a->tv_sec < b->tv_sec ? a : b);
+	return (a->tv_nsec <= b->tv_nsec ? a : b);
+}
+
+bool
+orch_deadline_expired(const struct timespec *deadline)
+{
+
+	return (deadline != NULL && orch_deadline_remaining(deadline) == 0);
+}
+
+/*
+ * Returns a timeout suitable for poll(2): -1 to block if we have no deadline,
+ * or the number of milliseconds remaining, rounded up so that we don't wake up
+ * just before the deadline and spin.
+ */
+int
+orch_deadline_poll_ms(const struct timespec *deadline)
+{
+	double remaining;
+
+	if (deadline == NULL)
+		return (-1);
+
+	remaining = orch_deadline_remaining(deadline) * 1000;
+	if (remaining >= INT_MAX)
+		return (INT_MAX);
+
+	return (ceil(remaining));
+}
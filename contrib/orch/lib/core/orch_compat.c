@@ -3,10 +3,12 @@
 #include <sys/ioctl.h>
 
 #ifdef __linux__
+#include <sys/syscall.h>
 #include <asm/termbits.h>
 #endif
 
 #include <string.h>
+#include <unistd.h>
 
 #include "orch.h"
 
@@ -108,3 +110,26 @@ tcsetsid(int tty, int sess __unused)
 	return (ioctl(tty, TIOCSCTTY, NULL));
 }
 #endif
+#if defined(__linux__) || defined(__APPLE__)
+/*
+ * glibc only grew closefrom(3) in 2.34 and other Linux libcs may not have it at
+ * all, nor does macOS.  Linux's close_range(2) does the job in one go where
+ * it's available; otherwise, we just close everything up to the limit.
+ */
+void
+closefrom(int lowfd)
+{
+	long maxfd;
+
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, lowfd, ~0U, 0) == 0)
+		return;
+#endif
+
+	maxfd = sysconf(_SC_OPEN_MAX);
+	if (maxfd == -1)
+		maxfd = getdtablesize();
+	for (long fd = lowfd; fd < maxfd; fd++)
+		(void)close(fd);
+}
+#endif
@@ -0,0 +1,1092 @@
+/*-
+ * Copyright (c) 2024 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "orch.h"
+#include "orch_lib.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#define	ORCHLUA_DFAHANDLE	"orchlua_dfa"
+
+/*
+ * A streaming matcher for a practical subset of POSIX extended regular
+ * expressions: literals, escapes, ., bracket expressions (including ranges and
+ * the standard [:class:] names), grouping, alternation, the *, +, ? and {m,n}
+ * repetition operators, and a leading ^ to anchor the match to the beginning of
+ * the unmatched output.  $ is not supported, since the end of the output
+ * received so far isn't meaningful.
+ *
+ * The pattern is parsed into a tree, then compiled to a Thompson NFA; we compile
+ * one NFA for the pattern and another for the pattern reversed.  The forward
+ * NFA is simulated with a lazily-built DFA that carries its state across reads,
+ * so each byte of output is examined exactly once no matter how it was chunked.
+ * Once we've found where the earliest match ends, we run the reversed NFA
+ * backwards from there to find where the leftmost match ending there starts.
+ */
+#define	DFA_NSYMBOLS	(UCHAR_MAX + 1)
+#define	DFA_SETWORDS	(DFA_NSYMBOLS / 32)
+
+/* Bounds on how large we'll let a pattern make the automata. */
+#define	DFA_MAX_REPEAT	255
+#define	DFA_MAX_NSTATES	8192
+#define	DFA_MAX_DSTATES	512
+#define	DFA_MAX_POOL	(DFA_MAX_DSTATES * 64)
+#define	DFA_MIN_DSTATES	8
+#define	DFA_MIN_POOL	64
+#define	DFA_NBUCKETS	1024
+
+#define	DFA_NOSTATE	(-1)
+#define	DFA_UNKNOWN	(-2)
+
+typedef uint32_t dfa_set_t[DFA_SETWORDS];
+
+enum re_type {
+	RE_EMPTY,
+	RE_SET,
+	RE_CAT,
+	RE_ALT,
+	RE_REPEAT,
+};
+
+struct re_node {
+	enum re_type		 type;
+	int			 left;
+	int			 right;
+	int			 min;
+	int			 max;	/* -1 for unbounded */
+	dfa_set_t		 set;
+};
+
+struct re_parser {
+	const char		*pattern;
+	size_t			 len;
+	size_t			 pos;
+	struct re_node		*nodes;
+	size_t			 nnodes;
+	size_t			 nodecap;
+	const char		*error;
+};
+
+enum nfa_type {
+	NFA_SET,
+	NFA_SPLIT,
+	NFA_MATCH,
+};
+
+struct nfa_state {
+	enum nfa_type		 type;
+	int32_t			 out;
+	int32_t			 out1;
+	dfa_set_t		 set;
+};
+
+struct dfa_state {
+	int32_t			 next[DFA_NSYMBOLS];
+	size_t			 setoff;
+	size_t			 setlen;
+	uint32_t		 hash;
+	int32_t			 hnext;
+	bool			 accept;
+};
+
+/*
+ * An NFA along with the lazily-built DFA that simulates it.  The DFA is just a
+ * cache; if it grows too large we throw it away and start over.
+ */
+struct dfa_automaton {
+	struct nfa_state	*nstates;
+	size_t			 nnstates;
+	size_t			 nstatecap;
+	int32_t			 nstart;
+	bool			 anchored;
+
+	struct dfa_state	*dstates;
+	size_t			 ndstates;
+	size_t			 dstatecap;
+	int32_t			 buckets[DFA_NBUCKETS];
+	int32_t			*pool;
+	size_t			 poolsz;
+	size_t			 poolcap;
+
+	/* Scratch space for computing transitions */
+	int32_t			*work;
+	int32_t			*stack;
+	uint32_t		*mark;
+	uint32_t		 gen;
+	uint32_t		 flushes;
+};
+
+struct orch_dfa {
+	struct dfa_automaton	 fwd;
+	struct dfa_automaton	 rev;
+
+	/* Streaming state */
+	const struct orch_matchbuf	*buffer;
+	uint64_t		 base;
+	uint64_t		 start;
+	uint64_t		 scanned;
+	int32_t			 cur;
+	bool			 matched;
+	uint64_t		 mfirst;
+	uint64_t		 mend;
+};
+
+static void
+dfa_set_add(dfa_set_t set, unsigned char ch)
+{
+
+	set[ch / 32] |= 1U << (ch % 32);
+}
+
+static bool
+dfa_set_has(const dfa_set_t set, unsigned char ch)
+{
+
+	return ((set[ch / 32] & (1U << (ch % 32))) != 0);
+}
+
+/*
+ * Parser, producing a tree of re_node.  Nodes are referenced by index since the
+ * array may be reallocated as we go.
+ */
+static int
+re_newnode(struct re_parser *p, enum re_type type)
+{
+	struct re_node *node;
+
+	if (p->nnodes == p->nodecap) {
+		struct re_node *nodes;
+		size_t newcap;
+
+		newcap = MAX(p->nodecap * 2, 16);
+		nodes = realloc(p->nodes, newcap * sizeof(*nodes));
+		if (nodes == NULL) {
+			p->error = "out of memory";
+			return (-1);
+		}
+
+		p->nodes = nodes;
+		p->nodecap = newcap;
+	}
+
+	node = &p->nodes[p->nnodes];
+	memset(node, 0, sizeof(*node));
+	node->type = type;
+	node->left = node->right = -1;
+	return (p->nnodes++);
+}
+
+static int
+re_binary(struct re_parser *p, enum re_type type, int left, int right)
+{
+	int node;
+
+	node = re_newnode(p, type);
+	if (node < 0)
+		return (-1);
+
+	p->nodes[node].left = left;
+	p->nodes[node].right = right;
+	return (node);
+}
+
+static bool
+re_peek(struct re_parser *p, char ch)
+{
+
+	return (p->pos < p->len && p->pattern[p->pos] == ch);
+}
+
+static const struct {
+	const char	*name;
+	int		(*func)(int);
+} re_classes[] = {
+	{ "alnum",	isalnum },
+	{ "alpha",	isalpha },
+	{ "blank",	isblank },
+	{ "cntrl",	iscntrl },
+	{ "digit",	isdigit },
+	{ "graph",	isgraph },
+	{ "lower",	islower },
+	{ "print",	isprint },
+	{ "punct",	ispunct },
+	{ "space",	isspace },
+	{ "upper",	isupper },
+	{ "xdigit",	isxdigit },
+	{ NULL,		NULL },
+};
+
+static int
+re_parse_class(struct re_parser *p, dfa_set_t set)
+{
+	const char *name, *end;
+	size_t namesz;
+
+	/* We're just past the "[:" */
+	name = &p->pattern[p->pos];
+	end = memmem(name, p->len - p->pos, ":]", 2);
+	if (end == NULL) {
+		p->error = "unterminated character class";
+		return (-1);
+	}
+
+	namesz = end - name;
+	for (size_t i = 0; re_classes[i].name != NULL; i++) {
+		if (strlen(re_classes[i].name) != namesz ||
+		    strncmp(re_classes[i].name, name, namesz) != 0)
+			continue;
+
+		for (int ch = 0; ch < DFA_NSYMBOLS; ch++) {
+			if (re_classes[i].func(ch))
+				dfa_set_add(set, ch);
+		}
+
+		p->pos += namesz + 2;
+		return (0);
+	}
+
+	p->error = "invalid character class";
+	return (-1);
+}
+
+static int
+re_parse_bracket(struct re_parser *p)
+{
+	dfa_set_t set = { 0 };
+	bool first = true, negate = false;
+	int node;
+
+	/* We're just past the '[' */
+	if (re_peek(p, '^')) {
+		negate = true;
+		p->pos++;
+	}
+
+	for (;;) {
+		unsigned char lo, hi;
+
+		if (p->pos >= p->len) {
+			p->error = "brackets ([ ]) not balanced";
+			return (-1);
+		}
+
+		lo = p->pattern[p->pos];
+		if (lo == ']' && !first)
+			break;
+
+		first = false;
+		if (lo == '[' && p->pos + 1 < p->len) {
+			char next = p->pattern[p->pos + 1];
+
+			if (next == ':') {
+				p->pos += 2;
+				if (re_parse_class(p, set) != 0)
+					return (-1);
+				continue;
+			} else if (next == '.' || next == '=') {
+				p->error = "collating elements are not supported";
+				return (-1);
+			}
+		}
+
+		p->pos++;
+		hi = lo;
+		if (re_peek(p, '-') && p->pos + 1 < p->len &&
+		    p->pattern[p->pos + 1] != ']') {
+			hi = p->pattern[p->pos + 1];
+			p->pos += 2;
+
+			if (hi < lo) {
+				p->error = "invalid character range";
+				return (-1);
+			}
+		}
+
+		for (int ch = lo; ch <= hi; ch++)
+			dfa_set_add(set, ch);
+	}
+
+	/* Skip the closing ']' */
+	p->pos++;
+
+	node = re_newnode(p, RE_SET);
+	if (node < 0)
+		return (-1);
+
+	for (size_t i = 0; i < DFA_SETWORDS; i++)
+		p->nodes[node].set[i] = negate ? ~set[i] : set[i];
+	return (node);
+}
+
+static int re_parse_alt(struct re_parser *);
+
+static int
+re_parse_atom(struct re_parser *p)
+{
+	unsigned char ch;
+	int node;
+
+	ch = p->pattern[p->pos++];
+	switch (ch) {
+	case '(':
+		node = re_parse_alt(p);
+		if (node < 0)
+			return (-1);
+		if (!re_peek(p, ')')) {
+			p->error = "parentheses not balanced";
+			return (-1);
+		}
+
+		p->pos++;
+		return (node);
+	case '[':
+		return (re_parse_bracket(p));
+	case '.':
+		node = re_newnode(p, RE_SET);
+		if (node < 0)
+			return (-1);
+		memset(p->nodes[node].set, 0xff, sizeof(p->nodes[node].set));
+		return (node);
+	case '^':
+		p->error = "^ is only supported at the beginning of the pattern";
+		return (-1);
+	case '$':
+		p->error = "$ is not supported";
+		return (-1);
+	case '*':
+	case '+':
+	case '?':
+	case '{':
+		p->error = "repetition-operator operand invalid";
+		return (-1);
+	case '\\':
+		if (p->pos >= p->len) {
+			p->error = "trailing backslash (\\)";
+			return (-1);
+		}
+
+		ch = p->pattern[p->pos++];
+		if (isdigit(ch)) {
+			p->error = "back references are not supported";
+			return (-1);
+		}
+		/* FALLTHROUGH */
+	default:
+		node = re_newnode(p, RE_SET);
+		if (node < 0)
+			return (-1);
+		dfa_set_add(p->nodes[node].set, ch);
+		return (node);
+	}
+}
+
+static int
+re_parse_count(struct re_parser *p)
+{
+	int count = 0;
+
+	if (p->pos >= p->len || !isdigit((unsigned char)p->pattern[p->pos]))
+		return (-1);
+
+	while (p->pos < p->len && isdigit((unsigned char)p->pattern[p->pos])) {
+		count = count * 10 + (p->pattern[p->pos++] - '0');
+		if (count > DFA_MAX_REPEAT)
+			return (-1);
+	}
+
+	return (count);
+}
+
+static int
+re_parse_repeat(struct re_parser *p)
+{
+	int min, max, node, repeat;
+
+	node = re_parse_atom(p);
+	while (node >= 0 && p->pos < p->len) {
+		switch (p->pattern[p->pos]) {
+		case '*':
+			min = 0;
+			max = -1;
+			break;
+		case '+':
+			min = 1;
+			max = -1;
+			break;
+		case '?':
+			min = 0;
+			max = 1;
+			break;
+		case '{':
+			p->pos++;
+			min = max = re_parse_count(p);
+			if (min >= 0 && re_peek(p, ',')) {
+				p->pos++;
+				max = -1;
+				if (!re_peek(p, '}'))
+					max = re_parse_count(p);
+				if (max >= 0 && max < min)
+					min = -1;
+			}
+
+			if (min < 0 || !re_peek(p, '}')) {
+				p->error = "invalid repetition count(s)";
+				return (-1);
+			}
+			break;
+		default:
+			return (node);
+		}
+
+		p->pos++;
+
+		repeat = re_newnode(p, RE_REPEAT);
+		if (repeat < 0)
+			return (-1);
+
+		p->nodes[repeat].left = node;
+		p->nodes[repeat].min = min;
+		p->nodes[repeat].max = max;
+		node = repeat;
+	}
+
+	return (node);
+}
+
+static int
+re_parse_cat(struct re_parser *p)
+{
+	int node = -1, rhs;
+
+	while (p->pos < p->len && !re_peek(p, '|') && !re_peek(p, ')')) {
+		rhs = re_parse_repeat(p);
+		if (rhs < 0)
+			return (-1);
+
+		if (node < 0)
+			node = rhs;
+		else
+			node = re_binary(p, RE_CAT, node, rhs);
+		if (node < 0)
+			return (-1);
+	}
+
+	if (node < 0)
+		node = re_newnode(p, RE_EMPTY);
+	return (node);
+}
+
+static int
+re_parse_alt(struct re_parser *p)
+{
+	int node, rhs;
+
+	node = re_parse_cat(p);
+	while (node >= 0 && re_peek(p, '|')) {
+		p->pos++;
+
+		rhs = re_parse_cat(p);
+		if (rhs < 0)
+			return (-1);
+
+		node = re_binary(p, RE_ALT, node, rhs);
+	}
+
+	return (node);
+}
+
+/*
+ * NFA construction.  Each node is compiled with a continuation `next`, the
+ * state to go to once the node has matched, so there's nothing to patch up
+ * later.  Compiling the reversed pattern just swaps the order of concatenation.
+ */
+static int32_t
+nfa_newstate(struct dfa_automaton *dfa, enum nfa_type type, int32_t out,
+    int32_t out1)
+{
+	struct nfa_state *state;
+
+	if (dfa->nnstates == dfa->nstatecap) {
+		struct nfa_state *states;
+		size_t newcap;
+
+		if (dfa->nstatecap >= DFA_MAX_NSTATES)
+			return (DFA_NOSTATE);
+
+		newcap = MAX(dfa->nstatecap * 2, 16);
+		states = realloc(dfa->nstates, newcap * sizeof(*states));
+		if (states == NULL)
+			return (DFA_NOSTATE);
+
+		dfa->nstates = states;
+		dfa->nstatecap = newcap;
+	}
+
+	state = &dfa->nstates[dfa->nnstates];
+	memset(state, 0, sizeof(*state));
+	state->type = type;
+	state->out = out;
+	state->out1 = out1;
+	return (dfa->nnstates++);
+}
+
+static int32_t
+nfa_compile(struct dfa_automaton *dfa, const struct re_node *nodes, int idx,
+    int32_t next, bool reverse)
+{
+	const struct re_node *node = &nodes[idx];
+	int32_t left, right, split;
+
+	if (next == DFA_NOSTATE)
+		return (DFA_NOSTATE);
+
+	switch (node->type) {
+	case RE_EMPTY:
+		return (next);
+	case RE_SET:
+		split = nfa_newstate(dfa, NFA_SET, next, DFA_NOSTATE);
+		if (split != DFA_NOSTATE)
+			memcpy(dfa->nstates[split].set, node->set, sizeof(node->set));
+		return (split);
+	case RE_CAT:
+		if (reverse)
+			return (nfa_compile(dfa, nodes, node->right,
+			    nfa_compile(dfa, nodes, node->left, next, reverse),
+			    reverse));
+		return (nfa_compile(dfa, nodes, node->left,
+		    nfa_compile(dfa, nodes, node->right, next, reverse),
+		    reverse));
+	case RE_ALT:
+		left = nfa_compile(dfa, nodes, node->left, next, reverse);
+		right = nfa_compile(dfa, nodes, node->right, next, reverse);
+		if (left == DFA_NOSTATE || right == DFA_NOSTATE)
+			return (DFA_NOSTATE);
+		return (nfa_newstate(dfa, NFA_SPLIT, left, right));
+	case RE_REPEAT:
+		/* Optional copies beyond the minimum, innermost first. */
+		if (node->max < 0) {
+			split = nfa_newstate(dfa, NFA_SPLIT, DFA_NOSTATE, next);
+			if (split == DFA_NOSTATE)
+				return (DFA_NOSTATE);
+
+			left = nfa_compile(dfa, nodes, node->left, split,
+			    reverse);
+			if (left == DFA_NOSTATE)
+				return (DFA_NOSTATE);
+
+			dfa->nstates[split].out = left;
+			next = split;
+		} else {
+			for (int i = node->min; i < node->max; i++) {
+				left = nfa_compile(dfa, nodes, node->left, next,
+				    reverse);
+				if (left == DFA_NOSTATE)
+					return (DFA_NOSTATE);
+
+				next = nfa_newstate(dfa, NFA_SPLIT, left, next);
+				if (next == DFA_NOSTATE)
+					return (DFA_NOSTATE);
+			}
+		}
+
+		for (int i = 0; i < node->min; i++)
+			next = nfa_compile(dfa, nodes, node->left, next,
+			    reverse);
+		return (next);
+	}
+
+	return (DFA_NOSTATE);
+}
+
+/*
+ * Lazy DFA.  Each DFA state is the set of NFA states (SET and MATCH only) that
+ * we could be in, stored sorted in a shared pool.
+ */
+static void
+dfa_flush(struct dfa_automaton *dfa)
+{
+
+	dfa->ndstates = 0;
+	dfa->poolsz = 0;
+	dfa->flushes++;
+	for (size_t i = 0; i < DFA_NBUCKETS; i++)
+		dfa->buckets[i] = DFA_NOSTATE;
+}
+
+static void
+dfa_addstate(struct dfa_automaton *dfa, int32_t s, size_t *nwork)
+{
+	size_t depth = 0;
+
+	dfa->stack[depth++] = s;
+	while (depth > 0) {
+		s = dfa->stack[--depth];
+		if (s == DFA_NOSTATE || dfa->mark[s] == dfa->gen)
+			continue;
+
+		dfa->mark[s] = dfa->gen;
+		if (dfa->nstates[s].type == NFA_SPLIT) {
+			dfa->stack[depth++] = dfa->nstates[s].out1;
+			dfa->stack[depth++] = dfa->nstates[s].out;
+			continue;
+		}
+
+		dfa->work[(*nwork)++] = s;
+	}
+}
+
+static int
+dfa_cmp(const void *a, const void *b)
+{
+	int32_t lhs = *(const int32_t *)a, rhs = *(const int32_t *)b;
+
+	return ((lhs > rhs) - (lhs < rhs));
+}
+
+/*
+ * Make room for another DFA state with a set of `nwork` NFA states, if we
+ * haven't yet hit our limits.  The cache starts out small, since most patterns
+ * only ever need a handful of states.
+ */
+static bool
+dfa_grow(struct dfa_automaton *dfa, size_t nwork)
+{
+	size_t newcap;
+
+	if (dfa->ndstates == dfa->dstatecap) {
+		struct dfa_state *dstates;
+
+		if (dfa->dstatecap >= DFA_MAX_DSTATES)
+			return (false);
+
+		newcap = MIN(dfa->dstatecap * 2, DFA_MAX_DSTATES);
+		dstates = realloc(dfa->dstates, newcap * sizeof(*dstates));
+		if (dstates == NULL)
+			return (false);
+
+		dfa->dstates = dstates;
+		dfa->dstatecap = newcap;
+	}
+
+	if (dfa->poolcap - dfa->poolsz < nwork) {
+		int32_t *pool;
+
+		newcap = dfa->poolcap;
+		while (newcap - dfa->poolsz < nwork)
+			newcap *= 2;
+		if (newcap > DFA_MAX_POOL)
+			return (false);
+
+		pool = realloc(dfa->pool, newcap * sizeof(*pool));
+		if (pool == NULL)
+			return (false);
+
+		dfa->pool = pool;
+		dfa->poolcap = newcap;
+	}
+
+	return (true);
+}
+
+/*
+ * Look up the DFA state for the set in dfa->work, creating it if need be.  This
+ * may flush the cache, in which case all previously returned states are stale.
+ */
+static int32_t
+dfa_lookup(struct dfa_automaton *dfa, size_t nwork)
+{
+	struct dfa_state *state;
+	uint32_t hash = 2166136261U;
+	int32_t idx;
+
+	qsort(dfa->work, nwork, sizeof(*dfa->work), dfa_cmp);
+	for (size_t i = 0; i < nwork; i++)
+		hash = (hash ^ (uint32_t)dfa->work[i]) * 16777619U;
+
+	for (idx = dfa->buckets[hash % DFA_NBUCKETS]; idx != DFA_NOSTATE;
+	    idx = dfa->dstates[idx].hnext) {
+		state = &dfa->dstates[idx];
+		if (state->hash == hash && state->setlen == nwork &&
+		    memcmp(&dfa->pool[state->setoff], dfa->work,
+		    nwork * sizeof(*dfa->work)) == 0)
+			return (idx);
+	}
+
+	if (!dfa_grow(dfa, nwork))
+		dfa_flush(dfa);
+
+	idx = dfa->ndstates++;
+	state = &dfa->dstates[idx];
+	for (size_t i = 0; i < DFA_NSYMBOLS; i++)
+		state->next[i] = DFA_UNKNOWN;
+	state->setoff = dfa->poolsz;
+	state->setlen = nwork;
+	state->hash = hash;
+	state->accept = false;
+	for (size_t i = 0; i < nwork; i++) {
+		if (dfa->nstates[dfa->work[i]].type == NFA_MATCH)
+			state->accept = true;
+	}
+
+	memcpy(&dfa->pool[dfa->poolsz], dfa->work, nwork * sizeof(*dfa->work));
+	dfa->poolsz += nwork;
+
+	state->hnext = dfa->buckets[hash % DFA_NBUCKETS];
+	dfa->buckets[hash % DFA_NBUCKETS] = idx;
+	return (idx);
+}
+
+static int32_t
+dfa_initial(struct dfa_automaton *dfa)
+{
+	size_t nwork = 0;
+
+	dfa->gen++;
+	dfa_addstate(dfa, dfa->nstart, &nwork);
+	return (dfa_lookup(dfa, nwork));
+}
+
+/*
+ * Returns the state we move to from `cur` on `ch`.  Unless we're anchored, the
+ * start state is always mixed back in so that a match may begin anywhere.
+ */
+static int32_t
+dfa_step(struct dfa_automaton *dfa, int32_t cur, unsigned char ch)
+{
+	const struct dfa_state *state;
+	int32_t next;
+	size_t nwork = 0;
+	uint32_t flushes;
+
+	state = &dfa->dstates[cur];
+	if (state->next[ch] != DFA_UNKNOWN)
+		return (state->next[ch]);
+
+	dfa->gen++;
+	for (size_t i = 0; i < state->setlen; i++) {
+		const struct nfa_state *nstate;
+
+		nstate = &dfa->nstates[dfa->pool[state->setoff + i]];
+		if (nstate->type == NFA_SET && dfa_set_has(nstate->set, ch))
+			dfa_addstate(dfa, nstate->out, &nwork);
+	}
+
+	if (!dfa->anchored)
+		dfa_addstate(dfa, dfa->nstart, &nwork);
+
+	flushes = dfa->flushes;
+	next = dfa_lookup(dfa, nwork);
+
+	/* If we flushed, then `cur` is gone and there's nothing to memoize. */
+	if (dfa->flushes == flushes)
+		dfa->dstates[cur].next[ch] = next;
+	return (next);
+}
+
+static bool
+dfa_dead(const struct dfa_automaton *dfa, int32_t cur)
+{
+
+	return (dfa->dstates[cur].setlen == 0);
+}
+
+static int
+dfa_init(struct dfa_automaton *dfa, const struct re_node *nodes, int root,
+    bool anchored, bool reverse)
+{
+	int32_t match;
+
+	memset(dfa, 0, sizeof(*dfa));
+	dfa->anchored = anchored;
+
+	match = nfa_newstate(dfa, NFA_MATCH, DFA_NOSTATE, DFA_NOSTATE);
+	dfa->nstart = nfa_compile(dfa, nodes, root, match, reverse);
+	if (dfa->nstart == DFA_NOSTATE)
+		return (-1);
+
+	/*
+	 * The pool must at least be able to hold a set of every NFA state, so
+	 * that we can always make progress after a flush.
+	 */
+	dfa->dstatecap = DFA_MIN_DSTATES;
+	dfa->dstates = calloc(dfa->dstatecap, sizeof(*dfa->dstates));
+	dfa->poolcap = MAX(DFA_MIN_POOL, dfa->nnstates);
+	dfa->pool = calloc(dfa->poolcap, sizeof(*dfa->pool));
+	dfa->work = calloc(dfa->nnstates, sizeof(*dfa->work));
+
+	/* Each SPLIT pushes two states, and each is only expanded once. */
+	dfa->stack = calloc(2 * dfa->nnstates + 1, sizeof(*dfa->stack));
+	dfa->mark = calloc(dfa->nnstates, sizeof(*dfa->mark));
+	if (dfa->dstates == NULL || dfa->pool == NULL || dfa->work == NULL ||
+	    dfa->stack == NULL || dfa->mark == NULL)
+		return (-1);
+
+	dfa_flush(dfa);
+	return (0);
+}
+
+static void
+dfa_free(struct dfa_automaton *dfa)
+{
+
+	free(dfa->nstates);
+	free(dfa->dstates);
+	free(dfa->pool);
+	free(dfa->work);
+	free(dfa->stack);
+	free(dfa->mark);
+	memset(dfa, 0, sizeof(*dfa));
+}
+
+static void
+orch_dfa_reset(struct orch_dfa *self, const struct orch_matchbuf *buffer,
+    uint64_t base, uint64_t start)
+{
+
+	self->buffer = buffer;
+	self->base = base;
+	self->start = self->scanned = start;
+	self->cur = dfa_initial(&self->fwd);
+	self->matched = false;
+
+	/* A pattern that can match nothing matches right away. */
+	if (self->fwd.dstates[self->cur].accept) {
+		self->matched = true;
+		self->mfirst = self->mend = start;
+	}
+}
+
+/*
+ * Walk the reversed pattern back from the end of a match to find the leftmost
+ * position that a match ending there could have started at.
+ */
+static uint64_t
+orch_dfa_first(struct orch_dfa *self, const unsigned char *data, uint64_t end)
+{
+	uint64_t first, pos;
+	int32_t cur;
+
+	if (self->fwd.anchored)
+		return (self->start);
+
+	first = end;
+	cur = dfa_initial(&self->rev);
+	for (pos = end; pos > self->start; pos--) {
+		cur = dfa_step(&self->rev, cur, data[pos - 1 - self->base]);
+		if (dfa_dead(&self->rev, cur))
+			break;
+		if (self->rev.dstates[cur].accept)
+			first = pos - 1;
+	}
+
+	return (first);
+}
+
+/*
+ * Scan the rest of `data`, which begins at absolute offset self->base, picking
+ * up from wherever we left off last time.
+ */
+static bool
+orch_dfa_scan(struct orch_dfa *self, const unsigned char *data, size_t len)
+{
+	size_t off;
+	int32_t cur;
+
+	if (self->matched)
+		return (true);
+
+	cur = self->cur;
+	for (off = self->scanned - self->base; off < len; off++) {
+		cur = dfa_step(&self->fwd, cur, data[off]);
+		if (self->fwd.dstates[cur].accept) {
+			self->matched = true;
+			self->mend = self->base + off + 1;
+			self->mfirst = orch_dfa_first(self, data, self->mend);
+			off++;
+			break;
+		}
+
+		/* Only an anchored pattern can die. */
+		if (dfa_dead(&self->fwd, cur)) {
+			off = len;
+			break;
+		}
+	}
+
+	self->scanned = self->base + off;
+	self->cur = cur;
+	return (self->matched);
+}
+
+static int
+orchlua_dfa_push_result(lua_State *L, const struct orch_dfa *self)
+{
+
+	if (!self->matched) {
+		lua_pushnil(L);
+		return (1);
+	}
+
+	lua_pushinteger(L, self->mfirst - self->base + 1);
+	lua_pushinteger(L, self->mend - self->base);
+	return (2);
+}
+
+/*
+ * dfa(pattern) -- compile `pattern` into a streaming matcher.
+ */
+static int
+orchlua_dfa(lua_State *L)
+{
+	struct re_parser parser = { 0 };
+	struct orch_dfa *dfa;
+	const char *error = NULL;
+	int root;
+	bool anchored = false;
+
+	parser.pattern = luaL_checklstring(L, 1, &parser.len);
+	if (re_peek(&parser, '^')) {
+		anchored = true;
+		parser.pos++;
+	}
+
+	root = re_parse_alt(&parser);
+	if (root >= 0 && parser.pos != parser.len) {
+		/* Only a stray ')' stops the top-level parse early. */
+		parser.error = "parentheses not balanced";
+		root = -1;
+	}
+
+	dfa = lua_newuserdata(L, sizeof(*dfa));
+	memset(dfa, 0, sizeof(*dfa));
+	luaL_setmetatable(L, ORCHLUA_DFAHANDLE);
+
+	if (root < 0) {
+		error = parser.error;
+	} else if (dfa_init(&dfa->fwd, parser.nodes, root, anchored,
+	    false) != 0 ||
+	    dfa_init(&dfa->rev, parser.nodes, root, true, true) != 0) {
+		error = "pattern too large";
+	}
+
+	free(parser.nodes);
+	if (error != NULL) {
+		dfa_free(&dfa->fwd);
+		dfa_free(&dfa->rev);
+
+		luaL_pushfail(L);
+		lua_pushstring(L, error);
+		return (2);
+	}
+
+	return (1);
+}
+
+/*
+ * find(subject[, init]) -- find the match that ends earliest in `subject`,
+ * starting at index `init`, and return its first and last indices like
+ * string.find(), or nil if there's no match.  If `subject` is a match buffer,
+ * then we remember how far we got and only scan what's new on the next call,
+ * as long as nothing has been consumed from the buffer in the meantime.
+ */
+static int
+orchlua_dfa_find(lua_State *L)
+{
+	struct orch_dfa *self;
+	struct orch_matchbuf *buffer;
+	const char *data;
+	size_t len, start;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_DFAHANDLE);
+	buffer = luaL_testudata(L, 2, ORCHLUA_MATCHBUFHANDLE);
+	data = orchlua_checksubject(L, 2, &len);
+	start = orchlua_optindex(L, 3, len);
+
+	if (buffer == NULL) {
+		orch_dfa_reset(self, NULL, 0, start);
+	} else if (self->buffer != buffer || self->base != buffer->base ||
+	    self->start != buffer->base + start) {
+		orch_dfa_reset(self, buffer, buffer->base,
+		    buffer->base + start);
+	}
+
+	(void)orch_dfa_scan(self, (const unsigned char *)data, len);
+
+	/* Strings are one-shot. */
+	if (buffer == NULL)
+		self->buffer = NULL;
+	return (orchlua_dfa_push_result(L, self));
+}
+
+static int
+orchlua_dfa_reset(lua_State *L)
+{
+	struct orch_dfa *self;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_DFAHANDLE);
+
+	self->buffer = NULL;
+	return (0);
+}
+
+static int
+orchlua_dfa_close(lua_State *L)
+{
+	struct orch_dfa *self;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_DFAHANDLE);
+
+	dfa_free(&self->fwd);
+	dfa_free(&self->rev);
+	self->buffer = NULL;
+	return (0);
+}
+
+#define	DFA_SIMPLE(n)	{ #n, orchlua_dfa_ ## n }
+static const luaL_Reg orchlua_dfa_methods[] = {
+	DFA_SIMPLE(find),
+	DFA_SIMPLE(reset),
+	{ NULL, NULL },
+};
+
+static const luaL_Reg orchlua_dfa_meta[] = {
+	{ "__index", NULL },	/* Set during registration */
+	{ "__gc", orchlua_dfa_close },
+	{ "__close", orchlua_dfa_close },
+	{ NULL, NULL },
+};
+
+int
+orchlua_setup_dfa(lua_State *L)
+{
+
+	/* Module is on the stack. */
+	lua_pushcfunction(L, orchlua_dfa);
+	lua_setfield(L, -2, "dfa");
+
+	luaL_newmetatable(L, ORCHLUA_DFAHANDLE);
+	luaL_setfuncs(L, orchlua_dfa_meta, 0);
+
+	luaL_newlibtable(L, orchlua_dfa_methods);
+	luaL_setfuncs(L, orchlua_dfa_methods, 0);
+	lua_setfield(L, -2, "__index");
+
+	lua_pop(L, 1);
+
+	return (1);
+}
@@ -0,0 +1,379 @@
+/*-
+ * Copyright (c) 2024 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "orch.h"
+#include "orch_lib.h"
+
+/*
+ * Streaming filters for process output, applied as it's read so that matchers
+ * and the log only ever see the filtered output.  Each stage looks at every
+ * byte once, and carries whatever state it needs across reads so that it
+ * doesn't matter how the output is split up.  A stage may need to hold on to a
+ * few bytes until it knows what follows them, e.g., a CR that might be the
+ * start of a CRLF; those are released by the next read, or at EOF.
+ *
+ * Stages are run one after another between a pair of scratch buffers, each
+ * sized for the most that its stage could produce.
+ */
+#define	UTF8_REPLACEMENT	"\xef\xbf\xbd"	/* U+FFFD */
+#define	UTF8_REPLACEMENTSZ	(sizeof(UTF8_REPLACEMENT) - 1)
+#define	UTF8_MAXHELD		3
+
+enum orch_filter_ansi_state {
+	ANSI_GROUND = 0,
+	ANSI_ESC,		/* After ESC */
+	ANSI_ESC_INTER,		/* ESC, intermediates */
+	ANSI_CSI,		/* ESC [, parameters and intermediates */
+	ANSI_STRING,		/* OSC, DCS, etc., until BEL or ST */
+	ANSI_STRING_ESC,	/* ESC within a string, maybe ST */
+};
+
+struct orch_filter_stage {
+	enum orch_filter_type	 type;
+	union {
+		enum orch_filter_ansi_state	 ansi;
+		bool				 cr;	/* CR held */
+		struct {
+			unsigned char	 held[UTF8_MAXHELD];
+			size_t		 nheld;
+			size_t		 need;	/* Continuation bytes */
+			unsigned char	 lo, hi;	/* Next byte's range */
+		} utf8;
+	};
+};
+
+struct orch_filter {
+	struct orch_filter_stage	 stages[ORCH_FILTER_MAX];
+	size_t				 nstages;
+	char				*scratch[2];
+	size_t				 scratchsz[2];
+};
+
+/*
+ * Drop ECMA-48 escape sequences: CSI sequences (cursor movement, colors, etc.),
+ * strings like OSC (window titles) that run until BEL or ST, and any other
+ * two-byte or intermediate escape.  A CSI interrupted by a control character
+ * is abandoned, and the control character is passed through.
+ */
+static size_t
+orch_filter_ansi(struct orch_filter_stage *stage, const unsigned char *in,
+    size_t len, unsigned char *out)
+{
+	enum orch_filter_ansi_state state;
+	size_t outlen;
+	unsigned char ch;
+
+	state = stage->ansi;
+	outlen = 0;
+	for (size_t i = 0; i < len; i++) {
+		ch = in[i];
+
+		switch (state) {
+		case ANSI_GROUND:
+			if (ch == '\033')
+				state = ANSI_ESC;
+			else
+				out[outlen++] = ch;
+			break;
+		case ANSI_ESC:
+			if (ch == '[') {
+				state = ANSI_CSI;
+			} else if (ch == ']' || ch == 'P' || ch == 'X' ||
+			    ch == '^' || ch == '_') {
+				state = ANSI_STRING;
+			} else if (ch >= 0x20 && ch <= 0x2f) {
+				state = ANSI_ESC_INTER;
+			} else if (ch >= 0x30 && ch <= 0x7e) {
+				state = ANSI_GROUND;
+			} else if (ch != '\033') {
+				state = ANSI_GROUND;
+				out[outlen++] = ch;
+			}
+			break;
+		case ANSI_ESC_INTER:
+			if (ch >= 0x30 && ch <= 0x7e) {
+				state = ANSI_GROUND;
+			} else if (ch < 0x20 || ch > 0x2f) {
+				state = ANSI_GROUND;
+				out[outlen++] = ch;
+			}
+			break;
+		case ANSI_CSI:
+			if (ch >= 0x40 && ch <= 0x7e) {
+				state = ANSI_GROUND;
+			} else if (ch < 0x20 || ch > 0x3f) {
+				state = ch == '\033' ? ANSI_ESC : ANSI_GROUND;
+				if (state == ANSI_GROUND)
+					out[outlen++] = ch;
+			}
+			break;
+		case ANSI_STRING:
+			if (ch == '\a')
+				state = ANSI_GROUND;
+			else if (ch == '\033')
+				state = ANSI_STRING_ESC;
+			break;
+		case ANSI_STRING_ESC:
+			if (ch == '\\')
+				state = ANSI_GROUND;
+			else if (ch != '\033')
+				state = ANSI_STRING;
+			break;
+		}
+	}
+
+	stage->ansi = state;
+	return (outlen);
+}
+
+/*
+ * Translate CRLF to LF; a CR on its own is left alone, but one at the end of
+ * the input has to wait to see what comes next.
+ */
+static size_t
+orch_filter_crlf(struct orch_filter_stage *stage, const unsigned char *in,
+    size_t len, unsigned char *out, bool flush)
+{
+	size_t outlen;
+	bool cr;
+
+	cr = stage->cr;
+	outlen = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (cr && in[i] != '\n')
+			out[outlen++] = '\r';
+
+		cr = in[i] == '\r';
+		if (!cr)
+			out[outlen++] = in[i];
+	}
+
+	if (cr && flush) {
+		out[outlen++] = '\r';
+		cr = false;
+	}
+
+	stage->cr = cr;
+	return (outlen);
+}
+
+static size_t
+orch_filter_nul(const unsigned char *in, size_t len, unsigned char *out)
+{
+	size_t outlen;
+
+	outlen = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (in[i] != '\0')
+			out[outlen++] = in[i];
+	}
+
+	return (outlen);
+}
+
+static size_t
+orch_filter_utf8_invalid(struct orch_filter_stage *stage, unsigned char *out)
+{
+
+	stage->utf8.nheld = stage->utf8.need = 0;
+	memcpy(out, UTF8_REPLACEMENT, UTF8_REPLACEMENTSZ);
+	return (UTF8_REPLACEMENTSZ);
+}
+
+/*
+ * Replace anything that isn't well-formed UTF-8 with U+FFFD, one for each
+ * maximal ill-formed subsequence as Unicode recommends: overlong forms,
+ * surrogates and anything past U+10FFFF are all rejected.  An incomplete
+ * sequence is held until it's either completed or broken.
+ */
+static size_t
+orch_filter_utf8(struct orch_filter_stage *stage, const unsigned char *in,
+    size_t len, unsigned char *out, bool flush)
+{
+	size_t i, outlen;
+	unsigned char ch;
+
+	outlen = 0;
+	for (i = 0; i < len; i++) {
+		ch = in[i];
+
+		if (stage->utf8.need != 0) {
+			if (ch >= stage->utf8.lo && ch <= stage->utf8.hi) {
+				stage->utf8.lo = 0x80;
+				stage->utf8.hi = 0xbf;
+				if (--stage->utf8.need != 0) {
+					stage->utf8.held[stage->utf8.nheld++] =
+					    ch;
+					continue;
+				}
+
+				memcpy(&out[outlen], stage->utf8.held,
+				    stage->utf8.nheld);
+				outlen += stage->utf8.nheld;
+				out[outlen++] = ch;
+				stage->utf8.nheld = 0;
+				continue;
+			}
+
+			/* Broken off; this byte gets a fresh start below. */
+			outlen += orch_filter_utf8_invalid(stage, &out[outlen]);
+		}
+
+		stage->utf8.lo = 0x80;
+		stage->utf8.hi = 0xbf;
+		if (ch < 0x80) {
+			out[outlen++] = ch;
+			continue;
+		} else if (ch >= 0xc2 && ch <= 0xdf) {
+			stage->utf8.need = 1;
+		} else if (ch >= 0xe0 && ch <= 0xef) {
+			stage->utf8.need = 2;
+			if (ch == 0xe0)
+				stage->utf8.lo = 0xa0;	/* Overlong */
+			else if (ch == 0xed)
+				stage->utf8.hi = 0x9f;	/* Surrogates */
+		} else if (ch >= 0xf0 && ch <= 0xf4) {
+			stage->utf8.need = 3;
+			if (ch == 0xf0)
+				stage->utf8.lo = 0x90;	/* Overlong */
+			else if (ch == 0xf4)
+				stage->utf8.hi = 0x8f;	/* > U+10FFFF */
+		} else {
+			outlen += orch_filter_utf8_invalid(stage, &out[outlen]);
+			continue;
+		}
+
+		stage->utf8.held[stage->utf8.nheld++] = ch;
+	}
+
+	if (flush && stage->utf8.need != 0)
+		outlen += orch_filter_utf8_invalid(stage, &out[outlen]);
+
+	return (outlen);
+}
+
+/* The most that a stage could produce from `len` bytes of input. */
+static size_t
+orch_filter_bound(const struct orch_filter_stage *stage, size_t len)
+{
+
+	switch (stage->type) {
+	case ORCH_FILTER_CRLF:
+		return (len + 1);
+	case ORCH_FILTER_UTF8:
+		return ((len + UTF8_MAXHELD) * UTF8_REPLACEMENTSZ);
+	default:
+		return (len);
+	}
+}
+
+struct orch_filter *
+orch_filter_alloc(const enum orch_filter_type *types, size_t ntypes)
+{
+	struct orch_filter *filter;
+
+	if (ntypes > ORCH_FILTER_MAX) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	filter = calloc(1, sizeof(*filter));
+	if (filter == NULL)
+		return (NULL);
+
+	for (size_t i = 0; i < ntypes; i++)
+		filter->stages[i].type = types[i];
+	filter->nstages = ntypes;
+	return (filter);
+}
+
+void
+orch_filter_free(struct orch_filter *filter)
+{
+
+	if (filter == NULL)
+		return;
+
+	free(filter->scratch[0]);
+	free(filter->scratch[1]);
+	free(filter);
+}
+
+static int
+orch_filter_reserve(struct orch_filter *filter, int which, size_t need)
+{
+	char *scratch;
+
+	if (filter->scratchsz[which] >= need)
+		return (0);
+
+	scratch = realloc(filter->scratch[which], need);
+	if (scratch == NULL)
+		return (-1);
+
+	filter->scratch[which] = scratch;
+	filter->scratchsz[which] = need;
+	return (0);
+}
+
+/*
+ * Run `len` bytes of output through the filter, and point `*outp` at the
+ * result.  The result is only valid until the next call.  If `flush` is set,
+ * then there's no more output coming and anything held is released.
+ */
+ssize_t
+orch_filter_run(struct orch_filter *filter, const char *data, size_t len,
+    bool flush, const char **outp)
+{
+	struct orch_filter_stage *stage;
+	const unsigned char *in;
+	unsigned char *out;
+	size_t outlen;
+	int which;
+
+	in = (const unsigned char *)data;
+	which = 0;
+	for (size_t i = 0; i < filter->nstages; i++, which ^= 1) {
+		stage = &filter->stages[i];
+
+		if (orch_filter_reserve(filter, which,
+		    MAX(orch_filter_bound(stage, len), 1)) != 0)
+			return (-1);
+
+		out = (unsigned char *)filter->scratch[which];
+		switch (stage->type) {
+		case ORCH_FILTER_ANSI:
+			outlen = orch_filter_ansi(stage, in, len, out);
+			break;
+		case ORCH_FILTER_CRLF:
+			outlen = orch_filter_crlf(stage, in, len, out, flush);
+			break;
+		case ORCH_FILTER_NUL:
+			outlen = orch_filter_nul(in, len, out);
+			break;
+		case ORCH_FILTER_UTF8:
+			outlen = orch_filter_utf8(stage, in, len, out, flush);
+			break;
+		default:
+			outlen = 0;
+			assert(0);
+		}
+
+		assert(outlen <= orch_filter_bound(stage, len));
+		in = out;
+		len = outlen;
+	}
+
+	*outp = (const char *)in;
+	return (len);
+}
@@ -4,11 +4,12 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
-#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -24,6 +25,8 @@ struct orch_ipc_header {
 struct orch_ipc_msg {
 	struct orch_ipc_header		 hdr;
 	/* Non-wire contents between hdr and data */
+	struct orch_ipc_msg		*next;	/* Receive queue / freelist */
+	size_t				 cap;	/* Allocated payload size */
 	_Alignas(max_align_t) unsigned char	 data[];
 };
 
@@ -41,10 +44,29 @@ struct orch_ipc_msg {
 #define	IPC_MSG_PAYLOAD_SIZE(msg)	\
 	((msg)->hdr.size - sizeof(msg->hdr))
 
-struct orch_ipc_msgq {
-	struct orch_ipc_msg	*msg;
-	struct orch_ipc_msgq	*next;
-};
+/*
+ * Almost everything that we send is either empty or a struct termios, so
+ * messages with payloads up to IPC_MSG_POOLSZ are allocated at that size and
+ * recycled through a small freelist rather than going back to the allocator.
+ */
+#define	IPC_MSG_POOLSZ		256
+#define	IPC_MSG_POOLMAX		8
+
+/* Initial size of the per-handle receive buffer; grown for larger frames. */
+#define	IPC_RBUF_SIZE		4096
+
+/*
+ * The largest payload that we'll send or accept.  Nothing legitimate comes
+ * anywhere close, and the size comes from our peer, so we don't want to grow
+ * the receive buffer for whatever it claims.
+ */
+#define	IPC_MSG_MAX		(64 * 1024)
+
+/*
+ * How long a send may go without making any progress before we give up on the
+ * peer, in seconds.
+ */
+#define	IPC_SEND_TIMEOUT	60
 
 struct orch_ipc_register {
 	orch_ipc_handler	*handler;
@@ -53,14 +75,22 @@ struct orch_ipc_register {
 
 struct orch_ipc {
 	struct orch_ipc_register	 callbacks[IPC_LAST - 1];
-	struct orch_ipc_msgq		*head;
-	struct orch_ipc_msgq		*tail;
+	struct orch_ipc_msg		*head;
+	struct orch_ipc_msg		*tail;
+	unsigned char			*rbuf;
+	size_t				 rhead;
+	size_t				 rtail;
+	size_t				 rcap;
 	int				 sockfd;
 };
 
-static int orch_ipc_drain(orch_ipc_t);
+static struct orch_ipc_msg *orch_ipc_msg_freelist;
+static size_t orch_ipc_msg_nfree;
+
+static int orch_ipc_drain(orch_ipc_t, bool);
 static int orch_ipc_pop(orch_ipc_t, struct orch_ipc_msg **);
 static int orch_ipc_poll(orch_ipc_t, bool *);
+static int orch_ipc_sendwait(orch_ipc_t, const struct timespec *);
 
 int
 orch_ipc_close(orch_ipc_t ipc)
@@ -82,7 +112,7 @@ orch_ipc_close(orch_ipc_t ipc)
 		while (ipc->sockfd != -1 && error == 0) {
 			orch_ipc_wait(ipc, NULL);
 
-			error = orch_ipc_drain(ipc);
+			error = orch_ipc_drain(ipc, false);
 		}
 
 		if (ipc->sockfd != -1) {
@@ -98,11 +128,19 @@ orch_ipc_close(orch_ipc_t ipc)
 	error = orch_ipc_pop(ipc, NULL);
 	assert(ipc->head == NULL);
 
+	free(ipc->rbuf);
 	free(ipc);
 
 	return (error);
 }
 
+int
+orch_ipc_fd(orch_ipc_t ipc)
+{
+
+	return (ipc->sockfd);
+}
+
 orch_ipc_t
 orch_ipc_open(int fd)
 {
@@ -114,6 +152,8 @@ orch_ipc_open(int fd)
 
 	memset(&hdl->callbacks[0], 0, sizeof(hdl->callbacks));
 	hdl->head = hdl->tail = NULL;
+	hdl->rbuf = NULL;
+	hdl->rhead = hdl->rtail = hdl->rcap = 0;
 	hdl->sockfd = fd;
 	return (hdl);
 }
@@ -125,25 +165,61 @@ orch_ipc_okay(orch_ipc_t ipc)
 	return (ipc->sockfd >= 0);
 }
 
+/*
+ * Grab a message with room for at least `payloadsz` bytes of payload, either
+ * from the freelist or freshly allocated.  The header and payload are left for
+ * the caller to fill in.
+ */
+static struct orch_ipc_msg *
+orch_ipc_msg_get(size_t payloadsz)
+{
+	struct orch_ipc_msg *msg;
+	size_t cap;
+
+	if (payloadsz <= IPC_MSG_POOLSZ && orch_ipc_msg_freelist != NULL) {
+		msg = orch_ipc_msg_freelist;
+		orch_ipc_msg_freelist = msg->next;
+		orch_ipc_msg_nfree--;
+
+		msg->next = NULL;
+		return (msg);
+	}
+
+	cap = payloadsz <= IPC_MSG_POOLSZ ? IPC_MSG_POOLSZ : payloadsz;
+	msg = malloc(IPC_MSG_SIZE(cap));
+	if (msg == NULL)
+		return (NULL);
+
+	msg->next = NULL;
+	msg->cap = cap;
+	return (msg);
+}
+
 struct orch_ipc_msg *
 orch_ipc_msg_alloc(enum orch_ipc_tag tag, size_t payloadsz, void **payload)
 {
 	struct orch_ipc_msg *msg;
-	size_t msgsz;
 
 	assert(payloadsz >= 0);
 	assert(payloadsz == 0 || payload != NULL);
 	assert(tag != IPC_NOXMIT);
 
-	msg = calloc(1, IPC_MSG_SIZE(payloadsz));
+	if (payloadsz > IPC_MSG_MAX) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	msg = orch_ipc_msg_get(payloadsz);
 	if (msg == NULL)
 		return (NULL);
 
 	msg->hdr.tag = tag;
 	msg->hdr.size = IPC_MSG_HDR_SIZE(payloadsz);
 
-	if (payloadsz != 0)
-		*payload = msg + 1;
+	if (payloadsz != 0) {
+		memset(&msg->data[0], 0, payloadsz);
+		*payload = &msg->data[0];
+	}
 
 	return (msg);
 }
@@ -161,7 +237,7 @@ orch_ipc_msg_payload(struct orch_ipc_msg *msg, size_t *odatasz)
 		*odatasz = datasz;
 	if (datasz == 0)
 		return (NULL);
-	return (msg + 1);
+	return (&msg->data[0]);
 }
 
 enum orch_ipc_tag
@@ -175,98 +251,168 @@ void
 orch_ipc_msg_free(struct orch_ipc_msg *msg)
 {
 
-	free(msg);
+	if (msg == NULL)
+		return;
+
+	if (msg->cap != IPC_MSG_POOLSZ ||
+	    orch_ipc_msg_nfree >= IPC_MSG_POOLMAX) {
+		free(msg);
+		return;
+	}
+
+	msg->next = orch_ipc_msg_freelist;
+	orch_ipc_msg_freelist = msg;
+	orch_ipc_msg_nfree++;
 }
 
+/*
+ * Make room for at least `need` more bytes at the tail of the receive buffer.
+ */
 static int
-orch_ipc_drain(orch_ipc_t ipc)
+orch_ipc_rbuf_reserve(orch_ipc_t ipc, size_t need)
 {
-	struct orch_ipc_header hdr;
-	struct orch_ipc_msg *msg;
-	struct orch_ipc_msgq *msgq;
-	ssize_t readsz;
-	size_t off, resid;
+	unsigned char *newbuf;
+	size_t len, newcap;
+
+	len = ipc->rtail - ipc->rhead;
+	if (ipc->rhead != 0) {
+		memmove(ipc->rbuf, &ipc->rbuf[ipc->rhead], len);
+		ipc->rhead = 0;
+		ipc->rtail = len;
+	}
 
-	if (!orch_ipc_okay(ipc))
+	if (ipc->rcap - len >= need)
 		return (0);
 
+	newcap = ipc->rcap == 0 ? IPC_RBUF_SIZE : ipc->rcap;
+	while (newcap - len < need)
+		newcap *= 2;
+
+	newbuf = realloc(ipc->rbuf, newcap);
+	if (newbuf == NULL)
+		return (-1);
+
+	ipc->rbuf = newbuf;
+	ipc->rcap = newcap;
+	return (0);
+}
+
+/*
+ * Carve as many complete frames as we can out of the receive buffer and queue
+ * them up.  `oneed` is set to the number of bytes that we still need to
+ * complete the current frame, or 0 if we're at a frame boundary.
+ */
+static int
+orch_ipc_parse(orch_ipc_t ipc, size_t *oneed)
+{
+	struct orch_ipc_header hdr;
+	struct orch_ipc_msg *msg;
+	size_t avail, payloadsz;
+
 	for (;;) {
-		readsz = read(ipc->sockfd, &hdr, sizeof(hdr));
-		if (readsz == -1) {
-			if (errno == EAGAIN)
-				break;
-			return (-1);
-		} else if (readsz == 0) {
-			goto eof;
+		avail = ipc->rtail - ipc->rhead;
+		if (avail < sizeof(hdr)) {
+			*oneed = avail == 0 ? 0 : sizeof(hdr) - avail;
+			break;
 		}
 
+		memcpy(&hdr, &ipc->rbuf[ipc->rhead], sizeof(hdr));
+
 		/*
 		 * We might have an empty payload, but we should never have less
-		 * than a header's worth of data.
+		 * than a header's worth of data, nor more than we're willing to
+		 * buffer for it.
 		 */
-		if (hdr.size < sizeof(hdr) || hdr.tag == IPC_NOXMIT) {
+		if (hdr.size < sizeof(hdr) ||
+		    hdr.size > IPC_MSG_HDR_SIZE(IPC_MSG_MAX) ||
+		    hdr.tag == IPC_NOXMIT || hdr.tag >= IPC_LAST) {
 			errno = EINVAL;
 			return (-1);
 		}
 
-		msg = malloc(IPC_MSG_SIZE(hdr.size));
+		if (avail < hdr.size) {
+			*oneed = hdr.size - avail;
+			break;
+		}
+
+		payloadsz = hdr.size - sizeof(hdr);
+		msg = orch_ipc_msg_get(payloadsz);
 		if (msg == NULL)
 			return (-1);
 
-		msgq = malloc(sizeof(*msgq));
-		if (msgq == NULL) {
-			free(msg);
-			errno = ENOMEM;
-			return (-1);
-		}
+		msg->hdr = hdr;
+		memcpy(&msg->data[0], &ipc->rbuf[ipc->rhead + sizeof(hdr)],
+		    payloadsz);
+		ipc->rhead += hdr.size;
 
-		msgq->msg = msg;
-		msgq->next = NULL;
+		if (ipc->head == NULL) {
+			ipc->head = ipc->tail = msg;
+		} else {
+			ipc->tail->next = msg;
+			ipc->tail = msg;
+		}
+	}
 
-		msg->hdr = hdr;
+	/* Cheap to reset when we've consumed everything. */
+	if (ipc->rhead == ipc->rtail)
+		ipc->rhead = ipc->rtail = 0;
 
-		off = 0;
-		resid = IPC_MSG_PAYLOAD_SIZE(msg);
+	return (0);
+}
 
-		while (resid != 0) {
-			readsz = read(ipc->sockfd, &msg->data[off], resid);
-			if (readsz == -1) {
-				if (errno != EAGAIN) {
-					free(msg);
-					return (-1);
-				}
+/*
+ * Read everything that's available into the receive buffer and queue up any
+ * complete frames.  A frame too large for the socket buffer arrives in pieces,
+ * and any partial frame is left in the buffer for the next drain to complete.
+ * If `wholeframe` is set, then we'll instead wait for the rest of it to arrive;
+ * that's only safe when we aren't trying to send, since the peer may be blocked
+ * sending to us until we've read something from it, and vice versa.
+ */
+static int
+orch_ipc_drain(orch_ipc_t ipc, bool wholeframe)
+{
+	ssize_t readsz;
+	size_t need;
 
-				if (orch_ipc_poll(ipc, NULL) == -1) {
-					free(msg);
-					return (-1);
-				}
+	if (!orch_ipc_okay(ipc))
+		return (0);
 
-				continue;
-			} else if (readsz == 0) {
-				free(msg);
-				msg = NULL;
+	/* We may already be partway through a frame. */
+	if (orch_ipc_parse(ipc, &need) != 0)
+		return (-1);
 
-				goto eof;
-			}
+	for (;;) {
+		if (orch_ipc_rbuf_reserve(ipc, need != 0 ? need : 1) != 0)
+			return (-1);
 
-			off += readsz;
-			resid -= readsz;
-		}
+		readsz = read(ipc->sockfd, &ipc->rbuf[ipc->rtail],
+		    ipc->rcap - ipc->rtail);
+		if (readsz == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				return (-1);
+			if (need == 0 || !wholeframe)
+				break;
 
-		if (ipc->head == NULL) {
-			ipc->head = ipc->tail = msgq;
-		} else {
-			ipc->tail->next = msgq;
-			ipc->tail = msgq;
+			if (orch_ipc_poll(ipc, NULL) == -1)
+				return (-1);
+			continue;
+		} else if (readsz == 0) {
+			goto eof;
 		}
 
-		msg = NULL;
-		msgq = NULL;
+		ipc->rtail += readsz;
+		if (orch_ipc_parse(ipc, &need) != 0)
+			return (-1);
 	}
 
 	return (0);
 eof:
 
+	/* Any partial frame left over is unusable. */
+	ipc->rhead = ipc->rtail = 0;
+
 	assert(ipc->sockfd >= 0);
 	close(ipc->sockfd);
 	ipc->sockfd = -1;
@@ -278,21 +424,17 @@ static int
 orch_ipc_pop(orch_ipc_t ipc, struct orch_ipc_msg **omsg)
 {
 	struct orch_ipc_register *reg;
-	struct orch_ipc_msgq *msgq;
 	struct orch_ipc_msg *msg;
 	int error;
 
 	error = 0;
 	while (ipc->head != NULL) {
 		/* Dequeue a msg */
-		msgq = ipc->head;
-		ipc->head = ipc->head->next;
-
-		/* Free the container */
-		msg = msgq->msg;
-
-		free(msgq);
-		msgq = NULL;
+		msg = ipc->head;
+		ipc->head = msg->next;
+		if (ipc->head == NULL)
+			ipc->tail = NULL;
+		msg->next = NULL;
 
 		/* Do we have a handler for it? */
 		reg = &ipc->callbacks[msg->hdr.tag - 1];
@@ -303,7 +445,7 @@ orch_ipc_pop(orch_ipc_t ipc, struct orch_ipc_msg **omsg)
 			if (error != 0)
 				serr = errno;
 
-			free(msg);
+			orch_ipc_msg_free(msg);
 			msg = NULL;
 
 			if (error != 0) {
@@ -324,7 +466,7 @@ orch_ipc_pop(orch_ipc_t ipc, struct orch_ipc_msg **omsg)
 		 * an omsg, we're just draining so we'll free the msg here.
 		 */
 		if (omsg == NULL) {
-			free(msg);
+			orch_ipc_msg_free(msg);
 			msg = NULL;
 
 			continue;
@@ -343,7 +485,7 @@ orch_ipc_recv(orch_ipc_t ipc, struct orch_ipc_msg **omsg)
 	struct orch_ipc_msg *rcvmsg;
 	int error;
 
-	if (orch_ipc_drain(ipc) != 0)
+	if (orch_ipc_drain(ipc, true) != 0)
 		return (-1);
 
 	rcvmsg = NULL;
@@ -364,38 +506,64 @@ orch_ipc_register(orch_ipc_t ipc, enum orch_ipc_tag tag,
 	return (0);
 }
 
+/*
+ * Frames go out with a single writev(2) so that the receiving side will almost
+ * always see them whole.  If the socket is full, we wait for it to drain rather
+ * than spinning, and keep accepting the peer's messages in the meantime in case
+ * it's blocked trying to send to us.  Those may be partial frames, too, which
+ * we just hold on to rather than waiting on the rest while the peer waits on
+ * us.
+ */
 int
 orch_ipc_send(orch_ipc_t ipc, struct orch_ipc_msg *msg)
 {
+	struct timespec deadline;
+	struct iovec iov[2], *iovp;
 	ssize_t writesz;
-	size_t off, resid;
+	int iovcnt;
 
-retry:
-	if (orch_ipc_drain(ipc) != 0)
+	if (orch_ipc_drain(ipc, false) != 0)
 		return (-1);
 
-	writesz = write(ipc->sockfd, &msg->hdr, sizeof(msg->hdr));
-	if (writesz == -1) {
-		if (errno != EAGAIN)
+	iov[0].iov_base = &msg->hdr;
+	iov[0].iov_len = sizeof(msg->hdr);
+	iov[1].iov_base = &msg->data[0];
+	iov[1].iov_len = IPC_MSG_PAYLOAD_SIZE(msg);
+
+	iovp = &iov[0];
+	iovcnt = iov[1].iov_len != 0 ? 2 : 1;
+	orch_deadline_init(&deadline, IPC_SEND_TIMEOUT);
+	while (iovcnt != 0) {
+		if (!orch_ipc_okay(ipc)) {
+			errno = EPIPE;
 			return (-1);
-		goto retry;
-	} else if ((size_t)writesz < sizeof(msg->hdr)) {
-		errno = EIO;
-		return (-1);
-	}
+		}
 
-	off = 0;
-	resid = IPC_MSG_PAYLOAD_SIZE(msg);
-	while (resid != 0) {
-		writesz = write(ipc->sockfd, &msg->data[off], resid);
+		writesz = writev(ipc->sockfd, iovp, iovcnt);
 		if (writesz == -1) {
+			if (errno == EINTR)
+				continue;
 			if (errno != EAGAIN)
 				return (-1);
+			if (orch_ipc_sendwait(ipc, &deadline) != 0)
+				return (-1);
 			continue;
 		}
 
-		off += writesz;
-		resid -= writesz;
+		/* Any progress at all resets the clock. */
+		orch_deadline_init(&deadline, IPC_SEND_TIMEOUT);
+
+		/* Advance past whatever made it out. */
+		while (iovcnt != 0 && (size_t)writesz >= iovp->iov_len) {
+			writesz -= iovp->iov_len;
+			iovp++;
+			iovcnt--;
+		}
+
+		if (iovcnt != 0) {
+			iovp->iov_base = (char *)iovp->iov_base + writesz;
+			iovp->iov_len -= writesz;
+		}
 	}
 
 	return (0);
@@ -412,16 +580,55 @@ orch_ipc_send_nodata(orch_ipc_t ipc, enum orch_ipc_tag tag)
 	return (orch_ipc_send(ipc, &msg));
 }
 
+/*
+ * Wait for the socket to become writable again, draining anything that the peer
+ * sends us while we wait.
+ */
+static int
+orch_ipc_sendwait(orch_ipc_t ipc, const struct timespec *deadline)
+{
+	struct pollfd pfd;
+	int ret;
+
+	for (;;) {
+		pfd.fd = ipc->sockfd;
+		pfd.events = POLLIN | POLLOUT;
+		pfd.revents = 0;
+
+		ret = poll(&pfd, 1, orch_deadline_poll_ms(deadline));
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		} else if (ret == 0) {
+			errno = ETIMEDOUT;
+			return (-1);
+		}
+
+		if ((pfd.revents & (POLLIN | POLLHUP)) != 0) {
+			if (orch_ipc_drain(ipc, false) != 0)
+				return (-1);
+			if (!orch_ipc_okay(ipc)) {
+				errno = EPIPE;
+				return (-1);
+			}
+		}
+
+		/* Errors will be picked up by the next write. */
+		if ((pfd.revents & (POLLOUT | POLLERR | POLLNVAL)) != 0)
+			return (0);
+	}
+}
+
 static int
 orch_ipc_poll(orch_ipc_t ipc, bool *eof_seen)
 {
-	fd_set rfd;
+	struct pollfd pfd;
 	int error;
 
 	if (eof_seen != NULL)
 		*eof_seen = false;
 
-	FD_ZERO(&rfd);
 	do {
 		if (ipc->sockfd == -1) {
 			if (eof_seen != NULL)
@@ -429,9 +636,11 @@ orch_ipc_poll(orch_ipc_t ipc, bool *eof_seen)
 			return (0);
 		}
 
-		FD_SET(ipc->sockfd, &rfd);
+		pfd.fd = ipc->sockfd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
 
-		error = select(ipc->sockfd + 1, &rfd, NULL, NULL, NULL);
+		error = poll(&pfd, 1, -1);
 	} while (error == -1 && errno == EINTR);
 
 	return (error);
@@ -0,0 +1,152 @@
+/*-
+ * Copyright (c) 2024 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "orch.h"
+#include "orch_lib.h"
+
+/*
+ * A process's transcript is written out from here as it's read into the match
+ * buffer (and as input is written to the process), so the log never needs the
+ * data to be turned into a Lua string.  Writes are buffered according to the
+ * flush policy; chunks at least as large as the buffer skip it and are written
+ * directly once whatever is buffered ahead of them has been flushed.
+ *
+ * Write errors are sticky: we stop logging at the first one, and report it from
+ * any subsequent flush.
+ */
+struct orch_log {
+	char			*buf;
+	size_t			 len;
+	size_t			 cap;
+	enum orch_log_flush	 flush;
+	int			 fd;
+	int			 error;
+};
+
+struct orch_log *
+orch_log_open(int fd, enum orch_log_flush flush, size_t bufsz)
+{
+	struct orch_log *log;
+
+	log = calloc(1, sizeof(*log));
+	if (log == NULL)
+		return (NULL);
+
+	if (flush != ORCH_LOG_ALWAYS && bufsz != 0) {
+		log->buf = malloc(bufsz);
+		if (log->buf == NULL) {
+			free(log);
+			return (NULL);
+		}
+
+		log->cap = bufsz;
+	}
+
+	log->flush = flush;
+	log->fd = fd;
+	return (log);
+}
+
+static int
+orch_log_writeall(struct orch_log *log, const char *data, size_t len)
+{
+	ssize_t wsz;
+
+	while (len != 0) {
+		wsz = write(log->fd, data, len);
+		if (wsz == -1 && errno == EINTR)
+			continue;
+		if (wsz == -1) {
+			log->error = errno;
+			return (-1);
+		}
+
+		data += wsz;
+		len -= wsz;
+	}
+
+	return (0);
+}
+
+int
+orch_log_write(struct orch_log *log, const char *data, size_t len)
+{
+
+	if (log->error != 0) {
+		errno = log->error;
+		return (-1);
+	} else if (len == 0) {
+		return (0);
+	}
+
+	if (len > log->cap - log->len) {
+		if (orch_log_flush(log) != 0)
+			return (-1);
+		if (len >= log->cap)
+			return (orch_log_writeall(log, data, len));
+	}
+
+	memcpy(&log->buf[log->len], data, len);
+	log->len += len;
+	return (0);
+}
+
+int
+orch_log_flush(struct orch_log *log)
+{
+	size_t len;
+
+	if (log->error != 0) {
+		errno = log->error;
+		return (-1);
+	}
+
+	len = log->len;
+	log->len = 0;
+	return (orch_log_writeall(log, log->buf, len));
+}
+
+/*
+ * Called whenever control goes back to the script, for the "batch" policy.
+ */
+int
+orch_log_sync(struct orch_log *log)
+{
+
+	if (log->flush != ORCH_LOG_BATCH)
+		return (0);
+	return (orch_log_flush(log));
+}
+
+/*
+ * Flush and close the log, returning the first error that we encountered with
+ * it, if any.
+ */
+int
+orch_log_close(struct orch_log *log)
+{
+	int error;
+
+	error = 0;
+	if (orch_log_flush(log) != 0)
+		error = errno;
+
+	close(log->fd);
+	free(log->buf);
+	free(log);
+
+	if (error != 0) {
+		errno = error;
+		return (-1);
+	}
+
+	return (0);
+}
@@ -5,7 +5,6 @@
  */
 
 #include <sys/param.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/wait.h>
@@ -14,7 +13,9 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -26,21 +27,11 @@
 #include "orch.h"
 #include "orch_lib.h"
 
-#ifdef __linux__
-#define	CLOCK_REALTIME_FAST	CLOCK_REALTIME_COARSE
-#endif
-
-/* Fallback */
-#ifndef CLOCK_REALTIME_FAST
-#define	CLOCK_REALTIME_FAST	CLOCK_REALTIME
-#endif
-
 /* Not a huge deal if it's missing... */
 #ifndef O_PATH
 #define	O_PATH	0
 #endif
 
-#define	ORCHLUA_PROCESSHANDLE	"orchlua_process"
 #define	ORCHLUA_REGEXHANDLE	"orchlua_regex_t"
 
 static struct orchlua_cfg {
@@ -52,6 +43,7 @@ static struct orchlua_cfg {
 };
 
 static int orchlua_add_execpath(const char *);
+static int orchlua_close_all(lua_State *);
 
 /*
  * Not exported
@@ -251,14 +243,15 @@ orchlua_sleep(lua_State *L)
 	return (1);
 }
 
+/*
+ * time() -- returns the current time in fractional seconds on a monotonic
+ * clock; only useful for measuring intervals.
+ */
 static int
 orchlua_time(lua_State *L)
 {
-	struct timespec tv;
 
-	assert (clock_gettime(CLOCK_REALTIME_FAST, &tv) == 0);
-
-	lua_pushnumber(L, tv.tv_sec);
+	lua_pushnumber(L, orch_clock_seconds());
 	return (1);
 }
 
@@ -271,42 +264,22 @@ orchlua_child_error(orch_ipc_t ipc __unused, struct orch_ipc_msg *msg,
 	size_t datasz;
 
 	childstr = orch_ipc_msg_payload(msg, &datasz);
-	if (datasz != 0)
+	if (datasz != 0) {
 		fprintf(stderr, "CHILD ERROR: %.*s\n", (int)datasz, childstr);
+		snprintf(proc->errmsg, sizeof(proc->errmsg), "%.*s",
+		    (int)datasz, childstr);
+	}
 	proc->error = true;
 	return (0);
 }
 
-static int
-orchlua_spawn(lua_State *L)
+/*
+ * Push a new, not yet spawned process.
+ */
+static struct orch_process *
+orchlua_process_alloc(lua_State *L)
 {
 	struct orch_process *proc;
-	const char **argv;
-	int argc;
-
-	if (lua_gettop(L) == 0) {
-		luaL_pushfail(L);
-		lua_pushstring(L, "No command specified to spawn");
-		return (2);
-	}
-
-	/*
-	 * The script can table.unpack its args, so we'll expect all strings even if
-	 * they choose to build it up via table.
-	 */
-	argc = lua_gettop(L);
-	argv = calloc(argc + 1, sizeof(*argv));
-
-	for (int i = 0; i < argc; i++) {
-		argv[i] = lua_tostring(L, i + 1);
-		if (argv[i] == NULL) {
-			free(argv);
-			luaL_pushfail(L);
-			lua_pushfstring(L, "Argument at index %d not a string", i + 1);
-			return (2);
-		}
-
-	}
 
 	/*
 	 * Note that the one uservalue allowed by Lua < 5.4 is already consumed
@@ -318,311 +291,322 @@ orchlua_spawn(lua_State *L)
 	proc = lua_newuserdata(L, sizeof(*proc));
 	proc->L = L;
 	proc->term = NULL;
+	proc->log = NULL;
+	proc->rec = NULL;
+	proc->replay = NULL;
+	proc->filter = proc->errfilter = NULL;
+	proc->ipc = NULL;
 	proc->status = 0;
+	proc->status_valid = false;
 	proc->pid = 0;
+	proc->reapfd = -1;
+	proc->termctl = proc->errfd = proc->infd = -1;
+	proc->pipe = proc->errsep = false;
+	memset(&proc->errbuf, 0, sizeof(proc->errbuf));
 	proc->buffered = proc->eof = proc->released = false;
 	proc->error = false;
+	proc->errmsg[0] = '\0';
+	proc->read_hiwat = ORCH_READ_HIWAT;
+	proc->scrollback = 0;
 
 	luaL_setmetatable(L, ORCHLUA_PROCESSHANDLE);
 
-	if (orch_spawn(argc, argv, proc, &orchlua_child_error) != 0) {
-		int serrno = errno;
-
-		free(argv);
-
-		luaL_pushfail(L);
-		lua_pushstring(L, strerror(serrno));
-		return (2);
-	}
-
-	free(argv);
+	proc->buffer = orchlua_matchbuf_alloc(L);
+	lua_setuservalue(L, -2);
 
-	return (1);
+	return (proc);
 }
 
-#define	REG_SIMPLE(n)	{ #n, orchlua_ ## n }
-static const struct luaL_Reg orchlib[] = {
-	REG_SIMPLE(open),
-	REG_SIMPLE(regcomp),
-	REG_SIMPLE(reset),
-	REG_SIMPLE(sleep),
-	REG_SIMPLE(time),
-	REG_SIMPLE(spawn),
-	{ NULL, NULL },
+/* Indexed by enum orch_spawn_method. */
+static const char *orchlua_spawn_methods[] = {
+	"default", "fork", "posix_spawn", NULL,
 };
 
-static void
-orchlua_process_close_alarm(int signo __unused)
+static int
+orchlua_spawn_checkmethod(lua_State *L, int idx, enum orch_spawn_method *method)
 {
-	/* XXX Ignored, just don't terminate us. */
+	const char *name;
+
+	name = lua_tostring(L, idx);
+	for (int i = 0; name != NULL && orchlua_spawn_methods[i] != NULL; i++) {
+		if (strcmp(name, orchlua_spawn_methods[i]) == 0) {
+			*method = i;
+			return (0);
+		}
+	}
+
+	luaL_pushfail(L);
+	lua_pushfstring(L, "unknown spawn method '%s'",
+	    name != NULL ? name : luaL_typename(L, idx));
+	return (2);
 }
 
-static bool
-orchlua_process_killed(struct orch_process *self, int *signo)
+/*
+ * spawn_method([method]) -- returns the method used to spawn processes that
+ * don't specify one, optionally setting it to `method` first: "fork" or
+ * "posix_spawn".  "default" resets it to the one named by $ORCH_SPAWN_METHOD,
+ * or "fork" if that's not set.
+ */
+static int
+orchlua_spawn_method(lua_State *L)
 {
+	enum orch_spawn_method method;
+	int error;
 
-	assert(self->pid != 0);
-	if (waitpid(self->pid, &self->status, WNOHANG) != self->pid)
-		return (false);
+	if (!lua_isnoneornil(L, 1)) {
+		if ((error = orchlua_spawn_checkmethod(L, 1, &method)) != 0)
+			return (error);
 
-	if (WIFSIGNALED(self->status))
-		*signo = WTERMSIG(self->status);
-	else
-		*signo = 0;
-	self->pid = 0;
+		orch_spawn_method_set(method);
+	}
 
-	return (true);
+	lua_pushstring(L, orchlua_spawn_methods[orch_spawn_method_get()]);
+	return (1);
 }
 
+/* Indexed by enum orch_spawn_stderr. */
+static const char *orchlua_spawn_stderr[] = {
+	"merge", "separate", "null", NULL,
+};
+
 static int
-orchlua_process_close(lua_State *L)
+orchlua_spawn_checkpipe(lua_State *L, int idx, struct orch_spawn_opts *opts)
 {
-	struct orch_process *self;
-	pid_t wret;
-	int sig;
-	bool failed;
-
-	failed = false;
-	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
-	if (self->pid != 0 && orchlua_process_killed(self, &sig) && sig != 0) {
+	const char *name;
+	int type;
+
+	idx = lua_absindex(L, idx);
+	opts->pipe = true;
+	opts->pipe_stdin = true;
+	opts->pipe_stderr = ORCH_STDERR_MERGE;
+	if (lua_type(L, idx) == LUA_TBOOLEAN) {
+		opts->pipe = lua_toboolean(L, idx);
+		return (0);
+	} else if (!lua_istable(L, idx)) {
 		luaL_pushfail(L);
-		lua_pushfstring(L, "spawned process killed with signal '%d'", sig);
+		lua_pushstring(L, "pipe must be a boolean or a table");
 		return (2);
 	}
 
-	if (self->pid != 0) {
-		struct sigaction sigalrm = {
-			.sa_handler = orchlua_process_close_alarm,
-		};
-
-		sigaction(SIGALRM, &sigalrm, NULL);
+	if (lua_getfield(L, idx, "stdin") != LUA_TNIL)
+		opts->pipe_stdin = lua_toboolean(L, -1);
+	lua_pop(L, 1);
 
-		/* XXX Configurable? */
-		alarm(5);
-		sig = SIGINT;
-again:
-		kill(self->pid, sig);
-		wret = waitpid(self->pid, &self->status, 0);
-		alarm(0);
-		if (wret != self->pid) {
-			failed = true;
+	type = lua_getfield(L, idx, "stderr");
+	if (type != LUA_TNIL) {
+		name = lua_tostring(L, -1);
+		for (int i = 0; ; i++) {
+			if (name == NULL || orchlua_spawn_stderr[i] == NULL) {
+				luaL_pushfail(L);
+				lua_pushfstring(L, "unknown stderr mode '%s'",
+				    name != NULL ? name : luaL_typename(L, -1));
+				return (2);
+			}
 
-			/* If asking nicely didn't work, just kill it. */
-			if (sig != SIGKILL) {
-				sig = SIGKILL;
-				goto again;
+			if (strcmp(name, orchlua_spawn_stderr[i]) == 0) {
+				opts->pipe_stderr = i;
+				break;
 			}
 		}
-
-		signal(SIGALRM, SIG_DFL);
-		self->pid = 0;
-	}
-
-	orch_ipc_close(self->ipc);
-	self->ipc = NULL;
-
-	if (self->termctl != -1)
-		close(self->termctl);
-	self->termctl = -1;
-
-	if (failed) {
-		luaL_pushfail(L);
-		lua_pushstring(L, "could not kill process with SIGINT");
-		return (2);
 	}
+	lua_pop(L, 1);
 
-	lua_pushboolean(L, 1);
-	return (1);
+	return (0);
 }
 
 /*
- * read(callback[, timeout]) -- returns true if we finished, false if we
- * hit EOF, or a fail, error pair otherwise.
+ * spawn([opts, ]cmd, ...) -- spawn `cmd` on a new pty.  If `opts` is specified,
+ * then it's a table that may contain:
+ *   - term: initial terminal settings to apply before the child reports in,
+ *     as { iflag = { set = mask, unset = mask }, oflag = ..., lflag = ...,
+ *     cc = { VEOF = "^D", ... } }.
+ *   - method: how to launch the child, as with spawn_method().
+ *   - pipe: true to give the child pipes for its stdio instead of a pty, or a
+ *     table to configure them: { stdin = false } gives it /dev/null instead,
+ *     and stderr may be "merge" (the default) to read it along with stdout,
+ *     "separate" to collect it for stderr(), or "null".  There's no terminal
+ *     to configure, so `term` can't be used with it.
  */
 static int
-orchlua_process_read(lua_State *L)
+orchlua_spawn(lua_State *L)
 {
-	char buf[LINE_MAX];
-	fd_set rfd;
-	struct orch_process *self;
-	struct timeval tv, *tvp;
-	time_t start, now;
-	ssize_t readsz;
-	int fd, ret;
-	lua_Number timeout;
-
-	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
-	luaL_checktype(L, 2, LUA_TFUNCTION);
+	struct orch_spawn_opts opts, *optsp;
+	struct orch_process *proc;
+	const char **argv;
+	int argbase, argc, error;
+
+	argbase = 1;
+	optsp = NULL;
+	if (lua_type(L, 1) == LUA_TTABLE) {
+		memset(&opts, 0, sizeof(opts));
+		if (lua_getfield(L, 1, "term") != LUA_TNIL) {
+			if (!lua_istable(L, -1)) {
+				luaL_pushfail(L);
+				lua_pushstring(L, "term must be a table");
+				return (2);
+			}
 
-	if (lua_gettop(L) > 2) {
-		timeout = luaL_checknumber(L, 3);
-		if (timeout < 0) {
-			luaL_pushfail(L);
-			lua_pushstring(L, "Invalid timeout");
-			return (2);
-		} else {
-			timeout = MAX(timeout, 1);
+			if ((error = orchlua_tty_checkmask(L, -1,
+			    &opts.termmask)) != 0)
+				return (error);
 		}
 
-		tv.tv_sec = timeout;
-		tv.tv_usec = 0;
-		tvp = &tv;
-	} else {
-		/* No timeout == block */
-		tvp = NULL;
-	}
-
-	fd = self->termctl;
-	FD_ZERO(&rfd);
-
-	/* Crude */
-	if (tvp != NULL)
-			start = now = time(NULL);
-	while ((tvp == NULL || now - start < timeout) && !self->error) {
-		FD_SET(fd, &rfd);
-		ret = select(fd + 1, &rfd, NULL, NULL, tvp);
-		if (ret == -1 && errno == EINTR) {
-			/*
-			 * Rearm the timeout and go again; we'll just let the loop
-			 * terminate with a negative tv.tv_sec if timeout seconds
-			 * have elapsed.
-			 */
-			if (tvp != NULL) {
-				now = time(NULL);
-				tv.tv_sec = timeout - (now - start);
-			}
+		lua_pop(L, 1);
 
-			continue;
-		} else if (ret == -1) {
-			int err = errno;
+		if (lua_getfield(L, 1, "method") != LUA_TNIL &&
+		    (error = orchlua_spawn_checkmethod(L, -1,
+		    &opts.method)) != 0)
+			return (error);
 
-			luaL_pushfail(L);
-			lua_pushstring(L, strerror(err));
-			return (2);
-		} else if (ret == 0) {
-			/* Timeout -- not the end of the world. */
-			lua_pushboolean(L, 1);
-			return (1);
-		}
+		lua_pop(L, 1);
 
-		/* Read it */
-		readsz = read(fd, buf, sizeof(buf));
+		if (lua_getfield(L, 1, "pipe") != LUA_TNIL &&
+		    (error = orchlua_spawn_checkpipe(L, -1, &opts)) != 0)
+			return (error);
 
-		/*
-		 * Some platforms will return `0` when the slave side of a pty
-		 * has gone away, while others will return -1 + EIO.  Convert
-		 * the latter to the former.
-		 */
-		if (readsz == -1 && errno == EIO)
-			readsz = 0;
-		if (readsz < 0) {
-			int err = errno;
+		lua_pop(L, 1);
 
+		if (lua_getfield(L, 1, "term") != LUA_TNIL && opts.pipe) {
 			luaL_pushfail(L);
-			lua_pushstring(L, strerror(err));
+			lua_pushstring(L, "term cannot be used with pipe");
 			return (2);
-		} else {
-			int nargs = 0;
+		}
 
-			/*
-			 * Duplicate the function value, it'll get popped by the call.
-			 */
-			lua_settop(L, 3);
-			lua_copy(L, -2, -1);
+		lua_pop(L, 1);
 
-			/* callback([data]) -- nil data == EOF */
-			if (readsz > 0) {
-				lua_pushlstring(L, buf, readsz);
-				nargs++;
-			}
+		optsp = &opts;
+		argbase++;
+	}
 
-			/*
-			 * Callback should return true if it's done, false if it
-			 * wants more.
-			 */
-			lua_call(L, nargs, 1);
+	if (lua_gettop(L) < argbase) {
+		luaL_pushfail(L);
+		lua_pushstring(L, "No command specified to spawn");
+		return (2);
+	}
 
-			if (readsz == 0) {
-				int signo;
+	/*
+	 * The script can table.unpack its args, so we'll expect all strings even if
+	 * they choose to build it up via table.
+	 */
+	argc = lua_gettop(L) - argbase + 1;
+	argv = calloc(argc + 1, sizeof(*argv));
 
-				self->eof = true;
+	for (int i = 0; i < argc; i++) {
+		argv[i] = lua_tostring(L, argbase + i);
+		if (argv[i] == NULL) {
+			free(argv);
+			luaL_pushfail(L);
+			lua_pushfstring(L, "Argument at index %d not a string",
+			    argbase + i);
+			return (2);
+		}
 
-				assert(self->termctl >= 0);
-				close(self->termctl);
-				self->termctl = -1;
+	}
 
-				if (orchlua_process_killed(self, &signo) && signo != 0) {
-					luaL_pushfail(L);
-					lua_pushfstring(L,
-						"spawned process killed with signal '%d'", signo);
-					return (2);
-				}
+	proc = orchlua_process_alloc(L);
+	if (orch_spawn(argc, argv, proc, optsp, &orchlua_child_error) != 0) {
+		int serrno = errno;
 
-				/*
-				 * We need to be able to distinguish between a disaster
-				 * scenario and possibly business as usual, so we'll
-				 * return true if we hit EOF.  This lets us assert()
-				 * on the return value and catch bad program exits.
-				 */
-				lua_pushboolean(L, 1);
-				return (1);
-			}
+		free(argv);
 
-			if (lua_toboolean(L, -1))
-				break;
-		}
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(serrno));
+		return (2);
 	}
 
-	lua_pushboolean(L, 1);
+	free(argv);
+
 	return (1);
 }
 
+/*
+ * replay(path[, opts]) -- play back a session from a recording made with
+ * record(), as a process that may be read from and written to like any other
+ * pipe-mode process.  Whatever is written to it is checked against the recorded
+ * input, and output that followed some input isn't played back until that
+ * input has been written.  `opts` may contain:
+ *   - speed: a multiplier for the recorded delays between events, e.g., 2 to
+ *     play back at twice the speed, or 0 for no delays at all.
+ *   - session: which session in the recording to play back, from 1.
+ *   - stderr: as for spawn()'s `pipe` option, for any recorded stderr.
+ */
 static int
-orchlua_process_write(lua_State *L)
+orchlua_replay(lua_State *L)
 {
-	struct orch_process *self;
-	const char *buf;
-	size_t bufsz, totalsz;
-	ssize_t writesz;
-	int fd;
+	struct orch_spawn_opts opts;
+	struct orch_process *proc;
+	struct orch_replay *replay;
+	const char *path;
+	lua_Number speed;
+	lua_Integer session;
+	int error, fd;
+
+	path = luaL_checkstring(L, 1);
+	memset(&opts, 0, sizeof(opts));
+	opts.pipe = opts.pipe_stdin = true;
+	speed = 1;
+	session = 1;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+
+		if (lua_getfield(L, 2, "speed") != LUA_TNIL) {
+			if (!lua_isnumber(L, -1) || lua_tonumber(L, -1) < 0) {
+				luaL_pushfail(L);
+				lua_pushstring(L, "speed must be a number >= 0");
+				return (2);
+			}
 
-	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
-	buf = luaL_checklstring(L, 2, &bufsz);
+			speed = lua_tonumber(L, -1);
+		}
+		lua_pop(L, 1);
 
-	fd = self->termctl;
-	totalsz = 0;
-	while (totalsz < bufsz) {
-		writesz = write(fd, &buf[totalsz], bufsz - totalsz);
-		if (writesz == -1 && errno == EINTR) {
-			continue;
-		} else if (writesz == -1) {
-			int err = errno;
+		if (lua_getfield(L, 2, "session") != LUA_TNIL) {
+			if (!lua_isinteger(L, -1) || lua_tointeger(L, -1) < 1 ||
+			    lua_tointeger(L, -1) > INT_MAX) {
+				luaL_pushfail(L);
+				lua_pushstring(L,
+				    "session must be a positive integer");
+				return (2);
+			}
 
-			luaL_pushfail(L);
-			lua_pushstring(L, strerror(err));
-			return (2);
+			session = lua_tointeger(L, -1);
 		}
+		lua_pop(L, 1);
 
-		totalsz += writesz;
+		/* Only `stderr` is relevant, the script always gets stdin. */
+		if ((error = orchlua_spawn_checkpipe(L, 2, &opts)) != 0)
+			return (error);
+		opts.pipe_stdin = true;
 	}
 
-	lua_pushnumber(L, totalsz);
-	return (1);
-}
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		error = errno;
 
-static int
-orchlua_process_release(lua_State *L)
-{
-	struct orch_process *self;
-	int error;
+		luaL_pushfail(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(error));
+		return (2);
+	}
 
-	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+	replay = orch_replay_open(fd, session, speed);
+	if (replay == NULL) {
+		error = errno;
 
-	error = orch_release(self->ipc);
-	orch_ipc_close(self->ipc);
-	self->ipc = NULL;
+		luaL_pushfail(L);
+		if (error == EINVAL)
+			lua_pushfstring(L, "%s: not a valid recording", path);
+		else if (error == ENOENT)
+			lua_pushfstring(L, "%s: no session %d in recording",
+			    path, (int)session);
+		else
+			lua_pushfstring(L, "%s: %s", path, strerror(error));
+		return (2);
+	}
 
-	if (error != 0) {
+	proc = orchlua_process_alloc(L);
+	proc->replay = replay;
+	opts.replay = replay;
+	if (orch_spawn(0, NULL, proc, &opts, &orchlua_child_error) != 0) {
 		error = errno;
 
 		luaL_pushfail(L);
@@ -630,20 +614,1416 @@ orchlua_process_release(lua_State *L)
 		return (2);
 	}
 
-	self->released = true;
-
-	lua_pushboolean(L, 1);
 	return (1);
 }
 
-static int
-orchlua_process_released(lua_State *L)
+#define	REG_SIMPLE(n)	{ #n, orchlua_ ## n }
+static const struct luaL_Reg orchlib[] = {
+	REG_SIMPLE(close_all),
+	REG_SIMPLE(matchbuf),
+	REG_SIMPLE(open),
+	REG_SIMPLE(regcomp),
+	REG_SIMPLE(replay),
+	REG_SIMPLE(reset),
+	REG_SIMPLE(sleep),
+	REG_SIMPLE(time),
+	REG_SIMPLE(spawn),
+	REG_SIMPLE(spawn_method),
+	{ NULL, NULL },
+};
+
+static bool
+orchlua_process_killed(struct orch_process *self, int *signo)
 {
-	struct orch_process *self;
 
-	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
-	lua_pushboolean(L, self->released);
-	return (1);
+	if (!orch_reap_check(self))
+		return (false);
+
+	if (self->status_valid && WIFSIGNALED(self->status))
+		*signo = WTERMSIG(self->status);
+	else
+		*signo = 0;
+
+	return (true);
+}
+
+/* Longest signal sequence that close() will accept. */
+#define	CLOSE_MAXSIGNALS	8
+
+/*
+ * The signals that close() sends in order, and how long we wait after each one
+ * for the process to exit before moving on to the next.  A negative grace
+ * period waits indefinitely.
+ */
+struct orch_close_opts {
+	int		 signals[CLOSE_MAXSIGNALS];
+	lua_Number	 grace[CLOSE_MAXSIGNALS];
+	size_t		 nsignals;
+};
+
+#define	CLOSE_DEFAULT_GRACE	5
+
+static const struct orchlua_signame {
+	const char	*name;
+	int		 signo;
+} orchlua_signames[] = {
+	{ "HUP",	SIGHUP },
+	{ "INT",	SIGINT },
+	{ "QUIT",	SIGQUIT },
+	{ "KILL",	SIGKILL },
+	{ "TERM",	SIGTERM },
+	{ "USR1",	SIGUSR1 },
+	{ "USR2",	SIGUSR2 },
+	{ NULL,		0 },
+};
+
+static void
+orchlua_close_defaults(struct orch_close_opts *opts)
+{
+
+	/* Ask nicely first; SIGKILL can't be ignored, so wait it out. */
+	opts->signals[0] = SIGINT;
+	opts->grace[0] = CLOSE_DEFAULT_GRACE;
+	opts->signals[1] = SIGKILL;
+	opts->grace[1] = -1;
+	opts->nsignals = 2;
+}
+
+static const char *
+orchlua_signame(int signo)
+{
+
+	for (const struct orchlua_signame *iter = &orchlua_signames[0];
+	    iter->name != NULL; iter++) {
+		if (iter->signo == signo)
+			return (iter->name);
+	}
+
+	return (NULL);
+}
+
+static int
+orchlua_checksignal(lua_State *L, int idx, int *signo)
+{
+	const char *name;
+
+	if (lua_type(L, idx) == LUA_TNUMBER) {
+		*signo = lua_tointeger(L, idx);
+		if (*signo > 0)
+			return (0);
+	} else if ((name = lua_tostring(L, idx)) != NULL) {
+		if (strncmp(name, "SIG", 3) == 0)
+			name += 3;
+
+		for (const struct orchlua_signame *iter = &orchlua_signames[0];
+		    iter->name != NULL; iter++) {
+			if (strcmp(iter->name, name) == 0) {
+				*signo = iter->signo;
+				return (0);
+			}
+		}
+	}
+
+	luaL_pushfail(L);
+	lua_pushfstring(L, "invalid signal '%s'", luaL_tolstring(L, idx, NULL));
+	return (2);
+}
+
+/*
+ * Parse the close options at `idx`, if it's a table:
+ *   - signals: array of signals to send in order, as numbers or names like
+ *     "INT" or "SIGINT" (default: { "INT", "KILL" })
+ *   - grace: seconds to wait after each signal, either a single number for all
+ *     of them or an array matching `signals` (default: 5).  If the last signal
+ *     is SIGKILL and it doesn't have its own grace period, then we'll wait for
+ *     as long as it takes.
+ */
+static int
+orchlua_close_checkopts(lua_State *L, int idx, struct orch_close_opts *opts)
+{
+	lua_Integer nsignals;
+	int error, type;
+
+	orchlua_close_defaults(opts);
+	if (lua_type(L, idx) != LUA_TTABLE)
+		return (0);
+
+	idx = lua_absindex(L, idx);
+	type = lua_getfield(L, idx, "signals");
+	if (type == LUA_TTABLE) {
+		nsignals = luaL_len(L, -1);
+		if (nsignals < 1 || nsignals > CLOSE_MAXSIGNALS) {
+			luaL_pushfail(L);
+			lua_pushfstring(L, "signals must have between 1 and %d entries",
+			    CLOSE_MAXSIGNALS);
+			return (2);
+		}
+
+		opts->nsignals = nsignals;
+		for (lua_Integer i = 0; i < nsignals; i++) {
+			lua_geti(L, -1, i + 1);
+			if ((error = orchlua_checksignal(L, -1,
+			    &opts->signals[i])) != 0)
+				return (error);
+			lua_pop(L, 1);
+
+			opts->grace[i] = CLOSE_DEFAULT_GRACE;
+		}
+
+		if (opts->signals[nsignals - 1] == SIGKILL)
+			opts->grace[nsignals - 1] = -1;
+	} else if (type != LUA_TNIL) {
+		luaL_pushfail(L);
+		lua_pushstring(L, "signals must be an array of signals");
+		return (2);
+	}
+	lua_pop(L, 1);
+
+	type = lua_getfield(L, idx, "grace");
+	if (type == LUA_TNUMBER) {
+		for (size_t i = 0; i < opts->nsignals; i++) {
+			if (opts->grace[i] >= 0)
+				opts->grace[i] = lua_tonumber(L, -1);
+		}
+	} else if (type == LUA_TTABLE) {
+		for (size_t i = 0; i < opts->nsignals; i++) {
+			if (lua_geti(L, -1, i + 1) == LUA_TNUMBER)
+				opts->grace[i] = lua_tonumber(L, -1);
+			else if (!lua_isnil(L, -1)) {
+				luaL_pushfail(L);
+				lua_pushstring(L, "grace periods must be numbers");
+				return (2);
+			}
+			lua_pop(L, 1);
+		}
+	} else if (type != LUA_TNIL) {
+		luaL_pushfail(L);
+		lua_pushstring(L, "grace must be a number or an array of numbers");
+		return (2);
+	}
+	lua_pop(L, 1);
+
+	return (0);
+}
+
+/*
+ * Work through the signal sequence for all of `procs` at once: each step
+ * signals every process that's still around, then waits on all of them against
+ * a single deadline.  Returns the number of processes that we couldn't get rid
+ * of; `escalated` is set to the number that needed more than the first signal.
+ */
+static size_t
+orchlua_terminate(struct orch_process **procs, size_t nprocs,
+    const struct orch_close_opts *opts, size_t *escalated)
+{
+	struct timespec deadline, *deadlinep;
+	size_t remaining;
+
+	remaining = 0;
+	for (size_t i = 0; i < nprocs; i++) {
+		if (procs[i]->pid != 0)
+			remaining++;
+	}
+
+	*escalated = 0;
+	for (size_t step = 0; step < opts->nsignals && remaining != 0; step++) {
+		if (step == 1)
+			*escalated = remaining;
+
+		for (size_t i = 0; i < nprocs; i++) {
+			if (procs[i]->pid != 0)
+				kill(procs[i]->pid, opts->signals[step]);
+		}
+
+		deadlinep = NULL;
+		if (opts->grace[step] >= 0) {
+			orch_deadline_init(&deadline, opts->grace[step]);
+			deadlinep = &deadline;
+		}
+
+		for (size_t i = 0; i < nprocs; i++) {
+			if (procs[i]->pid != 0 && orch_reap_wait(procs[i], deadlinep))
+				remaining--;
+		}
+	}
+
+	return (remaining);
+}
+
+static void
+orchlua_process_cleanup(struct orch_process *self)
+{
+
+	orch_ipc_close(self->ipc);
+	self->ipc = NULL;
+
+	orch_reap_close(self->reapfd);
+	self->reapfd = -1;
+
+	if (self->termctl != -1)
+		close(self->termctl);
+	self->termctl = -1;
+
+	if (self->errfd != -1)
+		close(self->errfd);
+	if (self->infd != -1)
+		close(self->infd);
+	self->errfd = self->infd = -1;
+
+	orch_matchbuf_free(&self->errbuf);
+
+	if (self->log != NULL)
+		(void)orch_log_close(self->log);
+	self->log = NULL;
+
+	if (self->rec != NULL)
+		(void)orch_record_close(self->rec);
+	self->rec = NULL;
+
+	if (self->replay != NULL)
+		orch_replay_close(self->replay);
+	self->replay = NULL;
+
+	orch_filter_free(self->filter);
+	orch_filter_free(self->errfilter);
+	self->filter = self->errfilter = NULL;
+}
+
+static void
+orchlua_close_failure(lua_State *L, const struct orch_close_opts *opts,
+    size_t remaining)
+{
+	const char *name;
+
+	luaL_pushfail(L);
+	if (remaining != 0) {
+		lua_pushstring(L, "could not terminate process");
+		return;
+	}
+
+	name = orchlua_signame(opts->signals[0]);
+	if (name != NULL)
+		lua_pushfstring(L, "could not kill process with SIG%s", name);
+	else
+		lua_pushfstring(L, "could not kill process with signal %d",
+		    opts->signals[0]);
+}
+
+/*
+ * close([opts]) -- terminate the process if it's still running, as described in
+ * orchlua_close_checkopts(), and release all of its resources.
+ */
+static int
+orchlua_process_close(lua_State *L)
+{
+	struct orch_close_opts opts;
+	struct orch_process *self;
+	size_t escalated, remaining;
+	int error, sig;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+
+	/* As __close, we'll get the error object (if any) here instead. */
+	if ((error = orchlua_close_checkopts(L, 2, &opts)) != 0)
+		return (error);
+
+	if (self->pid != 0 && orchlua_process_killed(self, &sig) && sig != 0) {
+		luaL_pushfail(L);
+		lua_pushfstring(L, "spawned process killed with signal '%d'", sig);
+		return (2);
+	}
+
+	remaining = orchlua_terminate(&self, 1, &opts, &escalated);
+	orchlua_process_cleanup(self);
+
+	if (remaining != 0 || escalated != 0) {
+		orchlua_close_failure(L, &opts, remaining);
+		return (2);
+	}
+
+	lua_pushboolean(L, 1);
+	return (1);
+}
+
+/*
+ * close_all(processes[, opts]) -- as process:close(), but for all of the
+ * processes in the `processes` array at once, so that they're all given their
+ * grace periods concurrently rather than one after the other.  Returns true if
+ * they all exited on the first signal, or fail and a description of the first
+ * problem otherwise.
+ */
+static int
+orchlua_close_all(lua_State *L)
+{
+	struct orch_close_opts opts;
+	struct orch_process **procs;
+	size_t escalated, nprocs, remaining;
+	int error, sig, signaled;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	if ((error = orchlua_close_checkopts(L, 2, &opts)) != 0)
+		return (error);
+
+	nprocs = luaL_len(L, 1);
+	procs = calloc(nprocs + 1, sizeof(*procs));
+	if (procs == NULL) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(ENOMEM));
+		return (2);
+	}
+
+	for (size_t i = 0; i < nprocs; i++) {
+		lua_rawgeti(L, 1, i + 1);
+		procs[i] = luaL_testudata(L, -1, ORCHLUA_PROCESSHANDLE);
+		lua_pop(L, 1);
+
+		if (procs[i] == NULL) {
+			free(procs);
+			luaL_pushfail(L);
+			lua_pushfstring(L, "element %d is not a process", (int)i + 1);
+			return (2);
+		}
+	}
+
+	signaled = 0;
+	for (size_t i = 0; i < nprocs; i++) {
+		if (procs[i]->pid != 0 && orchlua_process_killed(procs[i], &sig) &&
+		    sig != 0 && signaled == 0)
+			signaled = sig;
+	}
+
+	remaining = orchlua_terminate(procs, nprocs, &opts, &escalated);
+	for (size_t i = 0; i < nprocs; i++)
+		orchlua_process_cleanup(procs[i]);
+	free(procs);
+
+	if (signaled != 0) {
+		luaL_pushfail(L);
+		lua_pushfstring(L, "spawned process killed with signal '%d'",
+		    signaled);
+		return (2);
+	} else if (remaining != 0 || escalated != 0) {
+		orchlua_close_failure(L, &opts, remaining);
+		return (2);
+	}
+
+	lua_pushboolean(L, 1);
+	return (1);
+}
+
+/*
+ * Run `len` bytes of output through `filter` and into `buf`, logging whatever
+ * comes out the other end.  `data` is only read before `buf` is touched, so it
+ * may point at the uncommitted tail of `buf`.  The scrollback window is only
+ * applied if `scroll` is set, as described for orchlua_process_drain().
+ * Returns the number of bytes added to `buf`, or -1 if we couldn't allocate.
+ */
+static ssize_t
+orchlua_process_drain_filter(struct orch_process *self,
+    struct orch_filter *filter, struct orch_matchbuf *buf, const char *data,
+    size_t len, bool flush, bool scroll)
+{
+	const char *out;
+	char *tail;
+	ssize_t outsz;
+
+	outsz = orch_filter_run(filter, data, len, flush, &out);
+	if (outsz <= 0)
+		return (outsz);
+
+	/* Filters may grow the output a little; keep to the window anyway. */
+	if (self->scrollback != 0 && scroll) {
+		(void)orch_matchbuf_trim(buf, self->scrollback -
+		    MIN((size_t)outsz, self->scrollback));
+	}
+
+	if (orch_matchbuf_reserve(buf, outsz, &tail) != 0)
+		return (-1);
+
+	memcpy(tail, out, outsz);
+	orch_matchbuf_commit(buf, outsz);
+	if (self->log != NULL && buf == self->buffer)
+		(void)orch_log_write(self->log, tail, outsz);
+	return (outsz);
+}
+
+/*
+ * Drain `fd` (the pty, or one of the pipes) into `buf` until it would block, we
+ * hit EOF, or we've reached the high-water mark.  Each read asks for at least as
+ * much as we've already read in this drain, so a chatty process quickly ends
+ * up reading in large chunks while a quiet one doesn't grow the buffer.
+ *
+ * With batching disabled (a zero high-water mark), we stop after a single
+ * read(2) as we historically have.
+ *
+ * Output is recorded as it was read, but any filters are applied before it's
+ * logged or added to `buf`.  Returns the number of bytes added to `buf`.
+ *
+ * The scrollback limit is only applied if `scroll` is set, i.e., when we're
+ * draining for read() and the matchers will see each batch as it comes in.
+ * Output drained while write() waits on the process hasn't been seen by any
+ * matcher yet, so it's all kept until the next match has had a look at it.
+ */
+static ssize_t
+orchlua_process_drain(struct orch_process *self, int fd,
+    struct orch_matchbuf *buf, bool *eof, bool scroll)
+{
+	struct orch_filter *filter;
+	char *tail;
+	size_t added, avail, hiwat, total;
+	ssize_t filtersz, readsz;
+	bool batch;
+
+	*eof = false;
+	filter = fd == self->errfd ? self->errfilter : self->filter;
+	hiwat = self->read_hiwat;
+	batch = hiwat != 0;
+
+	/*
+	 * With a scrollback limit, we never read more than half of it before
+	 * the matchers get a look, so that at least the other half of it is
+	 * always there for a match that started in earlier output.
+	 */
+	if (self->scrollback != 0 && scroll && batch)
+		hiwat = MIN(hiwat, MAX(self->scrollback / 2, 1));
+
+	added = total = 0;
+	for (;;) {
+		if (batch) {
+			if (total >= hiwat)
+				break;
+			avail = MIN(MAX(total, LINE_MAX), hiwat - total);
+		} else {
+			avail = LINE_MAX;
+		}
+
+		/*
+		 * Make room by sliding the window along; nothing read in this
+		 * batch is discarded, since it's at most half of the window.
+		 */
+		if (self->scrollback != 0 && scroll) {
+			avail = MIN(avail, MAX(self->scrollback / 2, 1));
+			(void)orch_matchbuf_trim(buf, self->scrollback - avail);
+		}
+
+		if (orch_matchbuf_reserve(buf, avail, &tail) != 0) {
+			/* Make do with what we have, if anything. */
+			if (total != 0)
+				break;
+			return (-1);
+		}
+
+		readsz = read(fd, tail, avail);
+		if (readsz == -1 && errno == EINTR)
+			continue;
+
+		/*
+		 * Some platforms will return `0` when the slave side of a pty
+		 * has gone away, while others will return -1 + EIO.  Convert
+		 * the latter to the former.
+		 */
+		if (readsz == -1 && errno == EIO)
+			readsz = 0;
+		if (readsz == -1) {
+			if (errno == EAGAIN)
+				break;
+
+			/* Hand back what we got; the error will recur. */
+			if (total != 0)
+				break;
+			return (-1);
+		} else if (readsz == 0) {
+			/* Release anything the filters were holding on to. */
+			if (filter != NULL) {
+				filtersz = orchlua_process_drain_filter(self,
+				    filter, buf, NULL, 0, true, scroll);
+				if (filtersz > 0)
+					added += filtersz;
+			}
+
+			*eof = true;
+			break;
+		}
+
+		if (self->rec != NULL)
+			(void)orch_record_event(self->rec, fd == self->errfd ?
+			    ORCH_REC_STDERR : ORCH_REC_OUTPUT, tail, readsz);
+		total += readsz;
+
+		if (filter != NULL) {
+			filtersz = orchlua_process_drain_filter(self, filter,
+			    buf, tail, readsz, false, scroll);
+			if (filtersz == -1) {
+				if (added != 0)
+					break;
+				return (-1);
+			}
+
+			added += filtersz;
+		} else {
+			orch_matchbuf_commit(buf, readsz);
+			if (self->log != NULL && buf == self->buffer)
+				(void)orch_log_write(self->log, tail, readsz);
+			added += readsz;
+		}
+
+		if (!batch)
+			break;
+	}
+
+	return (added);
+}
+
+/*
+ * Drain the process's pty or stdout if `outready`, and its stderr pipe if
+ * `errready`, with `scroll` as for orchlua_process_drain().  Returns the number
+ * of bytes added to the match buffer; stderr that's kept separate goes into
+ * errbuf instead, and isn't counted.
+ */
+static ssize_t
+orchlua_process_drain_ready(struct orch_process *self, bool outready,
+    bool errready, bool *outeof, bool *erreof, bool scroll)
+{
+	ssize_t sz, total;
+
+	*outeof = *erreof = false;
+	total = 0;
+	if (outready) {
+		sz = orchlua_process_drain(self, self->termctl, self->buffer,
+		    outeof, scroll);
+		if (sz < 0)
+			return (-1);
+		total += sz;
+	}
+
+	if (errready) {
+		sz = orchlua_process_drain(self, self->errfd,
+		    self->errsep ? &self->errbuf : self->buffer, erreof,
+		    scroll);
+		if (sz < 0) {
+			/* Hand back what we got; the error will recur. */
+			if (total != 0)
+				return (total);
+			return (-1);
+		}
+
+		if (!self->errsep)
+			total += sz;
+	}
+
+	return (total);
+}
+
+/*
+ * read(callback[, timeout[, idle]]) -- returns true if we finished, false if we
+ * hit EOF, or a fail, error pair otherwise.  A nil `timeout` waits as long as it
+ * takes.  If `idle` is specified, then we also give up once the process has
+ * gone that many seconds without producing any output, and return true and
+ * "idle" to say so.
+ *
+ * Output is appended directly to the process's match buffer.  The callback is
+ * invoked with the number of bytes appended once per batch of output drained
+ * from the pty, and once more with no arguments at EOF.  In pipe mode, stdout
+ * and stderr may close independently, and we're only at EOF once both have.
+ */
+static int
+orchlua_process_doread(lua_State *L)
+{
+	struct pollfd pfd[3];
+	struct orch_process *self;
+	struct timespec deadline, *deadlinep, idle, *idlep;
+	const struct timespec *waitp;
+	ssize_t readsz;
+	int erridx, nfds, outidx, reapidx, ret;
+	lua_Number idletime, timeout;
+	bool check, eof, erreof, exited, outeof, ready;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+
+	if (!lua_isnoneornil(L, 3)) {
+		timeout = luaL_checknumber(L, 3);
+		if (timeout < 0) {
+			luaL_pushfail(L);
+			lua_pushstring(L, "Invalid timeout");
+			return (2);
+		}
+
+		orch_deadline_init(&deadline, timeout);
+		deadlinep = &deadline;
+	} else {
+		/* No timeout == block */
+		deadlinep = NULL;
+	}
+
+	idletime = 0;
+	idlep = NULL;
+	if (!lua_isnoneornil(L, 4)) {
+		idletime = luaL_checknumber(L, 4);
+		if (idletime <= 0) {
+			luaL_pushfail(L);
+			lua_pushstring(L, "Invalid idle timeout");
+			return (2);
+		}
+
+		orch_deadline_init(&idle, idletime);
+		idlep = &idle;
+	}
+
+	/*
+	 * Once the child has exited, we only give the pty a brief grace period
+	 * to deliver whatever output is left before we call it EOF; anything
+	 * still holding the pts open isn't what we're waiting on.  The grace
+	 * period runs from the exit, not from each read() call.
+	 */
+	check = true;
+	exited = false;
+	while (!self->error) {
+		if (check && !exited && orch_reap_check(self))
+			exited = true;
+
+		waitp = orch_deadline_min(deadlinep, idlep);
+		if (exited)
+			waitp = orch_deadline_min(waitp, &self->exitgrace);
+
+		check = false;
+		readsz = 0;
+		ready = false;
+
+		/* We may have seen EOF last time, but stopped short of it. */
+		eof = self->termctl == -1 && self->errfd == -1;
+		if (!eof) {
+			nfds = 0;
+			outidx = erridx = reapidx = -1;
+			if (self->termctl != -1) {
+				outidx = nfds++;
+				pfd[outidx].fd = self->termctl;
+			}
+			if (self->errfd != -1) {
+				erridx = nfds++;
+				pfd[erridx].fd = self->errfd;
+			}
+			if (!exited && self->reapfd != -1) {
+				reapidx = nfds++;
+				pfd[reapidx].fd = self->reapfd;
+			}
+
+			for (int i = 0; i < nfds; i++) {
+				pfd[i].events = POLLIN;
+				pfd[i].revents = 0;
+			}
+
+			ret = poll(pfd, nfds, orch_deadline_poll_ms(waitp));
+			if (ret == -1 && errno == EINTR) {
+				/*
+				 * The remaining time is recalculated from the
+				 * deadline.
+				 */
+				continue;
+			} else if (ret == -1) {
+				int err = errno;
+
+				luaL_pushfail(L);
+				lua_pushstring(L, strerror(err));
+				return (2);
+			} else if (ret == 0 && waitp == idlep) {
+				/* No progress, the process may be wedged. */
+				lua_pushboolean(L, 1);
+				lua_pushstring(L, "idle");
+				return (2);
+			} else if (ret == 0 && waitp != &self->exitgrace) {
+				/* Timeout -- not the end of the world. */
+				lua_pushboolean(L, 1);
+				return (1);
+			}
+
+			/* Any output (or EOF) is progress. */
+			ready = (outidx != -1 && pfd[outidx].revents != 0) ||
+			    (erridx != -1 && pfd[erridx].revents != 0);
+			if (idlep != NULL && ready)
+				orch_deadline_init(idlep, idletime);
+
+			if (reapidx != -1 && pfd[reapidx].revents != 0) {
+				/* Picked up at the top of the loop. */
+				orch_reap_ack(self->reapfd);
+				check = true;
+			}
+
+			/* Read it */
+			readsz = orchlua_process_drain_ready(self,
+			    outidx != -1 && pfd[outidx].revents != 0,
+			    erridx != -1 && pfd[erridx].revents != 0,
+			    &outeof, &erreof, true);
+			if (readsz < 0) {
+				int err = errno;
+
+				luaL_pushfail(L);
+				lua_pushstring(L, strerror(err));
+				return (2);
+			}
+
+			if (outeof) {
+				close(self->termctl);
+				self->termctl = -1;
+			}
+
+			if (erreof) {
+				close(self->errfd);
+				self->errfd = -1;
+			}
+
+			eof = self->termctl == -1 && self->errfd == -1;
+		}
+
+		/*
+		 * The child's gone and we've given its pty long enough to catch
+		 * up; whatever is still holding it open isn't our concern.  We
+		 * only call it once there's nothing left to read, though, since
+		 * the output may have just been waiting on a slow callback.
+		 */
+		if (exited && !ready && orch_deadline_expired(&self->exitgrace))
+			eof = true;
+
+		if (readsz > 0) {
+			/*
+			 * Duplicate the function value, it'll get popped by the call.
+			 */
+			lua_settop(L, 3);
+			lua_copy(L, -2, -1);
+
+			/* callback(count) */
+			lua_pushinteger(L, readsz);
+
+			/*
+			 * Callback should return true if it's done, false if it
+			 * wants more.  If it's done, any EOF we saw will be
+			 * picked up again by the next read.
+			 */
+			lua_call(L, 1, 1);
+			if (lua_toboolean(L, -1))
+				break;
+		}
+
+		if (eof) {
+			int signo;
+
+			/* callback() -- nil data == EOF */
+			lua_settop(L, 3);
+			lua_copy(L, -2, -1);
+			lua_call(L, 0, 1);
+
+			self->eof = true;
+			if (self->rec != NULL)
+				(void)orch_record_event(self->rec, ORCH_REC_EOF,
+				    NULL, 0);
+
+			if (self->termctl != -1)
+				close(self->termctl);
+			if (self->errfd != -1)
+				close(self->errfd);
+			self->termctl = self->errfd = -1;
+
+			if (orchlua_process_killed(self, &signo) && signo != 0) {
+				luaL_pushfail(L);
+				lua_pushfstring(L,
+					"spawned process killed with signal '%d'", signo);
+				return (2);
+			}
+
+			/*
+			 * We need to be able to distinguish between a disaster
+			 * scenario and possibly business as usual, so we'll
+			 * return true if we hit EOF.  This lets us assert()
+			 * on the return value and catch bad program exits.
+			 */
+			lua_pushboolean(L, 1);
+			return (1);
+		}
+
+		/*
+		 * A process that never stops writing would otherwise keep us
+		 * from ever noticing that the deadline has passed.
+		 */
+		if (orch_deadline_expired(deadlinep))
+			break;
+	}
+
+	lua_pushboolean(L, 1);
+	return (1);
+}
+
+static int
+orchlua_process_read(lua_State *L)
+{
+	struct orch_process *self;
+	int nret;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+	nret = orchlua_process_doread(L);
+	if (self->log != NULL)
+		(void)orch_log_sync(self->log);
+	if (self->rec != NULL)
+		(void)orch_record_sync(self->rec);
+	return (nret);
+}
+
+/*
+ * batch(hiwat) -- set the most output we'll drain from the pty before handing
+ * it to the read() callback.  0 disables batching, so that each read(2) is
+ * handed back individually.  Returns the previous high-water mark.
+ */
+static int
+orchlua_process_batch(lua_State *L)
+{
+	struct orch_process *self;
+	lua_Integer hiwat;
+	size_t prev;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+	hiwat = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, hiwat >= 0, 2, "high-water mark must be >= 0");
+
+	prev = self->read_hiwat;
+	self->read_hiwat = hiwat;
+
+	lua_pushinteger(L, prev);
+	return (1);
+}
+
+/*
+ * scrollback(limit) -- limit the output that we'll hold on to waiting for a
+ * match to `limit` bytes; the oldest output is discarded to make room for more,
+ * though it will still have been logged.  Output is read in batches of no more
+ * than half the limit, so any match up to half of the limit long will still be
+ * found.  0 removes the limit.  Returns the previous limit.
+ */
+static int
+orchlua_process_scrollback(lua_State *L)
+{
+	struct orch_process *self;
+	lua_Integer limit;
+	size_t prev;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+	limit = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, limit >= 0, 2, "scrollback must be >= 0");
+
+	prev = self->scrollback;
+	self->scrollback = limit;
+
+	lua_pushinteger(L, prev);
+	return (1);
+}
+
+/* Indexed by enum orch_filter_type. */
+static const char *orchlua_filter_names[] = {
+	"ansi", "crlf", "nul", "utf8", NULL,
+};
+
+/*
+ * filter([names]) -- run the process's output through each of the filters in
+ * the `names` array, in order, before it's logged or matched against:
+ *   - "ansi": strip terminal escape sequences.
+ *   - "crlf": translate CRLF line endings to LF.
+ *   - "nul": drop NUL bytes.
+ *   - "utf8": replace anything that isn't valid UTF-8 with U+FFFD.
+ * Output already in the buffer is left alone, and recordings always have the
+ * raw output.  No `names` removes any filters.
+ */
+static int
+orchlua_process_filter(lua_State *L)
+{
+	enum orch_filter_type types[ORCH_FILTER_MAX];
+	struct orch_filter *errfilter, *filter;
+	struct orch_process *self;
+	const char *name;
+	size_t ntypes;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+	ntypes = 0;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		ntypes = luaL_len(L, 2);
+		luaL_argcheck(L, ntypes <= ORCH_FILTER_MAX, 2,
+		    "too many filters");
+	}
+
+	for (size_t i = 0; i < ntypes; i++) {
+		lua_geti(L, 2, i + 1);
+		name = lua_tostring(L, -1);
+		for (int j = 0; ; j++) {
+			if (name == NULL || orchlua_filter_names[j] == NULL) {
+				luaL_pushfail(L);
+				lua_pushfstring(L, "unknown filter '%s'",
+				    name != NULL ? name : luaL_typename(L, -2));
+				return (2);
+			}
+
+			if (strcmp(name, orchlua_filter_names[j]) == 0) {
+				types[i] = j;
+				break;
+			}
+		}
+		lua_pop(L, 1);
+	}
+
+	filter = errfilter = NULL;
+	if (ntypes != 0) {
+		/* stderr has its own state, since it's a separate stream. */
+		filter = orch_filter_alloc(types, ntypes);
+		errfilter = orch_filter_alloc(types, ntypes);
+		if (filter == NULL || errfilter == NULL) {
+			orch_filter_free(filter);
+			orch_filter_free(errfilter);
+
+			luaL_pushfail(L);
+			lua_pushstring(L, strerror(ENOMEM));
+			return (2);
+		}
+	}
+
+	orch_filter_free(self->filter);
+	orch_filter_free(self->errfilter);
+	self->filter = filter;
+	self->errfilter = errfilter;
+
+	lua_pushboolean(L, 1);
+	return (1);
+}
+
+/*
+ * Writing to a pipe-mode child that's gone away would raise SIGPIPE, which
+ * would kill us unless the application has handled it.  Block it for the
+ * write(2) and discard the one that it raised, if any, so that the write just
+ * fails with EPIPE and the process-wide disposition is left alone.
+ */
+static ssize_t
+orch_write_nosigpipe(int fd, const void *buf, size_t len)
+{
+	sigset_t omask, pending, pipeset;
+	ssize_t sz;
+	int serr, sig;
+	bool waspending;
+
+	sigemptyset(&pipeset);
+	sigaddset(&pipeset, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &pipeset, &omask);
+
+	/* One that was already pending isn't ours to discard. */
+	sigpending(&pending);
+	waspending = sigismember(&pending, SIGPIPE);
+
+	sz = write(fd, buf, len);
+	serr = errno;
+	if (sz == -1 && serr == EPIPE && !waspending) {
+		sigpending(&pending);
+		if (sigismember(&pending, SIGPIPE))
+			(void)sigwait(&pipeset, &sig);
+	}
+
+	sigprocmask(SIG_SETMASK, &omask, NULL);
+	errno = serr;
+	return (sz);
+}
+
+/*
+ * write(data[, bytes[, delay]]) -- write `data` to the process, `bytes` at a
+ * time with `delay` seconds between each batch.  Batches are scheduled against
+ * a fixed start time, so time spent writing doesn't add up to extra delay.
+ * While we're waiting to write, we keep draining the process's output into its
+ * match buffer so that a chatty process can't fill up the pty and deadlock us;
+ * none of it is discarded to the scrollback limit until a match has seen it.
+ * Returns the number of bytes written and the number of bytes of output that
+ * were drained in the process.
+ */
+static int
+orchlua_process_dowrite(lua_State *L)
+{
+	struct pollfd pfd[3];
+	struct orch_process *self;
+	struct timespec next, start;
+	const char *buf;
+	lua_Integer chunksz;
+	lua_Number delay;
+	size_t boundary, bufsz, drained, nchunks, sent;
+	ssize_t sz;
+	int ret, wfd;
+	bool drainerr, drainout, due, erreof, outeof;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+	buf = luaL_checklstring(L, 2, &bufsz);
+	chunksz = luaL_optinteger(L, 3, 0);
+	delay = luaL_optnumber(L, 4, 0);
+	luaL_argcheck(L, chunksz >= 0, 3, "batch size must be >= 0");
+	luaL_argcheck(L, delay >= 0, 4, "delay must be >= 0");
+
+	wfd = self->pipe ? self->infd : self->termctl;
+	if (wfd == -1) {
+		luaL_pushfail(L);
+		lua_pushstring(L, self->pipe ? "process has no stdin pipe" :
+		    "process has already hit EOF");
+		return (2);
+	}
+
+	if (self->replay != NULL) {
+		uint64_t pos;
+
+		ret = orch_replay_expect(self->replay, buf, bufsz, &pos);
+		if (ret != 0) {
+			int serr = errno;
+
+			luaL_pushfail(L);
+			if (ret == 1)
+				lua_pushfstring(L,
+				    "input diverges from the recording at offset %I",
+				    (lua_Integer)pos);
+			else
+				lua_pushfstring(L, "replay: %s", strerror(serr));
+			return (2);
+		}
+	}
+
+	if (chunksz == 0 || (size_t)chunksz > bufsz)
+		chunksz = bufsz;
+
+	orch_clock_now(&start);
+	next = start;
+	nchunks = 0;
+	boundary = chunksz;
+	drained = sent = 0;
+	drainout = self->termctl != -1;
+	drainerr = self->errfd != -1;
+
+	/*
+	 * The pty is both our input and output, so it may appear twice; poll(2)
+	 * ignores the negative descriptors of anything we're not waiting on.
+	 */
+	pfd[0].events = POLLOUT;
+	pfd[1].events = pfd[2].events = POLLIN;
+	while (sent < bufsz) {
+		due = orch_deadline_expired(&next);
+
+		pfd[0].fd = due ? wfd : -1;
+		pfd[1].fd = drainout ? self->termctl : -1;
+		pfd[2].fd = drainerr ? self->errfd : -1;
+		for (int i = 0; i < 3; i++)
+			pfd[i].revents = 0;
+
+		ret = poll(pfd, 3, due ? -1 : orch_deadline_poll_ms(&next));
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			goto err;
+
+		sz = orchlua_process_drain_ready(self,
+		    (pfd[1].revents & (POLLIN | POLLHUP)) != 0,
+		    (pfd[2].revents & (POLLIN | POLLHUP)) != 0,
+		    &outeof, &erreof, false);
+		if (sz < 0)
+			goto err;
+
+		drained += sz;
+
+		/* Leave the EOF for the next read() to pick up. */
+		if (outeof)
+			drainout = false;
+		if (erreof)
+			drainerr = false;
+
+		/* A broken pipe is reported by the write. */
+		if (!due || (pfd[0].revents & (POLLOUT | POLLERR | POLLHUP)) == 0)
+			continue;
+
+		if (self->pipe)
+			sz = orch_write_nosigpipe(wfd, &buf[sent],
+			    boundary - sent);
+		else
+			sz = write(wfd, &buf[sent], boundary - sent);
+		if (sz == -1 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (sz == -1)
+			goto err;
+
+		if (self->log != NULL)
+			(void)orch_log_write(self->log, &buf[sent], sz);
+		if (self->rec != NULL)
+			(void)orch_record_event(self->rec, ORCH_REC_INPUT,
+			    &buf[sent], sz);
+
+		sent += sz;
+		if (sent == boundary) {
+			nchunks++;
+			boundary = MIN(bufsz, boundary + chunksz);
+
+			next = start;
+			orch_clock_add(&next, nchunks * delay);
+		}
+	}
+
+	lua_pushinteger(L, sent);
+	lua_pushinteger(L, drained);
+	return (2);
+err:
+	ret = errno;
+	luaL_pushfail(L);
+	lua_pushstring(L, strerror(ret));
+	return (2);
+}
+
+static int
+orchlua_process_write(lua_State *L)
+{
+	struct orch_process *self;
+	int nret;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+	nret = orchlua_process_dowrite(L);
+	if (self->log != NULL)
+		(void)orch_log_sync(self->log);
+	if (self->rec != NULL)
+		(void)orch_record_sync(self->rec);
+	return (nret);
+}
+
+/* Indexed by enum orch_log_flush. */
+static const char *orchlua_log_flushes[] = {
+	"full", "batch", "always", NULL,
+};
+
+/*
+ * Parse the `target` and `opts` at index 2 and 3 for logfile() and record().
+ * `*fdp` is set to a new descriptor for the target, or -1 if it was nil.
+ */
+static int
+orchlua_process_checksink(lua_State *L, int *fdp, enum orch_log_flush *flush,
+    size_t *bufsz)
+{
+	luaL_Stream *stream;
+	const char *name;
+	int error, fd;
+
+	*flush = ORCH_LOG_FULL;
+	*bufsz = ORCH_LOG_BUFSZ;
+	if (lua_type(L, 3) == LUA_TTABLE) {
+		if (lua_getfield(L, 3, "flush") != LUA_TNIL) {
+			name = lua_tostring(L, -1);
+			for (int i = 0; ; i++) {
+				if (name == NULL || orchlua_log_flushes[i] == NULL) {
+					luaL_pushfail(L);
+					lua_pushfstring(L, "unknown flush policy '%s'",
+					    name != NULL ? name : luaL_typename(L, -1));
+					return (2);
+				}
+
+				if (strcmp(name, orchlua_log_flushes[i]) == 0) {
+					*flush = i;
+					break;
+				}
+			}
+		}
+		lua_pop(L, 1);
+
+		if (lua_getfield(L, 3, "bufsize") != LUA_TNIL) {
+			if (!lua_isinteger(L, -1) || lua_tointeger(L, -1) < 0) {
+				luaL_pushfail(L);
+				lua_pushstring(L,
+				    "bufsize must be a non-negative integer");
+				return (2);
+			}
+
+			*bufsz = lua_tointeger(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+
+	fd = -1;
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		name = lua_tostring(L, 2);
+		fd = open(name, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if (fd == -1) {
+			error = errno;
+
+			luaL_pushfail(L);
+			lua_pushfstring(L, "%s: %s", name, strerror(error));
+			return (2);
+		}
+	} else if ((stream = luaL_testudata(L, 2, LUA_FILEHANDLE)) != NULL) {
+		if (stream->closef == NULL) {
+			luaL_pushfail(L);
+			lua_pushstring(L, "attempt to use a closed file");
+			return (2);
+		}
+
+		/*
+		 * We write to our own descriptor for it, so anything that's
+		 * already buffered in the stream needs to go out first.
+		 */
+		fflush(stream->f);
+		fd = fcntl(fileno(stream->f), F_DUPFD_CLOEXEC, 0);
+		if (fd == -1) {
+			error = errno;
+
+			luaL_pushfail(L);
+			lua_pushstring(L, strerror(error));
+			return (2);
+		}
+	} else if (!lua_isnoneornil(L, 2)) {
+		luaL_pushfail(L);
+		lua_pushstring(L, "target must be a path or an open file");
+		return (2);
+	}
+
+	*fdp = fd;
+	return (0);
+}
+
+/*
+ * logfile([target[, opts]]) -- write the process's transcript, i.e., its output
+ * along with anything that we write to it, to `target`: either a path, which
+ * is opened for appending, or an open file.  This happens as the output is
+ * read, so it doesn't need to go through Lua at all.  Any previous log is
+ * flushed and closed, and a nil `target` just stops logging.  `opts` may
+ * contain:
+ *   - flush: "full" (the default) to write the log out only as its buffer
+ *     fills, "batch" to also write it out whenever read() or write() return,
+ *     or "always" to not buffer it at all.
+ *   - bufsize: the size of the log buffer, in bytes.
+ *
+ * Returns true, or fail if we couldn't open the new log or finish writing the
+ * previous one; the new log is in place in the latter case.
+ */
+static int
+orchlua_process_logfile(lua_State *L)
+{
+	struct orch_process *self;
+	struct orch_log *log;
+	enum orch_log_flush flush;
+	size_t bufsz;
+	int error, fd;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+	if ((error = orchlua_process_checksink(L, &fd, &flush, &bufsz)) != 0)
+		return (error);
+
+	log = NULL;
+	if (fd != -1) {
+		log = orch_log_open(fd, flush, bufsz);
+		if (log == NULL) {
+			close(fd);
+
+			luaL_pushfail(L);
+			lua_pushstring(L, strerror(ENOMEM));
+			return (2);
+		}
+	}
+
+	error = 0;
+	if (self->log != NULL && orch_log_close(self->log) != 0)
+		error = errno;
+	self->log = log;
+
+	if (error != 0) {
+		luaL_pushfail(L);
+		lua_pushfstring(L, "previous log: %s", strerror(error));
+		return (2);
+	}
+
+	lua_pushboolean(L, 1);
+	return (1);
+}
+
+/*
+ * record([target[, opts]]) -- as logfile(), but write a timestamped recording
+ * of the session's input and output in the format described in orch_record.c.
+ * Output is recorded as it's read, before any processing.  Each call starts a
+ * new session in the recording.
+ */
+static int
+orchlua_process_record(lua_State *L)
+{
+	struct orch_process *self;
+	struct orch_record *rec;
+	enum orch_log_flush flush;
+	size_t bufsz;
+	int error, fd;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+	if ((error = orchlua_process_checksink(L, &fd, &flush, &bufsz)) != 0)
+		return (error);
+
+	rec = NULL;
+	if (fd != -1) {
+		rec = orch_record_open(fd, flush, bufsz);
+		if (rec == NULL) {
+			error = errno;
+
+			luaL_pushfail(L);
+			lua_pushstring(L, strerror(error));
+			return (2);
+		}
+	}
+
+	error = 0;
+	if (self->rec != NULL && orch_record_close(self->rec) != 0)
+		error = errno;
+	self->rec = rec;
+
+	if (error != 0) {
+		luaL_pushfail(L);
+		lua_pushfstring(L, "previous recording: %s", strerror(error));
+		return (2);
+	}
+
+	lua_pushboolean(L, 1);
+	return (1);
+}
+
+/*
+ * release() -- let the child proceed to exec the command.  The child's end of
+ * the IPC socket is close-on-exec, so we wait here for it to either close or
+ * for the child to tell us why it couldn't exec; the latter is returned as an
+ * error.
+ */
+static int
+orchlua_process_release(lua_State *L)
+{
+	struct orch_process *self;
+	int error;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+
+	error = orch_release_exec(self->ipc);
+	if (error != 0)
+		error = errno;
+	orch_ipc_close(self->ipc);
+	self->ipc = NULL;
+
+	if (error != 0) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(error));
+		return (2);
+	}
+
+	self->released = true;
+	if (self->error) {
+		luaL_pushfail(L);
+		lua_pushstring(L, self->errmsg[0] != '\0' ? self->errmsg :
+		    "child failed to execute");
+		return (2);
+	}
+
+	lua_pushboolean(L, 1);
+	return (1);
+}
+
+static int
+orchlua_process_released(lua_State *L)
+{
+	struct orch_process *self;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+	lua_pushboolean(L, self->released);
+	return (1);
 }
 
 static int
@@ -677,7 +2057,11 @@ orchlua_process_term(lua_State *L)
 
 	retvals = 0;
 	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
-	if (!orch_ipc_okay(self->ipc)) {
+	if (self->pipe) {
+		luaL_pushfail(L);
+		lua_pushstring(L, "process has no terminal");
+		return (2);
+	} else if (!orch_ipc_okay(self->ipc)) {
 		luaL_pushfail(L);
 		lua_pushstring(L, "process already released");
 		return (2);
@@ -689,6 +2073,14 @@ orchlua_process_term(lua_State *L)
 
 	sterm.proc = self;
 	sterm.initialized = false;
+
+	/* The child normally reported its attributes as part of spawning. */
+	if (self->child_term_valid) {
+		memcpy(&sterm.term, &self->child_term, sizeof(sterm.term));
+		sterm.initialized = true;
+		return (orchlua_tty_alloc(L, &sterm, &self->term));
+	}
+
 	orch_ipc_register(self->ipc, IPC_TERMIOS_SET, orchlua_process_term_set,
 	    &sterm);
 
@@ -745,6 +2137,135 @@ out:
 	return (retvals);
 }
 
+/*
+ * buffer() -- returns the match buffer that output is read into.
+ */
+static int
+orchlua_process_buffer(lua_State *L)
+{
+
+	luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+	lua_getuservalue(L, 1);
+	return (1);
+}
+
+/*
+ * status() -- returns "running" if the process hasn't exited yet, otherwise
+ * either "exited" and its exit code, or "signaled" and the signal that killed
+ * it.  If something other than us reaped the process, e.g., because SIGCHLD is
+ * ignored, then we just return "unknown".
+ */
+static int
+orchlua_process_status(lua_State *L)
+{
+	struct orch_process *self;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+	if (!orch_reap_check(self)) {
+		lua_pushstring(L, "running");
+		return (1);
+	} else if (!self->status_valid) {
+		lua_pushstring(L, "unknown");
+		return (1);
+	}
+
+	if (WIFSIGNALED(self->status)) {
+		lua_pushstring(L, "signaled");
+		lua_pushinteger(L, WTERMSIG(self->status));
+	} else {
+		lua_pushstring(L, "exited");
+		lua_pushinteger(L, WEXITSTATUS(self->status));
+	}
+
+	return (2);
+}
+
+static lua_Number
+orchlua_timeval_seconds(const struct timeval *tv)
+{
+
+	return (tv->tv_sec + tv->tv_usec / 1000000.0);
+}
+
+/*
+ * rusage() -- returns a table describing the resources that the process used
+ * over its lifetime, or fail if it hasn't exited yet:
+ *   - utime, stime: user and system CPU time, in seconds
+ *   - maxrss: peak resident set size, in kilobytes
+ *   - nvcsw, nivcsw: voluntary and involuntary context switches
+ *   - wall: seconds elapsed between spawn and exit
+ *
+ * As with wait4(2), this includes any descendants that the process waited for,
+ * but not those that it left behind.  It's not available at all if something
+ * other than us reaped the process.
+ */
+static int
+orchlua_process_rusage(lua_State *L)
+{
+	struct orch_process *self;
+	const struct rusage *ru;
+	long maxrss;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+	if (!orch_reap_check(self)) {
+		luaL_pushfail(L);
+		lua_pushstring(L, "process is still running");
+		return (2);
+	} else if (!self->status_valid) {
+		luaL_pushfail(L);
+		lua_pushstring(L, "process was reaped elsewhere");
+		return (2);
+	}
+
+	ru = &self->rusage;
+	maxrss = ru->ru_maxrss;
+#ifdef __APPLE__
+	/* macOS reports this in bytes, everyone else in kilobytes. */
+	maxrss /= 1024;
+#endif
+
+	lua_createtable(L, 0, 6);
+	lua_pushnumber(L, orchlua_timeval_seconds(&ru->ru_utime));
+	lua_setfield(L, -2, "utime");
+	lua_pushnumber(L, orchlua_timeval_seconds(&ru->ru_stime));
+	lua_setfield(L, -2, "stime");
+	lua_pushinteger(L, maxrss);
+	lua_setfield(L, -2, "maxrss");
+	lua_pushinteger(L, ru->ru_nvcsw);
+	lua_setfield(L, -2, "nvcsw");
+	lua_pushinteger(L, ru->ru_nivcsw);
+	lua_setfield(L, -2, "nivcsw");
+	lua_pushnumber(L, (self->exited.tv_sec - self->started.tv_sec) +
+	    (self->exited.tv_nsec - self->started.tv_nsec) / 1000000000.0);
+	lua_setfield(L, -2, "wall");
+
+	return (1);
+}
+
+/*
+ * stderr() -- returns whatever we've read from the process's stderr since the
+ * last call, if it was spawned with a separate stderr pipe.
+ */
+static int
+orchlua_process_stderr(lua_State *L)
+{
+	struct orch_process *self;
+	const char *data;
+	size_t len;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_PROCESSHANDLE);
+	if (!self->errsep) {
+		luaL_pushfail(L);
+		lua_pushstring(L, "stderr is not being collected separately");
+		return (2);
+	}
+
+	data = orch_matchbuf_data(&self->errbuf, &len);
+	lua_pushlstring(L, data, len);
+	orch_matchbuf_consume(&self->errbuf, len);
+	return (1);
+}
+
 static int
 orchlua_process_eof(lua_State *L)
 {
@@ -757,11 +2278,20 @@ orchlua_process_eof(lua_State *L)
 
 #define	PROCESS_SIMPLE(n)	{ #n, orchlua_process_ ## n }
 static const luaL_Reg orchlua_process[] = {
+	PROCESS_SIMPLE(batch),
+	PROCESS_SIMPLE(buffer),
 	PROCESS_SIMPLE(close),
+	PROCESS_SIMPLE(filter),
+	PROCESS_SIMPLE(logfile),
 	PROCESS_SIMPLE(read),
+	PROCESS_SIMPLE(record),
 	PROCESS_SIMPLE(write),
 	PROCESS_SIMPLE(release),
 	PROCESS_SIMPLE(released),
+	PROCESS_SIMPLE(rusage),
+	PROCESS_SIMPLE(scrollback),
+	PROCESS_SIMPLE(status),
+	PROCESS_SIMPLE(stderr),
 	PROCESS_SIMPLE(term),
 	PROCESS_SIMPLE(eof),
 	{ NULL, NULL },
@@ -799,19 +2329,116 @@ orchlua_regex_error(lua_State *L, regex_t *self, int error)
 	return (2);
 }
 
+/*
+ * regexec(3) wrapper that matches within subject[start, len) without relying
+ * on NUL termination, so that binary output doesn't silently truncate the
+ * subject.  Offsets in pmatch are relative to `subject`.  A `start` past the
+ * beginning of the subject is never treated as the beginning of a line, so a
+ * matcher resuming a scan won't spuriously satisfy a leading ^.
+ */
+static int
+orch_regexec(const regex_t *regex, const char *subject, size_t start,
+    size_t len, size_t nmatch, regmatch_t pmatch[], int eflags)
+{
+#ifdef REG_STARTEND
+	assert(nmatch > 0);
+
+	if (start != 0)
+		eflags |= REG_NOTBOL;
+
+	pmatch[0].rm_so = start;
+	pmatch[0].rm_eo = len;
+	return (regexec(regex, subject, nmatch, pmatch, eflags | REG_STARTEND));
+#else
+	char *scratch, *seg;
+	size_t off, seglen;
+	int error;
+
+	/*
+	 * No REG_STARTEND, so we make a NUL-terminated copy and match each
+	 * NUL-delimited segment of it in turn.  Matches can't span a NUL here,
+	 * but we at least won't lose everything after the first one.
+	 */
+	scratch = malloc(len - start + 1);
+	if (scratch == NULL)
+		return (REG_ESPACE);
+
+	memcpy(scratch, &subject[start], len - start);
+	scratch[len - start] = '\0';
+
+	error = REG_NOMATCH;
+	for (off = 0; off <= len - start; off += seglen + 1) {
+		int segflags = eflags;
+
+		seg = &scratch[off];
+		seglen = strlen(seg);
+
+		if (start + off != 0)
+			segflags |= REG_NOTBOL;
+		if (off + seglen != len - start)
+			segflags |= REG_NOTEOL;
+
+		error = regexec(regex, seg, nmatch, pmatch, segflags);
+		if (error != REG_NOMATCH)
+			break;
+	}
+
+	if (error == 0) {
+		for (size_t i = 0; i < nmatch; i++) {
+			if (pmatch[i].rm_so == -1)
+				continue;
+			pmatch[i].rm_so += start + off;
+			pmatch[i].rm_eo += start + off;
+		}
+	}
+
+	free(scratch);
+	return (error);
+#endif
+}
+
+/* Enough for most patterns without needing to allocate. */
+#define	REGEX_NMATCH_STATIC	10
+
+/*
+ * find(subject[, init]) -- match against `subject`, which may be a string or a
+ * match buffer, starting at index `init`.  Returns the first and last indices
+ * of the match like string.find(), followed by the string captured by each
+ * subexpression (nil for those that didn't participate in the match), or nil
+ * if there's no match.
+ */
 static int
 orchlua_regex_find(lua_State *L)
 {
+	regmatch_t smatch[REGEX_NMATCH_STATIC], *pmatch;
 	const char *subject;
 	regex_t *self;
-	regmatch_t match;
+	size_t len, nmatch, start;
 	int error;
 
 	self = luaL_checkudata(L, 1, ORCHLUA_REGEXHANDLE);
-	subject = luaL_checkstring(L, 2);
+	subject = orchlua_checksubject(L, 2, &len);
+	start = orchlua_optindex(L, 3, len);
+
+	/* Checked up front, since it raises and pmatch may need to be freed. */
+	nmatch = self->re_nsub + 1;
+	luaL_checkstack(L, nmatch + 1, "too many captures");
+
+	if (nmatch > REGEX_NMATCH_STATIC) {
+		pmatch = calloc(nmatch, sizeof(*pmatch));
+		if (pmatch == NULL) {
+			luaL_pushfail(L);
+			lua_pushstring(L, strerror(ENOMEM));
+			return (2);
+		}
+	} else {
+		pmatch = &smatch[0];
+	}
 
-	error = regexec(self, subject, 1, &match, 0);
+	error = orch_regexec(self, subject, start, len, nmatch, pmatch, 0);
 	if (error != 0) {
+		if (pmatch != &smatch[0])
+			free(pmatch);
 		if (error == REG_NOMATCH) {
 			lua_pushnil(L);
 			return (1);
@@ -825,9 +2452,22 @@ orchlua_regex_find(lua_State *L)
 	 * actually the the character just *after* the match, so we'll just take
 	 * that as-is rather than - 1 + 1.
 	 */
-	lua_pushnumber(L, match.rm_so + 1);
-	lua_pushnumber(L, match.rm_eo);
-	return (2);
+	lua_pushnumber(L, pmatch[0].rm_so + 1);
+	lua_pushnumber(L, pmatch[0].rm_eo);
+
+	for (size_t i = 1; i < nmatch; i++) {
+		if (pmatch[i].rm_so == -1) {
+			lua_pushnil(L);
+			continue;
+		}
+
+		lua_pushlstring(L, &subject[pmatch[i].rm_so],
+		    pmatch[i].rm_eo - pmatch[i].rm_so);
+	}
+
+	if (pmatch != &smatch[0])
+		free(pmatch);
+	return (nmatch + 1);
 }
 
 static int
@@ -900,6 +2540,10 @@ luaopen_orch_core(lua_State *L)
 	luaL_newlib(L, orchlib);
 
 	orchlua_setup_tty(L);
+	orchlua_setup_poll(L);
+	orchlua_setup_dfa(L);
+	orchlua_setup_matchbuf(L);
+	orchlua_setup_multimatch(L);
 
 	register_process_metatable(L);
 	register_regex_metatable(L);
@@ -0,0 +1,433 @@
+/*-
+ * Copyright (c) 2024 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "orch.h"
+#include "orch_lib.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#define	ORCHLUA_POLLERHANDLE	"orchlua_poller"
+
+/*
+ * Each process may contribute its pty (or stdout and stderr pipes), its IPC
+ * socket until it's released, and its exit notification until it's been reaped.
+ */
+#define	POLL_FDS_PER_PROC	4
+
+/*
+ * The poller keeps its member processes in its uservalue (an array) so that
+ * they can't be collected out from underneath it, and keeps a pollfd array
+ * around to be reused across wait() calls.  The fds are rebuilt on every wait,
+ * since a process's descriptors come and go as it's released and hits EOF.
+ */
+struct orch_poller {
+	struct pollfd	*fds;
+	int		*owners;
+	size_t		 fdcap;
+};
+
+static int
+orch_poller_reserve(struct orch_poller *poller, size_t nfds)
+{
+	struct pollfd *fds;
+	int *owners;
+
+	if (nfds <= poller->fdcap)
+		return (0);
+
+	fds = realloc(poller->fds, nfds * sizeof(*fds));
+	if (fds == NULL)
+		return (-1);
+	poller->fds = fds;
+
+	owners = realloc(poller->owners, nfds * sizeof(*owners));
+	if (owners == NULL)
+		return (-1);
+	poller->owners = owners;
+
+	poller->fdcap = nfds;
+	return (0);
+}
+
+/*
+ * Drain any IPC messages that the child has sent us before release; the only
+ * unsolicited message we expect is an IPC_ERROR, which is handled by the
+ * registered callback.
+ */
+static void
+orch_poller_service_ipc(struct orch_process *proc)
+{
+	struct orch_ipc_msg *msg;
+
+	while (proc->ipc != NULL && orch_ipc_okay(proc->ipc)) {
+		msg = NULL;
+		if (orch_ipc_recv(proc->ipc, &msg) != 0 || msg == NULL)
+			break;
+
+		orch_ipc_msg_free(msg);
+	}
+}
+
+/*
+ * Wait on all of the processes in the table at `tblidx`, and push a table of
+ * the processes that are ready.  The table will be empty if we timed out.  If
+ * none of them have anything left to wait on, then we just wait out the
+ * timeout, or fail if there isn't one.
+ */
+static int
+orch_poller_wait(lua_State *L, struct orch_poller *poller, int tblidx,
+    lua_Number timeout)
+{
+	struct timespec deadline, *deadlinep;
+	struct orch_process *proc;
+	size_t nfds;
+	int lastowner, nprocs, nready, ret;
+
+	tblidx = lua_absindex(L, tblidx);
+	nprocs = luaL_len(L, tblidx);
+
+	if (orch_poller_reserve(poller, nprocs * POLL_FDS_PER_PROC) != 0) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(ENOMEM));
+		return (2);
+	}
+
+	nfds = 0;
+	for (int i = 1; i <= nprocs; i++) {
+		lua_rawgeti(L, tblidx, i);
+		proc = luaL_testudata(L, -1, ORCHLUA_PROCESSHANDLE);
+		lua_pop(L, 1);
+
+		if (proc == NULL) {
+			luaL_pushfail(L);
+			lua_pushfstring(L, "element %d is not a process", i);
+			return (2);
+		}
+
+		if (proc->termctl != -1) {
+			poller->fds[nfds].fd = proc->termctl;
+			poller->fds[nfds].events = POLLIN;
+			poller->owners[nfds++] = i;
+		}
+
+		if (proc->errfd != -1) {
+			poller->fds[nfds].fd = proc->errfd;
+			poller->fds[nfds].events = POLLIN;
+			poller->owners[nfds++] = i;
+		}
+
+		if (proc->ipc != NULL && orch_ipc_okay(proc->ipc)) {
+			poller->fds[nfds].fd = orch_ipc_fd(proc->ipc);
+			poller->fds[nfds].events = POLLIN;
+			poller->owners[nfds++] = i;
+		}
+
+		/* A process that exits is ready; read() will report it. */
+		if (proc->pid != 0 && proc->reapfd != -1 &&
+		    (proc->termctl != -1 || proc->errfd != -1)) {
+			poller->fds[nfds].fd = proc->reapfd;
+			poller->fds[nfds].events = POLLIN;
+			poller->owners[nfds++] = i;
+		}
+	}
+
+	if (timeout >= 0) {
+		orch_deadline_init(&deadline, timeout);
+		deadlinep = &deadline;
+	} else {
+		deadlinep = NULL;
+	}
+
+	/*
+	 * With nothing left to wait on, we still sit out the timeout, just as
+	 * we would for processes that stay quiet; without one, we'd never
+	 * return.
+	 */
+	if (nfds == 0 && deadlinep == NULL) {
+		luaL_pushfail(L);
+		lua_pushstring(L, "nothing to wait on");
+		return (2);
+	}
+
+	do {
+		for (size_t i = 0; i < nfds; i++)
+			poller->fds[i].revents = 0;
+
+		ret = poll(poller->fds, nfds, orch_deadline_poll_ms(deadlinep));
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret == -1) {
+		int serr = errno;
+
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(serr));
+		return (2);
+	}
+
+	/*
+	 * A process may have several of its descriptors ready; owners are
+	 * recorded in order, so we just need to avoid reporting the same one
+	 * twice in a row.
+	 */
+	lua_newtable(L);
+	lastowner = 0;
+	nready = 0;
+	for (size_t i = 0; i < nfds && ret > 0; i++) {
+		int owner;
+
+		if (poller->fds[i].revents == 0)
+			continue;
+
+		ret--;
+		owner = poller->owners[i];
+
+		lua_rawgeti(L, tblidx, owner);
+		proc = lua_touserdata(L, -1);
+		if (proc->ipc != NULL &&
+		    poller->fds[i].fd == orch_ipc_fd(proc->ipc))
+			orch_poller_service_ipc(proc);
+
+		/*
+		 * The exit notification may be shared with other processes, so
+		 * make sure that it's actually this one that exited.
+		 */
+		if (poller->fds[i].fd == proc->reapfd) {
+			orch_reap_ack(proc->reapfd);
+			if (!orch_reap_check(proc)) {
+				lua_pop(L, 1);
+				continue;
+			}
+		}
+
+		if (owner == lastowner) {
+			lua_pop(L, 1);
+			continue;
+		}
+
+		lastowner = owner;
+		lua_rawseti(L, -2, ++nready);
+	}
+
+	return (1);
+}
+
+static lua_Number
+orch_poller_checktimeout(lua_State *L, int idx)
+{
+	lua_Number timeout;
+
+	if (lua_isnoneornil(L, idx))
+		return (-1);
+
+	timeout = luaL_checknumber(L, idx);
+	luaL_argcheck(L, timeout >= 0, idx, "timeout must be >= 0");
+	return (timeout);
+}
+
+/*
+ * wait_any(processes[, timeout]) -- wait for any of the processes in the
+ * `processes` array to have output (or EOF) available, returning an array of
+ * the ones that do.  An empty array is returned on timeout, even if there was
+ * nothing to wait on; without a timeout, that's an error instead.
+ */
+static int
+orchlua_wait_any(lua_State *L)
+{
+	struct orch_poller *poller;
+	lua_Number timeout;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	timeout = orch_poller_checktimeout(L, 2);
+
+	/*
+	 * The poller is a throwaway, but it's still allocated as a userdata so
+	 * that its pollfd array is released by __gc if anything below raises.
+	 */
+	poller = lua_newuserdata(L, sizeof(*poller));
+	memset(poller, 0, sizeof(*poller));
+	luaL_setmetatable(L, ORCHLUA_POLLERHANDLE);
+
+	return (orch_poller_wait(L, poller, 1, timeout));
+}
+
+/*
+ * poller() -- create a persistent poller that processes may be added to and
+ * removed from.
+ */
+static int
+orchlua_poller(lua_State *L)
+{
+	struct orch_poller *poller;
+
+	poller = lua_newuserdata(L, sizeof(*poller));
+	memset(poller, 0, sizeof(*poller));
+
+	luaL_setmetatable(L, ORCHLUA_POLLERHANDLE);
+
+	lua_newtable(L);
+	lua_setuservalue(L, -2);
+
+	return (1);
+}
+
+static int
+orchlua_poller_add(lua_State *L)
+{
+	int nprocs;
+
+	luaL_checkudata(L, 1, ORCHLUA_POLLERHANDLE);
+	luaL_checkudata(L, 2, ORCHLUA_PROCESSHANDLE);
+
+	lua_getuservalue(L, 1);
+	nprocs = luaL_len(L, -1);
+	for (int i = 1; i <= nprocs; i++) {
+		lua_rawgeti(L, -1, i);
+		if (lua_rawequal(L, -1, 2)) {
+			luaL_pushfail(L);
+			lua_pushstring(L, "process already added to poller");
+			return (2);
+		}
+
+		lua_pop(L, 1);
+	}
+
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, nprocs + 1);
+
+	lua_pushboolean(L, 1);
+	return (1);
+}
+
+static int
+orchlua_poller_remove(lua_State *L)
+{
+	int nprocs;
+
+	luaL_checkudata(L, 1, ORCHLUA_POLLERHANDLE);
+	luaL_checkudata(L, 2, ORCHLUA_PROCESSHANDLE);
+
+	lua_getuservalue(L, 1);
+	nprocs = luaL_len(L, -1);
+	for (int i = 1; i <= nprocs; i++) {
+		lua_rawgeti(L, -1, i);
+		if (!lua_rawequal(L, -1, 2)) {
+			lua_pop(L, 1);
+			continue;
+		}
+
+		lua_pop(L, 1);
+
+		/* Shift everything after it down a slot. */
+		for (int j = i; j < nprocs; j++) {
+			lua_rawgeti(L, -1, j + 1);
+			lua_rawseti(L, -2, j);
+		}
+
+		lua_pushnil(L);
+		lua_rawseti(L, -2, nprocs);
+
+		lua_pushboolean(L, 1);
+		return (1);
+	}
+
+	luaL_pushfail(L);
+	lua_pushstring(L, "process not present in poller");
+	return (2);
+}
+
+static int
+orchlua_poller_count(lua_State *L)
+{
+
+	luaL_checkudata(L, 1, ORCHLUA_POLLERHANDLE);
+
+	lua_getuservalue(L, 1);
+	lua_pushinteger(L, luaL_len(L, -1));
+	return (1);
+}
+
+/*
+ * wait([timeout]) -- as wait_any(), but for the processes in this poller.
+ */
+static int
+orchlua_poller_wait(lua_State *L)
+{
+	struct orch_poller *self;
+	lua_Number timeout;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_POLLERHANDLE);
+	timeout = orch_poller_checktimeout(L, 2);
+
+	lua_getuservalue(L, 1);
+	return (orch_poller_wait(L, self, -1, timeout));
+}
+
+static int
+orchlua_poller_close(lua_State *L)
+{
+	struct orch_poller *self;
+
+	self = luaL_checkudata(L, 1, ORCHLUA_POLLERHANDLE);
+
+	free(self->fds);
+	free(self->owners);
+	self->fds = NULL;
+	self->owners = NULL;
+	self->fdcap = 0;
+
+	return (0);
+}
+
+#define	POLLER_SIMPLE(n)	{ #n, orchlua_poller_ ## n }
+static const luaL_Reg orchlua_poller_methods[] = {
+	POLLER_SIMPLE(add),
+	POLLER_SIMPLE(count),
+	POLLER_SIMPLE(remove),
+	POLLER_SIMPLE(wait),
+	{ NULL, NULL },
+};
+
+static const luaL_Reg orchlua_poller_meta[] = {
+	{ "__index", NULL },	/* Set during registration */
+	{ "__gc", orchlua_poller_close },
+	{ "__close", orchlua_poller_close },
+	{ NULL, NULL },
+};
+
+static void
+register_poller_metatable(lua_State *L)
+{
+	luaL_newmetatable(L, ORCHLUA_POLLERHANDLE);
+	luaL_setfuncs(L, orchlua_poller_meta, 0);
+
+	luaL_newlibtable(L, orchlua_poller_methods);
+	luaL_setfuncs(L, orchlua_poller_methods, 0);
+	lua_setfield(L, -2, "__index");
+
+	lua_pop(L, 1);
+}
+
+int
+orchlua_setup_poll(lua_State *L)
+{
+
+	/* Module is on the stack. */
+	lua_pushcfunction(L, orchlua_poller);
+	lua_setfield(L, -2, "poller");
+
+	lua_pushcfunction(L, orchlua_wait_any);
+	lua_setfield(L, -2, "wait_any");
+
+	register_poller_metatable(L);
+
+	return (1);
+}
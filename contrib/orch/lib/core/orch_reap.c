@@ -0,0 +1,330 @@
+/*-
+ * Copyright (c) 2024 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/param.h>
+#include <sys/resource.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#else
+#include <sys/event.h>
+#endif
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "orch.h"
+#include "orch_lib.h"
+
+/*
+ * A process's pty only reports EOF once everything holding the pts open has
+ * gone away, which may be long after the process itself has exited if it left
+ * children behind.  To notice the exit itself, each process gets a descriptor
+ * that polls readable once it has exited:
+ *
+ *  - Linux: a pidfd
+ *  - Everything else: a kqueue with an EVFILT_PROC/NOTE_EXIT filter
+ *
+ * If neither of those is available (e.g., a Linux kernel without pidfd_open),
+ * then we fall back to a SIGCHLD handler that writes to a self-pipe for each
+ * such process; a wakeup on one just means that any child may have exited.
+ * Each process gets its own pipe so that clearing a wakeup for one of them
+ * doesn't swallow it for the others.
+ *
+ * Note that the handler is process-wide: while any process is relying on the
+ * fallback, our handler replaces whatever SIGCHLD disposition the embedding
+ * program had set.  A previous handler is still called from ours, and the
+ * previous disposition is restored once the last such process is closed, but
+ * a SIG_IGN disposition (and its automatic reaping) is suspended until then.
+ */
+
+/* How often we check on a process with no exit notification, in ms. */
+#define	REAP_POLL_MS	10
+
+struct orch_reap_pipe {
+	int	rfd;
+	int	wfd;
+};
+
+/*
+ * Only modified with SIGCHLD blocked, so the handler always sees a consistent
+ * view of the pipes.
+ */
+static struct orch_reap_pipe *orch_reap_pipes;
+static size_t orch_reap_npipes, orch_reap_pipecap;
+static struct sigaction orch_reap_prevsa;
+
+static void
+orch_reap_sigchld(int signo, siginfo_t *info, void *ctx)
+{
+	int serrno = errno;
+
+	for (size_t i = 0; i < orch_reap_npipes; i++)
+		(void)write(orch_reap_pipes[i].wfd, "", 1);
+
+	if ((orch_reap_prevsa.sa_flags & SA_SIGINFO) != 0)
+		orch_reap_prevsa.sa_sigaction(signo, info, ctx);
+	else if (orch_reap_prevsa.sa_handler != SIG_DFL &&
+	    orch_reap_prevsa.sa_handler != SIG_IGN)
+		orch_reap_prevsa.sa_handler(signo);
+
+	errno = serrno;
+}
+
+static int
+orch_reap_setfl(int fd)
+{
+
+	if (fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC) == -1)
+		return (-1);
+	return (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK));
+}
+
+static struct orch_reap_pipe *
+orch_reap_pipe_lookup(int fd)
+{
+
+	for (size_t i = 0; i < orch_reap_npipes; i++) {
+		if (orch_reap_pipes[i].rfd == fd)
+			return (&orch_reap_pipes[i]);
+	}
+
+	return (NULL);
+}
+
+static int
+orch_reap_pipe_open(void)
+{
+	struct sigaction sa = {
+		.sa_sigaction = orch_reap_sigchld,
+		.sa_flags = SA_RESTART | SA_NOCLDSTOP | SA_SIGINFO,
+	};
+	struct orch_reap_pipe *pipes;
+	sigset_t mask, omask;
+	size_t newcap;
+	int fds[2], ret;
+
+	if (pipe(fds) == -1)
+		return (-1);
+	if (orch_reap_setfl(fds[0]) == -1 || orch_reap_setfl(fds[1]) == -1)
+		goto fail;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &omask);
+
+	ret = -1;
+	if (orch_reap_npipes == orch_reap_pipecap) {
+		newcap = MAX(orch_reap_pipecap * 2, 4);
+		pipes = realloc(orch_reap_pipes, newcap * sizeof(*pipes));
+		if (pipes == NULL)
+			goto out;
+
+		orch_reap_pipes = pipes;
+		orch_reap_pipecap = newcap;
+	}
+
+	if (orch_reap_npipes == 0) {
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(SIGCHLD, &sa, &orch_reap_prevsa) == -1)
+			goto out;
+	}
+
+	orch_reap_pipes[orch_reap_npipes].rfd = fds[0];
+	orch_reap_pipes[orch_reap_npipes].wfd = fds[1];
+	orch_reap_npipes++;
+	ret = 0;
+out:
+	sigprocmask(SIG_SETMASK, &omask, NULL);
+	if (ret == 0)
+		return (fds[0]);
+fail:
+	close(fds[0]);
+	close(fds[1]);
+	return (-1);
+}
+
+static void
+orch_reap_pipe_close(struct orch_reap_pipe *rpipe)
+{
+	sigset_t mask, omask;
+	int rfd, wfd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &omask);
+
+	rfd = rpipe->rfd;
+	wfd = rpipe->wfd;
+	*rpipe = orch_reap_pipes[--orch_reap_npipes];
+
+	/* The last one out puts things back the way they were. */
+	if (orch_reap_npipes == 0)
+		(void)sigaction(SIGCHLD, &orch_reap_prevsa, NULL);
+
+	sigprocmask(SIG_SETMASK, &omask, NULL);
+
+	close(rfd);
+	close(wfd);
+}
+
+/*
+ * Returns a descriptor that will poll readable once `pid` exits, or -1 if we
+ * couldn't get one; callers should just rely on pty EOF in that case.
+ */
+int
+orch_reap_open(pid_t pid)
+{
+#if defined(__linux__)
+#ifdef SYS_pidfd_open
+	int fd;
+
+	/* pidfds are always close-on-exec. */
+	fd = syscall(SYS_pidfd_open, pid, 0);
+	if (fd != -1)
+		return (fd);
+#endif
+#else
+	struct kevent kev;
+	int fd;
+
+	fd = kqueue();
+	if (fd != -1) {
+		EV_SET(&kev, pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT,
+		    0, NULL);
+		if (orch_reap_setfl(fd) == 0 &&
+		    kevent(fd, &kev, 1, NULL, 0, NULL) == 0)
+			return (fd);
+
+		close(fd);
+	}
+#endif
+
+	(void)pid;
+	return (orch_reap_pipe_open());
+}
+
+void
+orch_reap_close(int fd)
+{
+	struct orch_reap_pipe *rpipe;
+
+	if (fd == -1)
+		return;
+
+	if ((rpipe = orch_reap_pipe_lookup(fd)) != NULL)
+		orch_reap_pipe_close(rpipe);
+	else
+		close(fd);
+}
+
+/*
+ * Clear a wakeup on `fd`; only the self-pipes need it, the others stay readable
+ * until the process is reaped and we stop polling them.
+ */
+void
+orch_reap_ack(int fd)
+{
+	char buf[64];
+
+	if (fd == -1 || orch_reap_pipe_lookup(fd) == NULL)
+		return;
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		continue;
+}
+
+/*
+ * Note when `p` exited, and so how long we'll keep reading its output if its
+ * pty doesn't report EOF on its own.
+ */
+static void
+orch_reap_exited(struct orch_process *p)
+{
+
+	orch_clock_now(&p->exited);
+	p->exitgrace = p->exited;
+	orch_clock_add(&p->exitgrace, ORCH_EXIT_GRACE);
+}
+
+/*
+ * Reap `p` if it has exited, recording its status, resource usage and when we
+ * noticed.  Returns true if it has been reaped, either now or previously; the
+ * status and resource usage are only valid if `status_valid` is set.
+ */
+bool
+orch_reap_check(struct orch_process *p)
+{
+	pid_t wret;
+
+	if (p->pid == 0)
+		return (true);
+
+	while ((wret = wait4(p->pid, &p->status, WNOHANG, &p->rusage)) == -1 &&
+	    errno == EINTR)
+		continue;
+
+	/*
+	 * Somebody else reaped it already: either the embedding program did, or
+	 * SIGCHLD is ignored and the kernel did.  It's gone all the same, but we
+	 * have no idea how it went.
+	 */
+	if (wret == -1 && errno == ECHILD) {
+		orch_reap_exited(p);
+		memset(&p->rusage, 0, sizeof(p->rusage));
+		p->status = 0;
+		p->status_valid = false;
+		p->pid = 0;
+		return (true);
+	}
+
+	if (wret != p->pid)
+		return (false);
+
+	orch_reap_exited(p);
+	p->status_valid = true;
+	p->pid = 0;
+	return (true);
+}
+
+/*
+ * Wait for `p` to exit until `deadline`, or indefinitely if it's NULL.  Returns
+ * true if it has been reaped.
+ */
+bool
+orch_reap_wait(struct orch_process *p, const struct timespec *deadline)
+{
+	struct pollfd pfd;
+	int ms;
+
+	while (!orch_reap_check(p)) {
+		if (orch_deadline_expired(deadline))
+			return (false);
+
+		ms = orch_deadline_poll_ms(deadline);
+		if (p->reapfd == -1) {
+			/* Nothing to wait on, so we just have to check back. */
+			if (ms == -1 || ms > REAP_POLL_MS)
+				ms = REAP_POLL_MS;
+			(void)poll(NULL, 0, ms);
+			continue;
+		}
+
+		pfd.fd = p->reapfd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, ms) > 0)
+			orch_reap_ack(p->reapfd);
+	}
+
+	return (true);
+}
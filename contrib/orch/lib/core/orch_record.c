@@ -0,0 +1,153 @@
+/*-
+ * Copyright (c) 2024 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "orch.h"
+#include "orch_lib.h"
+
+/*
+ * A recording is an append-only series of sessions, each of which is:
+ *
+ *   "ORCHREC" 0x01	magic and format version
+ *   u64 realtime	wall clock time at the start of the session, in ns
+ *
+ * followed by any number of events:
+ *
+ *   u8  type		enum orch_record_event
+ *   u64 time		monotonic ns since the start of the session
+ *   u32 length
+ *   u8  data[length]
+ *
+ * All integers are big-endian.  No event type collides with the first byte of
+ * the magic, so a reader can always tell where a new session starts.  Output is
+ * recorded as it comes in, before any processing, and the writes are buffered
+ * through an orch_log.  The sizes are in orch_lib.h for orch_replay.c's sake.
+ */
+struct orch_record {
+	struct orch_log		*log;
+	struct timespec		 start;
+};
+
+static void
+orch_record_enc32(unsigned char *p, uint32_t val)
+{
+
+	for (int i = 3; i >= 0; i--, val >>= 8)
+		p[i] = val & 0xff;
+}
+
+static void
+orch_record_enc64(unsigned char *p, uint64_t val)
+{
+
+	for (int i = 7; i >= 0; i--, val >>= 8)
+		p[i] = val & 0xff;
+}
+
+/*
+ * Start a new session on `fd`, which the recording takes ownership of even if
+ * we fail.
+ */
+struct orch_record *
+orch_record_open(int fd, enum orch_log_flush flush, size_t bufsz)
+{
+	unsigned char hdr[ORCH_REC_HDRSZ];
+	struct orch_record *rec;
+	struct timespec now;
+	int serr;
+
+	rec = calloc(1, sizeof(*rec));
+	if (rec == NULL) {
+		close(fd);
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	rec->log = orch_log_open(fd, flush, bufsz);
+	if (rec->log == NULL) {
+		close(fd);
+		free(rec);
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	(void)clock_gettime(CLOCK_REALTIME, &now);
+	orch_clock_now(&rec->start);
+
+	memcpy(hdr, ORCH_REC_MAGIC, ORCH_REC_MAGICSZ);
+	orch_record_enc64(&hdr[ORCH_REC_MAGICSZ],
+	    (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+
+	/* Make sure the session is marked even if nothing else happens. */
+	if (orch_log_write(rec->log, (const char *)hdr, sizeof(hdr)) != 0 ||
+	    orch_log_flush(rec->log) != 0) {
+		serr = errno;
+
+		(void)orch_log_close(rec->log);
+		free(rec);
+		errno = serr;
+		return (NULL);
+	}
+
+	return (rec);
+}
+
+int
+orch_record_event(struct orch_record *rec, enum orch_record_event type,
+    const char *data, size_t len)
+{
+	unsigned char evhdr[ORCH_REC_EVHDRSZ];
+	struct timespec now;
+	uint64_t elapsed;
+	size_t chunk;
+
+	orch_clock_now(&now);
+	elapsed = (uint64_t)(now.tv_sec - rec->start.tv_sec) * 1000000000 +
+	    now.tv_nsec - rec->start.tv_nsec;
+
+	/* Anything too large for one event is split up; EOF has no data. */
+	do {
+		chunk = len;
+		if (chunk > UINT32_MAX)
+			chunk = UINT32_MAX;
+
+		evhdr[0] = type;
+		orch_record_enc64(&evhdr[1], elapsed);
+		orch_record_enc32(&evhdr[9], chunk);
+		if (orch_log_write(rec->log, (const char *)evhdr,
+		    sizeof(evhdr)) != 0 ||
+		    orch_log_write(rec->log, data, chunk) != 0)
+			return (-1);
+
+		data += chunk;
+		len -= chunk;
+	} while (len != 0);
+
+	return (0);
+}
+
+int
+orch_record_sync(struct orch_record *rec)
+{
+
+	return (orch_log_sync(rec->log));
+}
+
+int
+orch_record_close(struct orch_record *rec)
+{
+	int error;
+
+	error = orch_log_close(rec->log);
+	free(rec);
+	return (error);
+}
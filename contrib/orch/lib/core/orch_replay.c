@@ -0,0 +1,407 @@
+/*-
+ * Copyright (c) 2024 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/param.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "orch.h"
+#include "orch_lib.h"
+
+/*
+ * Playback of a session from a recording written by orch_record.c.  A replay
+ * is spawned like a pipe-mode process, but the child plays the recording back
+ * rather than exec'ing anything: output and stderr are written out on the
+ * recorded schedule (scaled by the speed, or not at all for a speed of 0), and
+ * recorded input is waited for before anything that followed it is played.
+ *
+ * The parent keeps its own copy of the replay to check whatever the script
+ * writes against the recorded input, so that a script that's gone off the rails
+ * fails at the write rather than just timing out.  Everything is read with
+ * pread(2), so the two never disturb each other's position in the file.
+ */
+#define	REPLAY_BUFSZ	(64 * 1024)
+
+struct orch_replay {
+	int			 fd;
+	off_t			 off;		/* Next event header */
+	double			 speed;		/* 0 for no delays */
+
+	/* Input checking; the unchecked part of the current input event. */
+	off_t			 inoff;
+	uint32_t		 inleft;
+	uint64_t		 inpos;		/* Input checked so far */
+};
+
+static uint32_t
+orch_replay_dec32(const unsigned char *p)
+{
+	uint32_t val = 0;
+
+	for (int i = 0; i < 4; i++)
+		val = (val << 8) | p[i];
+	return (val);
+}
+
+static uint64_t
+orch_replay_dec64(const unsigned char *p)
+{
+	uint64_t val = 0;
+
+	for (int i = 0; i < 8; i++)
+		val = (val << 8) | p[i];
+	return (val);
+}
+
+static ssize_t
+orch_replay_pread(struct orch_replay *rp, void *buf, size_t len, off_t off)
+{
+	ssize_t rsz, total;
+
+	total = 0;
+	while ((size_t)total < len) {
+		rsz = pread(rp->fd, (char *)buf + total, len - total,
+		    off + total);
+		if (rsz == -1 && errno == EINTR)
+			continue;
+		if (rsz == -1)
+			return (-1);
+		if (rsz == 0)
+			break;
+
+		total += rsz;
+	}
+
+	return (total);
+}
+
+/*
+ * Step over the session header at the current position, if there is one.
+ * Returns 1 if we did, 0 at the end of the file, or -1 with EINVAL if there's
+ * anything else there.
+ */
+static int
+orch_replay_session(struct orch_replay *rp)
+{
+	unsigned char hdr[ORCH_REC_HDRSZ];
+	ssize_t rsz;
+
+	rsz = orch_replay_pread(rp, hdr, sizeof(hdr), rp->off);
+	if (rsz == -1)
+		return (-1);
+	if (rsz == 0)
+		return (0);
+	if ((size_t)rsz != sizeof(hdr) ||
+	    memcmp(hdr, ORCH_REC_MAGIC, ORCH_REC_MAGICSZ) != 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	rp->off += sizeof(hdr);
+	return (1);
+}
+
+/*
+ * Open session `session` (1-based) of the recording on `fd`, which the replay
+ * takes ownership of even if we fail.  Fails with EINVAL if this isn't a
+ * recording, or ENOENT if it doesn't have that many sessions.
+ */
+struct orch_replay *
+orch_replay_open(int fd, int session, double speed)
+{
+	struct orch_replay_event ev;
+	struct orch_replay *rp;
+	int error, ret;
+
+	rp = calloc(1, sizeof(*rp));
+	if (rp == NULL) {
+		close(fd);
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	rp->fd = fd;
+	rp->speed = speed;
+	for (int n = 1; ; n++) {
+		ret = orch_replay_session(rp);
+		if (ret == 0) {
+			errno = n == 1 ? EINVAL : ENOENT;
+			goto fail;
+		} else if (ret == -1) {
+			goto fail;
+		}
+
+		if (n == session)
+			break;
+
+		while ((ret = orch_replay_next(rp, &ev)) > 0)
+			continue;
+		if (ret == -1)
+			goto fail;
+	}
+
+	return (rp);
+fail:
+	error = errno;
+	orch_replay_close(rp);
+	errno = error;
+	return (NULL);
+}
+
+/*
+ * Fetch the next event in the session.  Returns 1 if there was one, 0 at the
+ * end of the session, or -1 with EINVAL if the recording is malformed.
+ */
+int
+orch_replay_next(struct orch_replay *rp, struct orch_replay_event *ev)
+{
+	unsigned char evhdr[ORCH_REC_EVHDRSZ];
+	ssize_t rsz;
+
+	rsz = orch_replay_pread(rp, evhdr, sizeof(evhdr), rp->off);
+	if (rsz == -1)
+		return (-1);
+	if (rsz == 0)
+		return (0);
+
+	/* The next session starts here. */
+	if ((size_t)rsz == sizeof(evhdr) &&
+	    memcmp(evhdr, ORCH_REC_MAGIC, ORCH_REC_MAGICSZ) == 0)
+		return (0);
+
+	if ((size_t)rsz != sizeof(evhdr) || evhdr[0] < ORCH_REC_OUTPUT ||
+	    evhdr[0] > ORCH_REC_EOF) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	ev->type = evhdr[0];
+	ev->time = orch_replay_dec64(&evhdr[1]);
+	ev->len = orch_replay_dec32(&evhdr[9]);
+	ev->dataoff = rp->off + sizeof(evhdr);
+
+	rp->off = ev->dataoff + ev->len;
+	return (1);
+}
+
+/*
+ * Check `len` bytes that the script is writing against the recorded input.
+ * Returns 0 if they match, or 1 with the offset into the input stream of the
+ * first byte that doesn't (or that's past the end of the recorded input).
+ */
+int
+orch_replay_expect(struct orch_replay *rp, const char *buf, size_t len,
+    uint64_t *posp)
+{
+	char expected[4096];
+	struct orch_replay_event ev;
+	size_t chunk;
+	ssize_t rsz;
+	int ret;
+
+	while (len != 0) {
+		while (rp->inleft == 0) {
+			ret = orch_replay_next(rp, &ev);
+			if (ret == -1)
+				return (-1);
+			if (ret == 0) {
+				*posp = rp->inpos;
+				return (1);
+			}
+
+			if (ev.type == ORCH_REC_INPUT) {
+				rp->inoff = ev.dataoff;
+				rp->inleft = ev.len;
+			}
+		}
+
+		chunk = MIN(MIN(len, rp->inleft), sizeof(expected));
+		rsz = orch_replay_pread(rp, expected, chunk, rp->inoff);
+		if (rsz == -1)
+			return (-1);
+		if ((size_t)rsz != chunk) {
+			errno = EINVAL;
+			return (-1);
+		}
+
+		for (size_t i = 0; i < chunk; i++) {
+			if (buf[i] != expected[i]) {
+				*posp = rp->inpos + i;
+				return (1);
+			}
+		}
+
+		buf += chunk;
+		len -= chunk;
+		rp->inoff += chunk;
+		rp->inleft -= chunk;
+		rp->inpos += chunk;
+	}
+
+	return (0);
+}
+
+static void
+orch_replay_sleep(double seconds)
+{
+	struct timespec ts, rem;
+
+	if (seconds <= 0)
+		return;
+
+	ts.tv_sec = seconds;
+	ts.tv_nsec = (seconds - ts.tv_sec) * 1000000000;
+	while (nanosleep(&ts, &rem) == -1 && errno == EINTR)
+		ts = rem;
+}
+
+static int
+orch_replay_copy(struct orch_replay *rp, const struct orch_replay_event *ev,
+    int fd, char *buf)
+{
+	off_t off;
+	size_t left;
+	ssize_t rsz, wsz;
+
+	off = ev->dataoff;
+	left = ev->len;
+	while (left != 0) {
+		rsz = orch_replay_pread(rp, buf, MIN(left, REPLAY_BUFSZ), off);
+		if (rsz == -1)
+			return (-1);
+		if (rsz == 0) {
+			errno = EINVAL;
+			return (-1);
+		}
+
+		off += rsz;
+		left -= rsz;
+		for (ssize_t sent = 0; sent < rsz; sent += wsz) {
+			wsz = write(fd, &buf[sent], rsz - sent);
+			if (wsz == -1 && errno == EINTR) {
+				wsz = 0;
+				continue;
+			}
+			if (wsz == -1)
+				return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Wait for the recorded input to arrive; we've already checked it on the
+ * script's side, so the contents don't matter here.  Returns 0 if the script
+ * closed our stdin first.
+ */
+static int
+orch_replay_await(const struct orch_replay_event *ev, int infd, char *buf)
+{
+	size_t left;
+	ssize_t rsz;
+
+	left = ev->len;
+	while (left != 0) {
+		rsz = read(infd, buf, MIN(left, REPLAY_BUFSZ));
+		if (rsz == -1 && errno == EINTR)
+			continue;
+		if (rsz == -1)
+			return (-1);
+		if (rsz == 0)
+			return (0);
+
+		left -= rsz;
+	}
+
+	return (1);
+}
+
+/*
+ * Play the session out to `outfd` and `errfd`, reading the recorded input from
+ * `infd`.  This runs in the replay's child.
+ */
+int
+orch_replay_play(struct orch_replay *rp, int infd, int outfd, int errfd)
+{
+	struct orch_replay_event ev;
+	char *buf;
+	double start, when;
+	int ret;
+
+	buf = malloc(REPLAY_BUFSZ);
+	if (buf == NULL)
+		return (-1);
+
+	start = orch_clock_seconds();
+	while ((ret = orch_replay_next(rp, &ev)) > 0) {
+		when = 0;
+		if (rp->speed != 0) {
+			when = ev.time / 1000000000.0 / rp->speed;
+			orch_replay_sleep(start + when - orch_clock_seconds());
+		}
+
+		switch (ev.type) {
+		case ORCH_REC_OUTPUT:
+		case ORCH_REC_STDERR:
+			if (orch_replay_copy(rp, &ev,
+			    ev.type == ORCH_REC_OUTPUT ? outfd : errfd,
+			    buf) != 0)
+				ret = -1;
+			break;
+		case ORCH_REC_INPUT:
+			ret = orch_replay_await(&ev, infd, buf);
+
+			/*
+			 * The script may be slower (or faster) to respond than
+			 * whatever drove the recording, so what follows is
+			 * scheduled relative to when the input actually came.
+			 */
+			start = orch_clock_seconds() - when;
+			break;
+		case ORCH_REC_EOF:
+			ret = 0;
+			break;
+		}
+
+		if (ret <= 0)
+			break;
+	}
+
+	free(buf);
+	return (ret);
+}
+
+/*
+ * Move the recording over to `fd`, e.g., so that the replay's child can close
+ * everything above it.
+ */
+int
+orch_replay_movefd(struct orch_replay *rp, int fd)
+{
+
+	if (rp->fd == fd)
+		return (0);
+	if (dup2(rp->fd, fd) == -1)
+		return (-1);
+
+	close(rp->fd);
+	rp->fd = fd;
+	return (0);
+}
+
+void
+orch_replay_close(struct orch_replay *rp)
+{
+
+	close(rp->fd);
+	free(rp);
+}
@@ -12,7 +12,10 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <paths.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,24 +43,120 @@
 #define	SOCKPAIR_ATTRS	(0)
 #endif
 
+#ifndef ORCH_SPAWN_HELPER
+#define	ORCH_SPAWN_HELPER	"/usr/local/libexec/orch-spawn-helper"
+#endif
+
 extern char **environ;
 
+/* Resolved from $ORCH_SPAWN_METHOD on first use. */
+static enum orch_spawn_method orch_spawn_default = ORCH_SPAWN_DEFAULT;
+
 /* Parent */
+static int orch_newpipes(struct orch_process *, const struct orch_spawn_opts *,
+    int [3]);
 static int orch_newpt(void);
+static int orch_spawn_fdabove(int);
+static pid_t orch_spawn_posix(int, int, const int *,
+    const struct orch_spawn_opts *, int, const char *[]);
 
 /* Child */
 static pid_t orch_newsess(orch_ipc_t);
-static void orch_usept(orch_ipc_t, pid_t, int, struct termios *);
+static void orch_usepipes(orch_ipc_t, const int [3]);
+static void orch_usept(orch_ipc_t, pid_t, int, struct termios *,
+    const struct orch_spawn_opts *);
 static void orch_child_error(orch_ipc_t, const char *, ...) __printflike(2, 3);
 static void orch_exec(orch_ipc_t, int, const char *[], struct termios *);
+static void orch_replay_child(orch_ipc_t, struct orch_replay *);
 
 /* Both */
+static void orch_termmask_apply(const struct orch_termmask *,
+    struct termios *);
+
 static int orch_wait(orch_ipc_t);
 
+enum orch_spawn_method
+orch_spawn_method_get(void)
+{
+	const char *env;
+
+	if (orch_spawn_default == ORCH_SPAWN_DEFAULT) {
+		env = getenv("ORCH_SPAWN_METHOD");
+		if (env != NULL && strcmp(env, "posix_spawn") == 0)
+			orch_spawn_default = ORCH_SPAWN_POSIX;
+		else
+			orch_spawn_default = ORCH_SPAWN_FORK;
+	}
+
+	return (orch_spawn_default);
+}
+
+void
+orch_spawn_method_set(enum orch_spawn_method method)
+{
+
+	orch_spawn_default = method;
+}
+
+/*
+ * The child reports its terminal attributes once they're configured, just
+ * before it releases us; stash them so that the first term() doesn't need to
+ * ask for them again.
+ */
+static int
+orch_spawn_termios_report(orch_ipc_t ipc __unused, struct orch_ipc_msg *msg,
+    void *cookie)
+{
+	struct orch_process *p = cookie;
+	struct termios *child_termios;
+	size_t datasz;
+
+	child_termios = orch_ipc_msg_payload(msg, &datasz);
+	if (child_termios == NULL || datasz != sizeof(*child_termios)) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	memcpy(&p->child_term, child_termios, sizeof(*child_termios));
+	p->child_term_valid = true;
+	return (0);
+}
+
+static void
+orch_spawn_closefds(struct orch_process *p, int childfds[3])
+{
+
+	for (int i = 0; i < 3; i++) {
+		if (childfds[i] != -1)
+			close(childfds[i]);
+		childfds[i] = -1;
+	}
+
+	if (p->termctl != -1)
+		close(p->termctl);
+	if (p->errfd != -1)
+		close(p->errfd);
+	if (p->infd != -1)
+		close(p->infd);
+	p->termctl = p->errfd = p->infd = -1;
+}
+
+static int
+orch_spawn_nonblock(int fd)
+{
+
+	if (fd == -1)
+		return (0);
+	return (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK));
+}
+
 int
 orch_spawn(int argc, const char *argv[], struct orch_process *p,
-    orch_ipc_handler *child_error_handler)
+    const struct orch_spawn_opts *opts, orch_ipc_handler *child_error_handler)
 {
+	enum orch_spawn_method method;
+	int error;
+	int childfds[3] = { -1, -1, -1 };
 	int cmdsock[2];
 	pid_t pid, sess;
 
@@ -81,10 +180,48 @@ orch_spawn(int argc, const char *argv[], struct orch_process *p,
 		err(1, "fcntl");
 #endif
 
-	p->termctl = orch_newpt();
+	p->reapfd = -1;
+	p->termctl = p->errfd = p->infd = -1;
+	p->pipe = opts != NULL && opts->pipe;
+	p->errsep = p->pipe && opts->pipe_stderr == ORCH_STDERR_SEPARATE;
+	if (p->pipe) {
+		if (orch_newpipes(p, opts, childfds) != 0) {
+			int serr = errno;
 
-	pid = fork();
-	if (pid == -1) {
+			close(cmdsock[0]);
+			close(cmdsock[1]);
+
+			errno = serr;
+			return (-1);
+		}
+	} else {
+		p->termctl = orch_newpt();
+	}
+
+	method = ORCH_SPAWN_DEFAULT;
+	if (opts != NULL)
+		method = opts->method;
+	if (method == ORCH_SPAWN_DEFAULT)
+		method = orch_spawn_method_get();
+
+	/* There's nothing to exec for a replay, it's all done in the child. */
+	if (opts != NULL && opts->replay != NULL)
+		method = ORCH_SPAWN_FORK;
+
+	if (method == ORCH_SPAWN_POSIX) {
+		pid = orch_spawn_posix(cmdsock[1], p->termctl,
+		    p->pipe ? childfds : NULL, opts, argc, argv);
+		if (pid == -1) {
+			int serr = errno;
+
+			close(cmdsock[0]);
+			close(cmdsock[1]);
+			orch_spawn_closefds(p, childfds);
+
+			errno = serr;
+			return (-1);
+		}
+	} else if ((pid = fork()) == -1) {
 		err(1, "fork");
 	} else if (pid == 0) {
 		struct termios t;
@@ -101,7 +238,15 @@ orch_spawn(int argc, const char *argv[], struct orch_process *p,
 
 		sess = orch_newsess(ipc);
 
-		orch_usept(ipc, sess, p->termctl, &t);
+		/* Our ends of the pipes are all close-on-exec. */
+		if (p->pipe) {
+			orch_usepipes(ipc, childfds);
+			if (opts->replay != NULL)
+				orch_replay_child(ipc, opts->replay);
+			orch_exec(ipc, argc, argv, NULL);
+		}
+
+		orch_usept(ipc, sess, p->termctl, &t, opts);
 		assert(p->termctl >= 0);
 		close(p->termctl);
 		p->termctl = -1;
@@ -110,17 +255,33 @@ orch_spawn(int argc, const char *argv[], struct orch_process *p,
 	}
 
 	p->released = false;
+	p->child_term_valid = false;
 	p->pid = pid;
+	orch_clock_now(&p->started);
 	p->ipc = orch_ipc_open(cmdsock[0]);
 
 	/* Parent */
 	close(cmdsock[1]);
+	for (int i = 0; i < 3; i++) {
+		if (childfds[i] != -1)
+			close(childfds[i]);
+		childfds[i] = -1;
+	}
+
+	/*
+	 * Reads drain the pty (or pipes) until it would block, so it needs to be
+	 * non-blocking on our side.
+	 */
+	if (orch_spawn_nonblock(p->termctl) == -1 ||
+	    orch_spawn_nonblock(p->errfd) == -1 ||
+	    orch_spawn_nonblock(p->infd) == -1)
+		err(1, "fcntl");
 
 	if (p->ipc == NULL) {
 		int status;
 
 		assert(p->termctl >= 0);
-		close(p->termctl);
+		orch_spawn_closefds(p, childfds);
 		close(cmdsock[0]);
 
 		kill(pid, SIGKILL);
@@ -133,12 +294,18 @@ orch_spawn(int argc, const char *argv[], struct orch_process *p,
 	}
 
 	orch_ipc_register(p->ipc, IPC_ERROR, child_error_handler, p);
+	orch_ipc_register(p->ipc, IPC_TERMIOS_SET, orch_spawn_termios_report, p);
 
 	/*
 	 * Stalls until the tty is configured, completely side step races from
 	 * script writing to the tty before, e.g., echo is disabled.
 	 */
-	return (orch_wait(p->ipc));
+	error = orch_wait(p->ipc);
+	orch_ipc_register(p->ipc, IPC_TERMIOS_SET, NULL, NULL);
+
+	if (error == 0)
+		p->reapfd = orch_reap_open(pid);
+	return (error);
 }
 
 static int
@@ -174,6 +341,39 @@ orch_release(orch_ipc_t ipc)
 	return (orch_ipc_send_nodata(ipc, IPC_RELEASE));
 }
 
+/*
+ * Release the child, then wait for it to either exec -- its end of the socket
+ * is close-on-exec -- or tell us why it couldn't.  We can't shut down our end
+ * until then, or the child may see EOF before it gets a chance to report the
+ * error.
+ */
+int
+orch_release_exec(orch_ipc_t ipc)
+{
+	struct orch_ipc_msg *msg;
+	bool eof;
+
+	if (orch_release(ipc) != 0)
+		return (-1);
+
+	eof = false;
+	while (!eof) {
+		if (orch_ipc_wait(ipc, &eof) == -1)
+			return (-1);
+		else if (eof)
+			break;
+
+		msg = NULL;
+		if (orch_ipc_recv(ipc, &msg) != 0)
+			return (-1);
+
+		/* Anything we care about is handled by a callback. */
+		orch_ipc_msg_free(msg);
+	}
+
+	return (0);
+}
+
 static void
 orch_child_error(orch_ipc_t ipc, const char *fmt, ...)
 {
@@ -270,12 +470,24 @@ orch_exec(orch_ipc_t ipc, int argc __unused, const char *argv[],
 	 * Register a couple of events that the script may want to use:
 	 * - IPC_TERMIOS_INQUIRY: sent our terminal attributes back over.
 	 * - IPC_TERMIOS_SET: update our terminal attributes
+	 *
+	 * There's no terminal at all in pipe mode (`t` is NULL), in which case
+	 * we just wait to be released.
 	 */
-	orch_ipc_register(ipc, IPC_TERMIOS_INQUIRY, orch_child_termios_inquiry,
-	    t);
-	orch_ipc_register(ipc, IPC_TERMIOS_SET, orch_child_termios_set, t);
-
-	/* Let the script commence. */
+	if (t != NULL) {
+		orch_ipc_register(ipc, IPC_TERMIOS_INQUIRY,
+		    orch_child_termios_inquiry, t);
+		orch_ipc_register(ipc, IPC_TERMIOS_SET, orch_child_termios_set,
+		    t);
+
+		/*
+		 * Report our terminal attributes up front, since the script
+		 * will almost certainly want them, then let the script
+		 * commence.
+		 */
+		if (orch_child_termios_inquiry(ipc, NULL, t) != 0)
+			_exit(1);
+	}
 	if (orch_release(ipc) != 0)
 		_exit(1);
 
@@ -289,14 +501,52 @@ orch_exec(orch_ipc_t ipc, int argc __unused, const char *argv[],
 	 * extensive protocol so that the script can, e.g., reconfigure the tty.
 	 */
 	error = orch_wait(ipc);
-	orch_ipc_close(ipc);
-
-	if (error != 0)
+	if (error != 0) {
+		orch_ipc_close(ipc);
 		_exit(1);
+	}
 
+	/*
+	 * The IPC socket is close-on-exec, so the parent will see it close once
+	 * we've successfully exec'd.  If we don't make it that far, we still
+	 * have it open to tell the parent why.
+	 */
 	execvp(argv[0], (char * const *)(const void *)argv);
 
-	_exit(1);
+	orch_child_error(ipc, "exec %s: %s", argv[0], strerror(errno));
+}
+
+/*
+ * Play back a replay rather than executing a command; to the parent, this
+ * looks just like a pipe-mode child that exec'd as soon as it was released.
+ *
+ * Without an exec, nothing that the parent opened close-on-exec goes away on
+ * its own: our stdin's write end, the other ends of our stdout and stderr, and
+ * the descriptors of every other process the parent has spawned.  We close all
+ * of them, or we'd never see EOF on our stdin and neither would any other
+ * pipe-mode child on its own.
+ */
+static void
+orch_replay_child(orch_ipc_t ipc, struct orch_replay *replay)
+{
+	int error;
+
+	signal(SIGINT, SIG_DFL);
+
+	if (orch_release(ipc) != 0 || orch_wait(ipc) != 0) {
+		orch_ipc_close(ipc);
+		_exit(1);
+	}
+
+	orch_ipc_close(ipc);
+
+	if (orch_replay_movefd(replay, STDERR_FILENO + 1) != 0)
+		_exit(1);
+	closefrom(STDERR_FILENO + 2);
+
+	error = orch_replay_play(replay, STDIN_FILENO, STDOUT_FILENO,
+	    STDERR_FILENO);
+	_exit(error == 0 ? 0 : 1);
 }
 
 static int
@@ -320,6 +570,71 @@ orch_newpt(void)
 	return (newpt);
 }
 
+static int
+orch_newpipe(int fds[2])
+{
+	int nfd;
+
+	if (pipe(fds) == -1)
+		return (-1);
+
+	/* The child's ends will be dup'd onto its stdio, so keep them clear. */
+	for (int i = 0; i < 2; i++) {
+		if (fcntl(fds[i], F_SETFD, FD_CLOEXEC) == -1 ||
+		    (nfd = orch_spawn_fdabove(fds[i])) == -1) {
+			int serr = errno;
+
+			close(fds[0]);
+			close(fds[1]);
+			errno = serr;
+			return (-1);
+		}
+
+		fds[i] = nfd;
+	}
+
+	return (0);
+}
+
+/*
+ * Pipe mode: the child gets pipes for its stdio rather than a pty, which avoids
+ * the line discipline and the pty's small buffers entirely.  Our ends go into
+ * `p`, with stdout in place of the pty; the child's ends are returned in
+ * `childfds`, with -1 for any that should just be /dev/null.
+ */
+static int
+orch_newpipes(struct orch_process *p, const struct orch_spawn_opts *opts,
+    int childfds[3])
+{
+	int fds[2], serr;
+
+	if (orch_newpipe(fds) != 0)
+		goto fail;
+	p->termctl = fds[0];
+	childfds[STDOUT_FILENO] = fds[1];
+
+	if (opts->pipe_stdin) {
+		if (orch_newpipe(fds) != 0)
+			goto fail;
+		p->infd = fds[1];
+		childfds[STDIN_FILENO] = fds[0];
+	}
+
+	if (opts->pipe_stderr != ORCH_STDERR_NULL) {
+		if (orch_newpipe(fds) != 0)
+			goto fail;
+		p->errfd = fds[0];
+		childfds[STDERR_FILENO] = fds[1];
+	}
+
+	return (0);
+fail:
+	serr = errno;
+	orch_spawn_closefds(p, childfds);
+	errno = serr;
+	return (-1);
+}
+
 static pid_t
 orch_newsess(orch_ipc_t ipc)
 {
@@ -333,7 +648,8 @@ orch_newsess(orch_ipc_t ipc)
 }
 
 static void
-orch_usept(orch_ipc_t ipc, pid_t sess, int termctl, struct termios *t)
+orch_usept(orch_ipc_t ipc, pid_t sess, int termctl, struct termios *t,
+    const struct orch_spawn_opts *opts)
 {
 	const char *name;
 	int target;
@@ -352,10 +668,268 @@ orch_usept(orch_ipc_t ipc, pid_t sess, int termctl, struct termios *t)
 	if (tcgetattr(target, t) == -1)
 		orch_child_error(ipc, "tcgetattr");
 
-	/* XXX Accept mask, buffering? */
+	/*
+	 * Apply the initial settings before anything else can touch the tty, so
+	 * that the script doesn't need to do it in a separate round trip.
+	 */
+	if (opts != NULL) {
+		orch_termmask_apply(&opts->termmask, t);
+		if (tcsetattr(target, TCSANOW, t) == -1)
+			orch_child_error(ipc, "tcsetattr: %s", strerror(errno));
+	}
+
 	dup2(target, STDIN_FILENO);
 	dup2(target, STDOUT_FILENO);
 	dup2(target, STDERR_FILENO);
 	if (target > STDERR_FILENO)
 		close(target);
 }
+
+static void
+orch_usepipes(orch_ipc_t ipc, const int childfds[3])
+{
+	int fd;
+
+	for (int i = STDIN_FILENO; i <= STDERR_FILENO; i++) {
+		fd = childfds[i];
+		if (fd == -1) {
+			fd = open(_PATH_DEVNULL, O_RDWR);
+			if (fd == -1)
+				orch_child_error(ipc, "open %s: %s",
+				    _PATH_DEVNULL, strerror(errno));
+		}
+
+		if (fd == i)
+			continue;
+
+		if (dup2(fd, i) == -1)
+			orch_child_error(ipc, "dup2: %s", strerror(errno));
+		close(fd);
+	}
+}
+
+static void
+orch_termflags_apply(const struct orch_termflags *flags, tcflag_t *field)
+{
+
+	*field = (*field & ~flags->unset) | flags->set;
+}
+
+static void
+orch_termmask_apply(const struct orch_termmask *mask, struct termios *t)
+{
+
+	orch_termflags_apply(&mask->iflag, &t->c_iflag);
+	orch_termflags_apply(&mask->oflag, &t->c_oflag);
+	orch_termflags_apply(&mask->lflag, &t->c_lflag);
+	for (size_t i = 0; i < NCCS; i++) {
+		if (mask->cc_set[i])
+			t->c_cc[i] = mask->cc[i];
+	}
+}
+
+/*
+ * Move `fd` out of the way of the stdio descriptors, so that the file actions
+ * below can't clobber it or leave it close-on-exec.
+ */
+static int
+orch_spawn_fdabove(int fd)
+{
+	int nfd;
+
+	if (fd > STDERR_FILENO)
+		return (fd);
+
+	nfd = fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+	if (nfd == -1)
+		return (-1);
+
+	close(fd);
+	return (nfd);
+}
+
+/*
+ * The posix_spawn(3) path: fork() has to duplicate the parent's entire address
+ * space just to exec, which gets expensive with a large Lua heap.  We instead
+ * configure the pts from the parent and hand it to a small helper as its stdio;
+ * the helper takes care of the parts that posix_spawn can't do portably
+ * (acquiring the controlling terminal) and then runs the usual release protocol
+ * before it execs the command.
+ *
+ * In pipe mode, `childfds` has the child's ends of the pipes to use for its
+ * stdio instead of the pts (-1 for /dev/null), and `termctl` isn't used.
+ */
+static pid_t
+orch_spawn_posix(int cmdsock, int termctl, const int *childfds,
+    const struct orch_spawn_opts *opts, int argc, const char *argv[])
+{
+	posix_spawn_file_actions_t actions;
+	struct termios t;
+	const char **hargv, *helper, *name;
+	char fdstr[16];
+	pid_t pid;
+	int argbase, error, target;
+	int stdio[3];
+
+	pid = -1;
+	hargv = NULL;
+	target = -1;
+
+	helper = getenv("ORCH_SPAWN_HELPER");
+	if (helper == NULL || helper[0] == '\0')
+		helper = ORCH_SPAWN_HELPER;
+
+	if (childfds != NULL) {
+		memcpy(stdio, childfds, sizeof(stdio));
+		goto spawn;
+	}
+
+	name = ptsname(termctl);
+	if (name == NULL)
+		return (-1);
+
+	/*
+	 * We keep the pts open until the child has its own references to it, so
+	 * that it doesn't get reset to the defaults on open in the child.
+	 */
+	target = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (target == -1)
+		return (-1);
+	if ((target = orch_spawn_fdabove(target)) == -1)
+		return (-1);
+
+	if (opts != NULL) {
+		if (tcgetattr(target, &t) == -1)
+			goto out;
+
+		orch_termmask_apply(&opts->termmask, &t);
+		if (tcsetattr(target, TCSANOW, &t) == -1)
+			goto out;
+	}
+
+	stdio[STDIN_FILENO] = stdio[STDOUT_FILENO] = stdio[STDERR_FILENO] =
+	    target;
+
+spawn:
+	/*
+	 * The IPC socket needs to survive into the helper; the parent closes its
+	 * copy as soon as we return, so we don't need to restore FD_CLOEXEC.
+	 */
+	assert(cmdsock > STDERR_FILENO);
+	if (fcntl(cmdsock, F_SETFD, fcntl(cmdsock, F_GETFD) & ~FD_CLOEXEC) == -1)
+		goto out;
+
+	hargv = calloc(argc + 4, sizeof(*hargv));
+	if (hargv == NULL)
+		goto out;
+
+	snprintf(fdstr, sizeof(fdstr), "%d", cmdsock);
+	argbase = 0;
+	hargv[argbase++] = helper;
+	if (childfds != NULL)
+		hargv[argbase++] = "-p";
+	hargv[argbase++] = fdstr;
+	for (int i = 0; i < argc; i++)
+		hargv[argbase + i] = argv[i];
+
+	if ((error = posix_spawn_file_actions_init(&actions)) != 0) {
+		errno = error;
+		goto out;
+	}
+
+	for (int i = STDIN_FILENO; i <= STDERR_FILENO && error == 0; i++) {
+		if (stdio[i] == -1)
+			error = posix_spawn_file_actions_addopen(&actions, i,
+			    _PATH_DEVNULL, O_RDWR, 0);
+		else
+			error = posix_spawn_file_actions_adddup2(&actions,
+			    stdio[i], i);
+	}
+
+	if (error == 0)
+		error = posix_spawn(&pid, helper, &actions, NULL,
+		    (char * const *)(const void *)hargv, environ);
+	if (error != 0) {
+		pid = -1;
+		errno = error;
+	}
+
+	posix_spawn_file_actions_destroy(&actions);
+
+out:
+	if (pid == -1) {
+		int serr = errno;
+
+		free(hargv);
+		if (target != -1)
+			close(target);
+		errno = serr;
+		return (-1);
+	}
+
+	free(hargv);
+	if (target != -1)
+		close(target);
+	return (pid);
+}
+
+/*
+ * Entry point for the orch-spawn-helper program: argv is the IPC socket's descriptor
+ * followed by the command to run, and our stdio is already the pts.  With -p,
+ * our stdio is a set of pipes and there's no terminal to set up.
+ */
+int
+orch_spawn_helper(int argc, const char *argv[])
+{
+	struct termios t;
+	orch_ipc_t ipc;
+	char *end;
+	long fd;
+	pid_t sess;
+	int argbase;
+	bool pipemode;
+
+	argbase = 1;
+	pipemode = argc > 1 && strcmp(argv[1], "-p") == 0;
+	if (pipemode)
+		argbase++;
+
+	if (argc < argbase + 2) {
+		fprintf(stderr, "usage: %s [-p] fd command [argument ...]\n",
+		    argv[0]);
+		return (1);
+	}
+
+	errno = 0;
+	fd = strtol(argv[argbase], &end, 10);
+	if (errno != 0 || *end != '\0' || fd <= STDERR_FILENO || fd > INT_MAX) {
+		fprintf(stderr, "%s: bad descriptor '%s'\n", argv[0],
+		    argv[argbase]);
+		return (1);
+	}
+
+	/* The socket shouldn't leak into the command. */
+	if (fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC) == -1)
+		err(1, "fcntl");
+
+	ipc = orch_ipc_open(fd);
+	if (ipc == NULL) {
+		close(fd);
+		fprintf(stderr, "child out of memory\n");
+		return (1);
+	}
+
+	sess = orch_newsess(ipc);
+	if (pipemode)
+		orch_exec(ipc, argc - argbase - 1, &argv[argbase + 1], NULL);
+
+	if (tcsetsid(STDIN_FILENO, sess) == -1)
+		orch_child_error(ipc, "tcsetsid");
+	if (tcgetattr(STDIN_FILENO, &t) == -1)
+		orch_child_error(ipc, "tcgetattr");
+
+	orch_exec(ipc, argc - argbase - 1, &argv[argbase + 1], &t);
+
+	/* NOTREACHED */
+	return (1);
+}
@@ -126,8 +126,13 @@ orchlua_term_fetch(lua_State *L)
 	return (retvals);
 }
 
+/*
+ * Update the `ccs` array from the table of characters to remap at the top of
+ * the stack.  If `setp` is not NULL, then we also record which of them were
+ * specified.
+ */
 static int
-orchlua_term_update_cc(lua_State *L, struct termios *term)
+orchlua_term_update_cc(lua_State *L, cc_t *ccs, bool *setp)
 {
 	const struct orchlua_tty_cntrl *iter;
 	int type;
@@ -185,7 +190,9 @@ orchlua_term_update_cc(lua_State *L, struct termios *term)
 			}
 		}
 
-		term->c_cc[iter->cntrl_idx] = cc;
+		ccs[iter->cntrl_idx] = cc;
+		if (setp != NULL)
+			setp[iter->cntrl_idx] = true;
 		lua_pop(L, 1);
 	}
 
@@ -257,7 +264,8 @@ orchlua_term_update(lua_State *L)
 				return (2);
 			}
 
-			if ((error = orchlua_term_update_cc(L, &updated)) != 0)
+			if ((error = orchlua_term_update_cc(L, updated.c_cc,
+			    NULL)) != 0)
 				return (error);
 		}
 
@@ -398,6 +406,79 @@ orchlua_setup_tty(lua_State *L)
 	return (1);
 }
 
+static int
+orchlua_tty_checkflags(lua_State *L, const char *name,
+    struct orch_termflags *flags)
+{
+	const char *which[] = { "set", "unset" };
+	tcflag_t *fields[] = { &flags->set, &flags->unset };
+	int type, valid;
+
+	type = lua_getfield(L, -1, name);
+	if (type == LUA_TNIL) {
+		lua_pop(L, 1);
+		return (0);
+	} else if (type != LUA_TTABLE) {
+		luaL_pushfail(L);
+		lua_pushfstring(L, "%s must be a table of masks to set/unset",
+		    name);
+		return (2);
+	}
+
+	for (size_t i = 0; i < 2; i++) {
+		type = lua_getfield(L, -1, which[i]);
+		if (type != LUA_TNIL) {
+			*fields[i] = lua_tonumberx(L, -1, &valid);
+			if (!valid) {
+				luaL_pushfail(L);
+				lua_pushfstring(L, "%s.%s must be a numeric mask",
+				    name, which[i]);
+				return (2);
+			}
+		}
+
+		lua_pop(L, 1);
+	}
+
+	lua_pop(L, 1);
+	return (0);
+}
+
+/*
+ * Parse the table at `idx` describing the initial terminal settings for a new
+ * process.  Each of iflag, oflag, and lflag may be a table with set and unset
+ * masks, as with stty(), and cc may be a table of characters to remap, as with
+ * term:update().  Returns 0 on success, or the number of values pushed to
+ * describe the error.
+ */
+int
+orchlua_tty_checkmask(lua_State *L, int idx, struct orch_termmask *mask)
+{
+	int error, type;
+
+	memset(mask, 0, sizeof(*mask));
+
+	lua_pushvalue(L, idx);
+	if ((error = orchlua_tty_checkflags(L, "iflag", &mask->iflag)) != 0 ||
+	    (error = orchlua_tty_checkflags(L, "oflag", &mask->oflag)) != 0 ||
+	    (error = orchlua_tty_checkflags(L, "lflag", &mask->lflag)) != 0)
+		return (error);
+
+	type = lua_getfield(L, -1, "cc");
+	if (type == LUA_TTABLE) {
+		if ((error = orchlua_term_update_cc(L, mask->cc,
+		    mask->cc_set)) != 0)
+			return (error);
+	} else if (type != LUA_TNIL) {
+		luaL_pushfail(L);
+		lua_pushstring(L, "cc must be a table of characters to remap");
+		return (2);
+	}
+
+	lua_pop(L, 2);
+	return (0);
+}
+
 int
 orchlua_tty_alloc(lua_State *L, const struct orch_term *copy,
     struct orch_term **otermp)
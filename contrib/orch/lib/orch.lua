@@ -6,20 +6,50 @@
 
 local core = require("orch.core")
 local direct = require("orch.direct")
+local recording = require("orch.recording")
 local scripter = require("orch.scripter")
 local orch = {}
 
+-- close_all(procs[, opts]): close all of the processes returned by spawn() in
+-- the `procs` array, sending each signal to all of them at once and waiting out
+-- a single grace period rather than one per process.  `opts` may specify
+-- `signals`, an array of signal names or numbers to send in order, and `grace`,
+-- the number of seconds to wait after each (or an array of them).
+orch.close_all = direct.close_all
+
 -- env: table of values that will be exposed to the orch script's environment.
 -- A user of this library may add to the orch.env before calling
 -- orch.run_script() and see their changes in the script's environment.
 orch.env = scripter.env
 
+-- open_recording(file): open a recording written by the record() directive or
+-- a process's record() method, given either a path or an open file.  Returns a
+-- reader whose next() method yields each event in turn, with its time since the
+-- start of the session, the time since the previous event, and its byte offset
+-- within its stream, for finding where a session spent its time.  The reader
+-- also has find(needle[, kind]) to locate output, and gaps(threshold) to list
+-- the events that followed a stall of at least `threshold` seconds.
+orch.open_recording = recording.open
+
+-- replay(path[, opts]): play back a session from a recording made with the
+-- record() directive or a process's record() method, returning a process just
+-- like spawn() would.  Anything written to it is checked against the recorded
+-- input, and output that followed input isn't played back until that input has
+-- been written.  `opts` may set `speed` to scale the recorded delays (e.g., 10
+-- for ten times faster, or 0 for no delays at all), `session` to pick which
+-- session in the recording to play (from 1), and `stderr` as for spawn()'s
+-- `pipe` option.
+orch.replay = direct.replay
+
 -- run_script(scriptfile[, config]): run `scriptfile` as an .orch script, with
 -- an optional configuration table that may be supplied.
 --
 -- The currently recognized configuration items are `alter_path` (boolean) that
 -- indicates that the script's directory should be added to PATH, and `command`
 -- (table) to indicate the argv of a process to spawn before running the script.
+-- A `replay` table, with the `path` of a recording and any of the options that
+-- replay() takes, plays back the recording's sessions in order in place of the
+-- `command` and any spawn() in the script.
 orch.run_script = scripter.run_script
 
 -- sleep(duration): sleep for the given duration, in seconds.  Fractional
@@ -27,10 +57,30 @@ orch.run_script = scripter.run_script
 -- is at least somewhat high resolution.
 orch.sleep = core.sleep
 
--- spawn(cmd...): spawn the given command, returning a process that may be
--- manipulated as needed.
+-- spawn([opts, ]cmd...): spawn the given command, returning a process that may
+-- be manipulated as needed.  If `opts` is supplied, it may set `pipe` to run
+-- the command on pipes instead of a pty: either true, or a table with `stdin`
+-- (false for /dev/null) and `stderr` ("merge" with stdout by default,
+-- "separate" to collect it for the process's stderr() method, or "null").
+-- Pipes are much faster for commands that just produce a lot of output, but
+-- there's no terminal to configure.
 orch.spawn = direct.spawn
 
+-- spawn_method([method]): get or set how processes are launched, either
+-- "fork" (the default) or "posix_spawn".  The latter avoids duplicating the
+-- interpreter's address space for every spawn, which is cheaper when the
+-- caller has a large heap; it requires the orch-spawn-helper to be installed.
+-- The default may also be set with $ORCH_SPAWN_METHOD.
+orch.spawn_method = core.spawn_method
+
+-- wait_any(procs[, timeout]): wait for any of the processes returned by spawn()
+-- in the `procs` array to become readable, returning an array of those that
+-- are.  The returned array is empty if `timeout` seconds elapse first; a nil
+-- timeout waits indefinitely.  If none of them can become readable (e.g.,
+-- `procs` is empty, or they've all hit EOF), then we still wait out `timeout`,
+-- or fail without one rather than block forever.
+orch.wait_any = direct.wait_any
+
 -- Reset all of the state; this largely means resetting the scripting bits, as
 -- a user of this lib won't really need to reset anything.
 function orch.reset()
@@ -47,8 +47,26 @@ function MatchAction:dump(level)
 end
 function MatchAction:matches(buffer)
 	local matcher_arg = self.pattern_obj or self.pattern
+	local base = buffer:offset()
+	local init = 1
+
+	-- self.resume is an absolute offset into the process output, so it
+	-- remains valid if some other action consumes from the buffer between
+	-- our attempts.
+	if self.resume and self.resume > base then
+		init = self.resume - base + 1
+	end
+
+	local result = table.pack(self.matcher.match(matcher_arg, buffer, init))
+	if not result[1] then
+		local overlap = self.matcher.overlap and self.matcher.overlap(self)
+
+		if overlap then
+			self.resume = math.max(base + buffer:len() - overlap, base)
+		end
+	end
 
-	return self.matcher.match(matcher_arg, buffer)
+	return table.unpack(result, 1, result.n)
 end
 
 actions.MatchAction = MatchAction
@@ -70,11 +88,27 @@ actions.defined = {
 	},
 	eof = {
 		print_diagnostics = function(action)
-			io.stderr:write(string.format("[%s]:%d: eof not observed\n",
-			    action.src, action.line))
+			if action.idled then
+				io.stderr:write(string.format(
+				    "[%s]:%d: eof not observed, no output for %s seconds\n",
+				    action.src, action.line, action.idle))
+			else
+				io.stderr:write(string.format(
+				    "[%s]:%d: eof not observed\n",
+				    action.src, action.line))
+			end
 		end,
 		init = function(action, args)
-			action.timeout = args[1] or action.ctx.timeout
+			-- Either may be false to disable it.
+			action.timeout = args[1]
+			if action.timeout == nil then
+				action.timeout = action.ctx.timeout
+			end
+
+			action.idle = args[2]
+			if action.idle == nil then
+				action.idle = action.ctx.idle
+			end
 		end,
 		execute = function(action)
 			local ctx = action.ctx
@@ -87,7 +121,8 @@ actions.defined = {
 			local function discard()
 			end
 
-			buffer:refill(discard, action.timeout)
+			action.idled = buffer:refill(discard, action.timeout,
+			    action.idle)
 			if not buffer.eof then
 				if not ctx:fail(action, buffer:contents()) then
 					return false
@@ -99,12 +134,8 @@ actions.defined = {
 	},
 	log = {
 		init = function(action, args)
-			local file = args[1]
-			if type(file) == "string" then
-				file = io.open(file, "a+")
-			end
-
-			action.file = file
+			action.file = args[1]
+			action.opts = args[2]
 		end,
 		execute = function(action)
 			local current_process = action.ctx.process
@@ -113,7 +144,7 @@ actions.defined = {
 				error("execute() called before process spawned.")
 			end
 
-			current_process:logfile(action.file)
+			assert(current_process:logfile(action.file, action.opts))
 			return true
 		end,
 	},
@@ -132,6 +163,22 @@ actions.defined = {
 			return true
 		end,
 	},
+	record = {
+		init = function(action, args)
+			action.file = args[1]
+			action.opts = args[2]
+		end,
+		execute = function(action)
+			local current_process = action.ctx.process
+
+			if not current_process then
+				error("record() called before process spawned.")
+			end
+
+			assert(current_process:record(action.file, action.opts))
+			return true
+		end,
+	},
 	release = {
 		execute = function(action)
 			local current_process = action.ctx.process
@@ -148,10 +195,11 @@ actions.defined = {
 			action.cmd = args
 
 			if type(action.cmd[1]) == "table" then
-				if #action.cmd > 1 then
+				if #action.cmd > 2 or (#action.cmd == 2 and
+				    type(action.cmd[2]) ~= "table") then
 					error("spawn: bad mix of table and additional arguments")
 				end
-				action.cmd = table.unpack(action.cmd)
+				action.cmd, action.opts = table.unpack(action.cmd)
 			end
 		end,
 		execute = function(action)
@@ -160,7 +208,8 @@ actions.defined = {
 				assert(current_process:close())
 			end
 
-			action.ctx.process = process:new(action.cmd, action.ctx)
+			action.ctx.process = process:new(action.cmd, action.ctx,
+			    action.opts)
 			return true
 		end,
 	},
@@ -179,6 +228,9 @@ actions.defined = {
 			local field = action.field
 			local set, unset = action.set, action.unset
 			local current_process = action.ctx.process
+			if not current_process.term then
+				error("stty: process has no terminal")
+			end
 
 			local value = current_process.term:fetch(field)
 			if type(value) == "table" then
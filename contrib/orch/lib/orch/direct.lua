@@ -4,6 +4,7 @@
 -- SPDX-License-Identifier: BSD-2-Clause
 --
 
+local core = require('orch.core')
 local actions = require('orch.actions')
 local context = require('orch.context')
 local matchers = require('orch.matchers')
@@ -16,8 +17,8 @@ direct.defaults = {
 }
 
 local direct_ctx = context:new()
-function direct_ctx.execute(_, callback)
-	callback()
+function direct_ctx.execute(_, callback, _, ...)
+	callback(...)
 end
 function direct_ctx:fail(_, contents)
 	if self.fail_handler then
@@ -28,11 +29,11 @@ end
 
 -- Wraps a process, provide everything we offer in actions.defined as a wrapper
 local DirectProcess = {}
-function DirectProcess:new(cmd, ctx)
+function DirectProcess:new(cmd, ctx, opts)
 	local pwrap = setmetatable({}, self)
 	self.__index = self
 
-	pwrap._process = process:new(cmd, ctx)
+	pwrap._process = process:new(cmd, ctx, opts)
 	pwrap.ctx = ctx
 	pwrap.timeout = direct.defaults.timeout
 
@@ -40,11 +41,14 @@ function DirectProcess:new(cmd, ctx)
 
 	return pwrap
 end
+-- match(pattern[, matcher]): the process's `timeout` applies, as does its
+-- `idle` timeout if one has been set.  Either may be false to disable it.
 function DirectProcess:match(pattern, matcher)
 	matcher = matcher or matchers.available.default
 
 	local action = actions.MatchAction:new("match")
 	action.timeout = self.timeout
+	action.idle = self.idle
 	action.pattern = pattern
 	action.matcher = matcher
 
@@ -54,6 +58,29 @@ function DirectProcess:match(pattern, matcher)
 
 	return self._process:match(action)
 end
+-- status(): "running", or "exited" and the exit code, or "signaled" and the
+-- signal number.  "unknown" if something else reaped the process, e.g., because
+-- SIGCHLD is ignored.
+function DirectProcess:status()
+	return self._process:status()
+end
+-- stderr(): for processes spawned with { pipe = { stderr = "separate" } },
+-- returns the stderr output that's been read since the last call.
+function DirectProcess:stderr()
+	return self._process:stderr()
+end
+-- rusage(): nil and an error while the process is running, then a table of
+-- `utime` and `stime` (CPU seconds), `maxrss` (peak RSS in kilobytes), `nvcsw`
+-- and `nivcsw` (voluntary and involuntary context switches), and `wall` (seconds
+-- from spawn to exit).
+function DirectProcess:rusage()
+	return self._process:rusage()
+end
+-- close([opts]): terminate the process, escalating through `opts.signals` with
+-- `opts.grace` seconds between them (default: SIGINT, then SIGKILL after 5s).
+function DirectProcess:close(opts)
+	return self._process:close(opts)
+end
 for name, def in pairs(actions.defined) do
 	-- Each of these gets a function that generates the action and then
 	-- subsequently executes it.
@@ -73,12 +100,85 @@ end
 
 function direct.spawn(...)
 	local fresh_ctx = {}
+	local cmd = {...}
+	local opts
+
+	for k, v in pairs(direct_ctx) do
+		fresh_ctx[k] = v
+	end
+
+	if type(cmd[1]) == "table" then
+		opts = table.remove(cmd, 1)
+	end
+
+	return DirectProcess:new(cmd, fresh_ctx, opts)
+end
+
+-- Play back a session from the recording at `path` in place of spawning a
+-- command, with any of orch.core's replay() `opts`.
+function direct.replay(path, opts)
+	local fresh_ctx = {}
+	local replay = { path = path }
 
 	for k, v in pairs(direct_ctx) do
 		fresh_ctx[k] = v
 	end
 
-	return DirectProcess:new({...}, fresh_ctx)
+	for k, v in pairs(opts or {}) do
+		replay[k] = v
+	end
+
+	return DirectProcess:new(nil, fresh_ctx, { replay = replay })
+end
+
+-- Wait for any of the DirectProcess objects in `procs` to have output or EOF
+-- pending, returning an array of those that do (empty on timeout).  A nil
+-- timeout blocks indefinitely, and fails if there's nothing to wait on.
+function direct.wait_any(procs, timeout)
+	local handles, owners = {}, {}
+
+	for _, pwrap in ipairs(procs) do
+		local handle = pwrap._process._process
+
+		handles[#handles + 1] = handle
+		owners[handle] = pwrap
+	end
+
+	local ready, err = core.wait_any(handles, timeout)
+	if not ready then
+		return nil, err
+	end
+
+	for idx, handle in ipairs(ready) do
+		ready[idx] = owners[handle]
+	end
+
+	return ready
+end
+
+-- Close all of the DirectProcess objects in `procs`, signalling all of them
+-- before waiting on any so that their grace periods run concurrently.  `opts`
+-- is as for DirectProcess:close().
+function direct.close_all(procs, opts)
+	local handles = {}
+
+	for _, pwrap in ipairs(procs) do
+		handles[#handles + 1] = pwrap._process._process
+	end
+
+	local ok, err = core.close_all(handles, opts)
+
+	-- The handles are all closed out now, so just tear down the rest rather
+	-- than closing them all over again.
+	for _, pwrap in ipairs(procs) do
+		pwrap._process:closed()
+	end
+
+	if not ok then
+		return nil, err
+	end
+
+	return true
 end
 
 return direct
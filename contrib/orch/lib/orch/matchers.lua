@@ -14,26 +14,85 @@ function PatternMatcher:new()
 	return obj
 end
 function PatternMatcher.match()
-	-- All matchers should return start, last of match
+	-- All matchers are handed an orch.core match buffer and the index to
+	-- start searching at, and should return start, last of match within it,
+	-- optionally followed by any values captured by the pattern.
 	return false
 end
+function PatternMatcher.overlap()
+	-- After a failed match, the number of bytes at the end of the buffer
+	-- that must be examined again on the next attempt, or nil if the whole
+	-- buffer must be rescanned.  Matchers that can't tell, or that ignore
+	-- the init argument to match(), should leave this alone.
+	return nil
+end
 
 local LuaMatcher = PatternMatcher:new()
-function LuaMatcher.match(pattern, buffer)
-	return buffer:find(pattern)
+function LuaMatcher.match(pattern, buffer, init)
+	local result = table.pack(buffer:contents(init):find(pattern))
+
+	if not result[1] then
+		return nil
+	end
+
+	-- Indices, including any position captures, are relative to where we
+	-- started.
+	init = init or 1
+	for idx = 1, result.n do
+		if math.type(result[idx]) == "integer" then
+			result[idx] = result[idx] + init - 1
+		end
+	end
+
+	return table.unpack(result, 1, result.n)
+end
+function LuaMatcher.overlap(action)
+	-- An anchored pattern would anchor at the resume point, rather than at
+	-- the beginning of the buffer.
+	if action.pattern:sub(1, 1) == "^" then
+		return nil
+	end
+
+	return action.window
 end
 
 local PlainMatcher = PatternMatcher:new()
-function PlainMatcher.match(pattern, buffer)
-	return buffer:find(pattern, nil, true)
+function PlainMatcher.match(pattern, buffer, init)
+	-- Searched in-place, no need to pull the contents out.
+	return buffer:find(pattern, init)
+end
+function PlainMatcher.overlap(action)
+	-- Any match must end in the newly arrived data, so we only need to back
+	-- up far enough to catch one that started in the old data.
+	return math.max(#action.pattern - 1, 0)
 end
 
 local PosixMatcher = PatternMatcher:new()
 function PosixMatcher.compile(pattern)
 	return assert(core.regcomp(pattern))
 end
-function PosixMatcher.match(pattern, buffer)
-	return pattern:find(buffer)
+function PosixMatcher.match(pattern, buffer, init)
+	-- Also searched in-place, and safe in the face of embedded NULs.
+	return pattern:find(buffer, init)
+end
+function PosixMatcher.overlap(action)
+	-- The resume point isn't the beginning of the buffer, so an anchored
+	-- pattern searched from there (with REG_NOTBOL) could never match.
+	if action.pattern:sub(1, 1) == "^" then
+		return nil
+	end
+
+	return action.window
+end
+
+local DfaMatcher = PatternMatcher:new()
+function DfaMatcher.compile(pattern)
+	return assert(core.dfa(pattern))
+end
+function DfaMatcher.match(pattern, buffer, init)
+	-- The compiled pattern carries its own state between calls, so it only
+	-- ever looks at new output; no overlap() needed.
+	return pattern:find(buffer, init)
 end
 
 -- Exported: the base for making new matchers, as well as a table of available
@@ -43,6 +102,7 @@ matchers.PatternMatcher = PatternMatcher
 -- default will be configurable via `matcher()`
 matchers.available = {
 	default = LuaMatcher,
+	dfa = DfaMatcher,
 	lua = LuaMatcher,
 	plain = PlainMatcher,
 	posix = PosixMatcher,
@@ -7,57 +7,62 @@
 local core = require("orch.core")
 local tty = core.tty
 
+-- The buffer itself lives in orch.core, and output is read directly into it;
+-- we only pull out a string when somebody explicitly asks for the contents.
 local MatchBuffer = {}
 function MatchBuffer:new(process, ctx)
 	local obj = setmetatable({}, self)
 	self.__index = self
-	self.buffer = ""
-	self.ctx = ctx
-	self.process = process
-	self.eof = false
+	obj.buffer = process._process:buffer()
+	obj.ctx = ctx
+	obj.process = process
+	obj.eof = false
 	return obj
 end
 function MatchBuffer:_matches(action)
-	local first, last = action:matches(self.buffer)
+	local result = table.pack(action:matches(self.buffer))
 
-	if not first then
+	if not result[1] then
 		return false
 	end
 
+	return self:_complete(action, result[2],
+	    table.unpack(result, 3, result.n))
+end
+function MatchBuffer:_complete(action, last, ...)
 	-- On match, we need to trim the buffer and signal completion.
 	action.completed = true
-	self.buffer = self.buffer:sub(last + 1)
+	action.captures = table.pack(...)
+	self.buffer:consume(last)
 
 	-- Return value is not significant, ignored.
 	if action.callback then
-		self.ctx:execute(action.callback)
+		self.ctx:execute(action.callback, nil, ...)
 	end
 
 	return true
 end
 function MatchBuffer:contents()
-	return self.buffer
+	return self.buffer:contents()
 end
 function MatchBuffer:empty()
-	return #self.buffer == 0
+	return self.buffer:empty()
 end
-function MatchBuffer:refill(action, timeout)
+-- Returns true if we gave up because the process went `idle` seconds without
+-- producing any output; a false `timeout` or `idle` disables that limit.
+function MatchBuffer:refill(action, timeout, idle)
 	assert(not self.eof)
 
 	if not self.process:released() then
-		self.process:release()
+		-- Fails if the command couldn't be executed.
+		assert(self.process:release())
 	end
-	local function refill(input)
-		if not input then
+	local function refill(count)
+		if not count then
 			self.eof = true
 			return true
 		end
 
-		if self.process.log then
-			self.process.log:write(input)
-		end
-
-		self.buffer = self.buffer .. input
 		if type(action) == "table" then
 			return self:_matches(action)
 		else
@@ -67,15 +72,26 @@ function MatchBuffer:refill(action, timeout)
 		end
 	end
 
-	if timeout then
-		assert(self.process:read(refill, timeout))
-	else
-		assert(self.process:read(refill))
+	-- A match may ask for more (or less) scrollback than the process has.
+	local handle = self.process._process
+	local prev
+	if type(action) == "table" and action.scrollback then
+		prev = handle:scrollback(action.scrollback)
+	end
+
+	local ok, status = self.process:read(refill, timeout or nil,
+	    idle or nil)
+
+	if prev then
+		handle:scrollback(prev)
 	end
+
+	assert(ok, status)
+	return status == "idle"
 end
 function MatchBuffer:match(action)
 	if not self:_matches(action) and not self.eof then
-		self:refill(action, action.timeout)
+		action.idled = self:refill(action, action.timeout, action.idle)
 	end
 
 	return action.completed
@@ -83,23 +99,54 @@ end
 
 -- Wrap a process and perform operations on it.
 local Process = {}
-function Process:new(cmd, ctx)
+-- `opts` may set `pipe` to spawn the process on pipes rather than a pty, as
+-- described for orch.core's spawn(); such a process has no `term`.  It may
+-- instead set `replay` to play back a recording in place of `cmd`, as a table
+-- of the recording's `path` and any of orch.core's replay() options.
+function Process:new(cmd, ctx, opts)
 	local pwrap = setmetatable({}, self)
 	self.__index = self
 
-	pwrap._process = assert(core.spawn(table.unpack(cmd)))
+	-- A context that's replaying a recording plays its next session in
+	-- place of each command that it spawns.
+	if ctx.replay then
+		local replay = {}
+
+		for k, v in pairs(ctx.replay) do
+			replay[k] = v
+		end
+
+		ctx.replay_session = (ctx.replay_session or
+		    (ctx.replay.session or 1) - 1) + 1
+		replay.session = ctx.replay_session
+		opts = { replay = replay }
+	end
+
+	if opts and opts.replay then
+		pwrap._process = assert(core.replay(opts.replay.path,
+		    opts.replay))
+	elseif opts and opts.pipe then
+		pwrap._process = assert(core.spawn({
+			pipe = opts.pipe,
+		}, table.unpack(cmd)))
+	else
+		-- Echo is disabled by the child before it reports in, and it
+		-- sends its terminal attributes along with that, so we don't
+		-- need any extra round trips before the script can start.
+		pwrap._process = assert(core.spawn({
+			term = {
+				lflag = { unset = tty.lflag.ECHO },
+			},
+		}, table.unpack(cmd)))
+	end
 	pwrap.buffer = MatchBuffer:new(pwrap, ctx)
 	pwrap.cfg = {}
 	pwrap.ctx = ctx
 	pwrap.is_raw = false
 
-	pwrap.term = assert(pwrap._process:term())
-	local mask = pwrap.term:fetch("lflag")
-
-	mask = mask & ~tty.lflag.ECHO
-	assert(pwrap.term:update({
-		lflag = mask,
-	}))
+	if not (opts and (opts.pipe or opts.replay)) then
+		pwrap.term = assert(pwrap._process:term())
+	end
 
 	return pwrap
 end
@@ -110,12 +157,23 @@ end
 function Process:release()
 	return self._process:release()
 end
-function Process:read(func, timeout)
-	if timeout then
-		return self._process:read(func, timeout)
-	else
-		return self._process:read(func)
+function Process:status()
+	return self._process:status()
+end
+function Process:stderr()
+	return self._process:stderr()
+end
+-- rusage(): resource usage of the exited process; see the core for the fields.
+-- This remains available after the process has been closed.
+function Process:rusage()
+	if not self._process then
+		return self._rusage
 	end
+
+	return self._process:rusage()
+end
+function Process:read(func, timeout, idle)
+	return self._process:read(func, timeout, idle)
 end
 function Process:raw(is_raw)
 	local prev_raw = self.is_raw
@@ -124,40 +182,23 @@ function Process:raw(is_raw)
 end
 function Process:write(data, cfg)
 	if not self.is_raw then
-		-- Convert ^[A-Z] -> cntrl sequence
-		local quoted = false
-		for i = 1, #data do
-			if i > #data then
-				break
+		-- Convert ^[A-Z] -> cntrl sequence, and strip the escaping
+		-- backslash from anything quoted.
+		data = data:gsub("([\\^])(.?)", function(esc, ch)
+			if esc == "\\" then
+				return ch
+			elseif ch == "" then
+				error("Incomplete CNTRL character at end of buffer")
 			end
 
-			local ch = data:sub(i, i)
-
-			if quoted then
-				quoted = false
-			elseif ch == "\\" then
-				quoted = true
-				data = data:sub(1, i - 1) .. data:sub(i + 1)
-			elseif ch == "^" then
-				if i == #data then
-					error("Incomplete CNTRL character at end of buffer")
-				end
-
-				local esch = data:sub(i + 1, i + 1)
-				local esc = string.byte(esch)
-				if esc < 0x40 or esc > 0x5f then
-					error("Invalid escape of '" .. esch .. "'")
-				end
-
-				esch = string.char(esc - 0x40)
-				data = data:sub(1, i - 1) .. esch .. data:sub(i + 2)
+			local byte = string.byte(ch)
+			if byte < 0x40 or byte > 0x5f then
+				error("Invalid escape of '" .. ch .. "'")
 			end
-		end
-	end
-	if self.log then
-		self.log:write(data)
-	end
 
+			return string.char(byte - 0x40)
+		end)
+	end
 	local bytes, delay
 	local function set_rate(which_cfg)
 		if not which_cfg or not which_cfg.rate then
@@ -178,46 +219,65 @@ function Process:write(data, cfg)
 	set_rate(self.cfg)
 	set_rate(cfg)
 
-	-- If we didn't have a configured rate, just send a single batch of all
-	-- data without delay.
-	if not bytes or bytes == 0 then
-		bytes = #data
-		delay = nil
-	end
-
-	local sent = 0
-	local total = #data
-
-	while sent < total do
-		local bound = math.min(total, sent + bytes)
-
-		assert(self._process:write(data:sub(sent + 1, bound)))
-		sent = bound
-
-		if delay and sent < total then
-			core.sleep(delay)
-		end
-	end
+	-- Pacing is handled in core; without a configured rate, all of the data
+	-- is sent in a single batch without delay.  Any output that arrived
+	-- while we were writing is already in the buffer, and both have been
+	-- logged by the core.
+	local sent, drained = self._process:write(data, bytes, delay)
+	assert(sent, drained)
 
 	return sent
 end
-function Process:close()
-	assert(self._process:close())
+-- close([opts]): `opts` may override the signals sent to terminate the process
+-- and the grace periods between them, as described for orch.close_all().
+function Process:close(opts)
+	assert(self._process:close(opts))
+	self:closed()
+	return true
+end
+-- closed(): tear down everything but the core process, which has already been
+-- closed out, e.g., by orch.core's close_all().
+function Process:closed()
+	self._rusage = self._process:rusage()
 
 	-- Flush output, close everything out
 	self:logfile(nil)
+	self:record(nil)
 	self._process = nil
 	self.term = nil
-	return true
 end
--- Our own special salt
-function Process:logfile(file)
-	if self.log then
-		self.log:flush()
+-- Our own special salt: `file` may be a path or an open file, which we take
+-- ownership of, and `opts` may set the core's `flush` policy and `bufsize`.
+-- The transcript is written by the core as output is read.
+function Process:logfile(file, opts)
+	local ok, err = true, nil
+
+	if self._process then
+		ok, err = self._process:logfile(file, opts)
+	end
+
+	if io.type(self.log) == "file" and self.log ~= file then
 		self.log:close()
 	end
 
 	self.log = file
+	return ok, err
+end
+-- As logfile(), but for a timestamped recording of the session that may be
+-- read back with orch.open_recording().
+function Process:record(file, opts)
+	local ok, err = true, nil
+
+	if self._process then
+		ok, err = self._process:record(file, opts)
+	end
+
+	if io.type(self.recording) == "file" and self.recording ~= file then
+		self.recording:close()
+	end
+
+	self.recording = file
+	return ok, err
 end
 function Process:match(action)
 	local buffer = self.buffer
@@ -225,14 +285,31 @@ function Process:match(action)
 		if not self.ctx:fail(action, buffer:contents()) then
 			return false
 		end
+
+		return true
 	end
 
-	return true
+	local captures = action.captures
+	return true, table.unpack(captures, 1, captures.n)
 end
 function Process:set(cfg)
 	for k, v in pairs(cfg) do
 		self.cfg[k] = v
 	end
+
+	if cfg.batch ~= nil then
+		self._process:batch(cfg.batch)
+	end
+	if cfg.filter ~= nil then
+		local ok, err = self._process:filter(cfg.filter or nil)
+
+		if not ok then
+			error("cfg: " .. err)
+		end
+	end
+	if cfg.scrollback ~= nil then
+		self._process:scrollback(cfg.scrollback)
+	end
 end
 
 return Process
@@ -0,0 +1,182 @@
+--
+-- Copyright (c) 2024 Kyle Evans <kevans@FreeBSD.org>
+--
+-- SPDX-License-Identifier: BSD-2-Clause
+--
+
+-- Reader for the recordings written by Process:record(); see orch_record.c in
+-- the core for the format.  Recordings may be large, so they're read a single
+-- event at a time rather than loaded up front.
+local recording = {}
+
+local MAGIC = "ORCHREC\001"
+local SESSION_FMT = ">I8"
+local EVENT_FMT = ">I1 I8 I4"
+local EVENT_HDRSZ = string.packsize(EVENT_FMT)
+
+local kinds = { "output", "input", "stderr", "eof" }
+
+local Reader = {}
+Reader.__index = Reader
+
+local function nsec2sec(nsec)
+	return nsec / 1000000000
+end
+
+-- next(): returns the next event in the recording, or nil at the end of it.
+-- Events are tables with the following fields:
+--   - kind: "session" at the start of each session, then "output", "input",
+--     "stderr", or "eof".
+--   - time: seconds since the start of the session.
+--   - delta: seconds since the previous event in the session.
+--   - offset: the byte offset of `data` within its stream for this session.
+--   - data: the bytes that were read or written.
+--   - realtime: the wall clock time that a "session" started, in seconds
+--     since the epoch.
+-- An error is raised if the recording is malformed or truncated.
+function Reader:next()
+	local hdr = self.file:read(EVENT_HDRSZ)
+	if not hdr then
+		return nil
+	elseif #hdr == EVENT_HDRSZ and hdr:sub(1, #MAGIC) == MAGIC then
+		-- The session header is larger than an event header.
+		local rest = self.file:read(#MAGIC + 8 - EVENT_HDRSZ) or ""
+
+		hdr = hdr .. rest
+		if #hdr ~= #MAGIC + 8 or hdr:sub(1, #MAGIC) ~= MAGIC then
+			error(self.name .. ": bad session header")
+		end
+
+		self.last = 0
+		self.offsets = {}
+		return {
+			kind = "session",
+			time = 0,
+			delta = 0,
+			offset = 0,
+			data = "",
+			realtime = nsec2sec(string.unpack(SESSION_FMT, hdr,
+			    #MAGIC + 1)),
+		}
+	elseif #hdr ~= EVENT_HDRSZ then
+		error(self.name .. ": truncated event")
+	elseif not self.offsets then
+		error(self.name .. ": not a recording")
+	end
+
+	local type, nsec, len = string.unpack(EVENT_FMT, hdr)
+	local kind = kinds[type]
+	if not kind then
+		error(self.name .. ": unknown event type " .. type)
+	end
+
+	local data = ""
+	if len > 0 then
+		data = self.file:read(len)
+		if not data or #data ~= len then
+			error(self.name .. ": truncated event")
+		end
+	end
+
+	local offset = self.offsets[kind] or 0
+	self.offsets[kind] = offset + len
+
+	local delta = nsec - self.last
+	self.last = nsec
+	return {
+		kind = kind,
+		time = nsec2sec(nsec),
+		delta = nsec2sec(delta),
+		offset = offset,
+		data = data,
+	}
+end
+
+-- events(): iterator over the remaining events.
+function Reader:events()
+	return function()
+		return self:next()
+	end
+end
+
+-- find(needle[, kind]): find the next occurrence of `needle` in the `kind`
+-- stream ("output" by default), which may span events but not sessions; the
+-- search carries on into later sessions if need be.  Returns the offset that it
+-- starts at in its session's stream and the time that the last of it arrived,
+-- or nil if the rest of the recording doesn't contain it.
+function Reader:find(needle, kind)
+	local carry = ""
+
+	kind = kind or "output"
+	for event in self:events() do
+		if event.kind == "session" then
+			-- Streams don't continue across sessions.
+			carry = ""
+		elseif event.kind == kind then
+			local window = carry .. event.data
+			local start = window:find(needle, 1, true)
+
+			if start then
+				return event.offset - #carry + start - 1,
+				    event.time
+			end
+
+			-- Keep enough of the tail for a match that spans into
+			-- the next event.
+			local keep = math.min(#window, #needle - 1)
+			carry = window:sub(#window - keep + 1)
+		end
+	end
+
+	return nil
+end
+
+-- gaps(threshold): returns an array of the remaining events that came at
+-- least `threshold` seconds after the event before them, i.e., where the
+-- session stalled.
+function Reader:gaps(threshold)
+	local gaps = {}
+
+	for event in self:events() do
+		if event.kind ~= "session" and event.delta >= threshold then
+			gaps[#gaps + 1] = event
+		end
+	end
+
+	return gaps
+end
+
+function Reader:close()
+	if self.owned then
+		self.file:close()
+	end
+
+	self.file = nil
+end
+
+Reader.__close = Reader.close
+
+-- open(file): `file` may be a path or an open file.  We only close the file
+-- on close() if we opened it.
+function recording.open(file)
+	local reader = setmetatable({}, Reader)
+
+	if io.type(file) == "file" then
+		reader.file = file
+		reader.name = "recording"
+	else
+		local err
+
+		reader.file, err = io.open(file, "rb")
+		if not reader.file then
+			return nil, err
+		end
+
+		reader.name = file
+		reader.owned = true
+	end
+
+	return reader
+end
+
+return recording
@@ -21,7 +21,10 @@ local current_ctx
 
 local match_valid_cfg = {
 	callback = true,
+	idle = true,
+	scrollback = true,
 	timeout = true,
+	window = true,
 }
 
 -- Sometimes a queue, sometimes a stack.  Oh well.
@@ -128,29 +131,46 @@ function MatchContext:process()
 end
 function MatchContext:process_one()
 	local ctx_actions = self:items()
-	local elapsed = 0
 	local current_process = current_ctx.process
 
 	if not current_process then
 		error("Script did not spawn process prior to matching")
 	end
 
-	-- Return low, high timeout of current batch
-	local function get_timeout()
+	-- Each action gets an absolute deadline, measured against the monotonic
+	-- clock from the time that the block started processing.
+	local start = core.time()
+	local function deadline(action)
+		if not action.timeout then
+			return math.huge
+		end
+
+		return start + action.timeout
+	end
+
+	-- The block as a whole is only idle once the most patient of its
+	-- actions would be.
+	local idle
+	for _, action in ipairs(ctx_actions) do
+		if not action.idle then
+			idle = nil
+			break
+		end
+
+		idle = math.max(idle or 0, action.idle)
+	end
+
+	-- Return the nearest deadline of the actions still in play
+	local function next_deadline(now)
 		local low
 
 		for _, action in ipairs(ctx_actions) do
-			if action.timeout <= elapsed then
-				goto skip
-			end
-			if low == nil then
-				low = action.timeout
-				goto skip
-			end
-
-			low = math.min(low, action.timeout)
+			local action_deadline = deadline(action)
 
-			::skip::
+			if action_deadline > now and
+			    (low == nil or action_deadline < low) then
+				low = action_deadline
+			end
 		end
 		return low
 	end
@@ -159,14 +179,33 @@ function MatchContext:process_one()
 	-- block, but it could be swapped out by a later block.  We don't care,
 	-- though, because we won't need the buffer anymore.
 	local buffer = current_process.buffer
-
-	local start = core.time()
+	local multimatch = self.action.multimatch
 	local matched
 
+	-- With a multimatch, the whole block is scanned for in one pass up front
+	-- and each action just checks the result.
+	local function action_matches(idx, action)
+		if not multimatch then
+			return buffer:_matches(action)
+		end
+
+		local _, last = multimatch:match(idx)
+		if not last then
+			return false
+		end
+
+		return buffer:_complete(action, last)
+	end
+
 	local function match_any()
-		local elapsed_now = core.time() - start
-		for _, action in ipairs(ctx_actions) do
-			if action.timeout >= elapsed_now and buffer:_matches(action) then
+		local now = core.time()
+
+		if multimatch then
+			multimatch:scan(buffer.buffer)
+		end
+
+		for idx, action in ipairs(ctx_actions) do
+			if deadline(action) >= now and action_matches(idx, action) then
 				matched = true
 				return true
 			end
@@ -175,21 +214,30 @@ function MatchContext:process_one()
 		return false
 	end
 
-	local tlo
+	if multimatch then
+		multimatch:reset()
+	end
 
 	while not matched and not buffer.eof do
 		-- We recalculate every iteration to rule out any actions that have
-		-- timed out.  Anything with a timeout lower than our current will be
-		-- ignored for matching.
-		elapsed = core.time() - start
-		tlo = get_timeout()
+		-- timed out.  Anything whose deadline has passed will be ignored
+		-- for matching.
+		local now = core.time()
+		local next_time = next_deadline(now)
 
-		if tlo == nil then
+		if next_time == nil then
 			break
 		end
 
-		assert(tlo > elapsed)
-		buffer:refill(match_any, tlo - elapsed)
+		-- Nothing left with a timeout; just wait for output.
+		local timeout
+		if next_time ~= math.huge then
+			timeout = next_time - now
+		end
+
+		if buffer:refill(match_any, timeout, idle) then
+			break
+		end
 	end
 
 	if not matched then
@@ -214,13 +262,14 @@ end
 -- Execute a chunk; may either be a callback from a match block, or it may be
 -- an entire included file.  Either way, each execution gets a new match context
 -- that we may or may not use.  We'll act upon the latest in the stack no matter
--- what happens.
-function script_ctx:execute(func, match_ctx)
+-- what happens.  Any additional arguments are passed along to the chunk, e.g.,
+-- the captures from the match that triggered a callback.
+function script_ctx:execute(func, match_ctx, ...)
 	local match_ctx_stack = self.match_ctx_stack
 	local prev_ctx = self.match_ctx
 	self.match_ctx = match_ctx or MatchContext:new()
 
-	assert(pcall(func))
+	assert(pcall(func, ...))
 
 	-- If we created a new context for this, we may need to put it on the
 	-- stack.  We'll leave caller-supplied contexts alone.
@@ -259,11 +308,14 @@ function script_ctx:reset()
 	end
 
 	self.process = nil
+	self.replay = nil
+	self.replay_session = nil
 
 	self.match_ctx_stack:clear()
 	self.match_ctx = nil
 	self._state = CTX_QUEUE
 	self.timeout = actions.default_timeout
+	self.idle = nil
 end
 function script_ctx:state(new_state)
 	local prev_state = self._state
@@ -370,9 +422,16 @@ function scripter.env.matcher(val)
 	return true
 end
 
+function scripter.env.idle(val)
+	if val ~= false and (type(val) ~= "number" or val <= 0) then
+		error("Idle timeout must be > 0, or false")
+	end
+	current_ctx.idle = val or nil
+end
+
 function scripter.env.timeout(val)
-	if val == nil or val < 0 then
-		error("Timeout must be >= 0")
+	if val ~= false and (val == nil or val < 0) then
+		error("Timeout must be >= 0, or false")
 	end
 	current_ctx.timeout = val
 end
@@ -423,6 +482,13 @@ local extra_actions = {
 	},
 	match = {
 		print_diagnostics = function(action)
+			if action.idled then
+				io.stderr:write(string.format("[%s]:%d: match (pattern '%s') failed, no output for %s seconds\n",
+				    action.src, action.line, action.pattern,
+				    action.idle))
+				return
+			end
+
 			io.stderr:write(string.format("[%s]:%d: match (pattern '%s') failed\n",
 			    action.src, action.line, action.pattern))
 		end,
@@ -431,6 +497,7 @@ local extra_actions = {
 
 			action.pattern = pattern
 			action.timeout = action.ctx.timeout
+			action.idle = action.ctx.idle
 
 			if action.matcher.compile then
 				action.pattern_obj = action.matcher.compile(pattern)
@@ -466,10 +533,23 @@ local extra_actions = {
 			script_ctx:execute(func, action.match_ctx)
 
 			-- Sanity check the script
+			local patterns = {}
 			for _, chaction in ipairs(action.match_ctx:items()) do
 				if chaction.type ~= "match" then
 					error("Type '" .. chaction.type .. "' not legal in a one() block")
 				end
+
+				if patterns and chaction.matcher == matchers.available.plain then
+					patterns[#patterns + 1] = chaction.pattern
+				else
+					patterns = nil
+				end
+			end
+
+			-- If every alternative is a plain string, then we can look for
+			-- all of them at once.
+			if patterns and #patterns > 1 then
+				action.multimatch = assert(core.multimatch(patterns))
 			end
 		end,
 		execute = function(action)
@@ -492,10 +572,13 @@ local extra_actions = {
 -- Valid config options:
 --   * alter_path: boolean, add script's directory to $PATH (default: false)
 --   * command: argv table to pass to spawn
+--   * replay: table with the `path` of a recording to play back in place of
+--     the command and each spawn(), and any other options for core.replay()
 function scripter.run_script(scriptfile, config)
 	local done
 
 	script_ctx:reset()
+	script_ctx.replay = config and config.replay
 	current_ctx = script_ctx
 
 	-- Make a copy of scripter.env at the time of script execution.  The
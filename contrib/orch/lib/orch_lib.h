@@ -7,9 +7,12 @@
 #pragma once
 
 #include <sys/types.h>
+#include <sys/resource.h>
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <termios.h>
+#include <time.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -21,6 +24,24 @@
 #define	luaL_pushfail(L)	lua_pushnil(L)
 #endif
 
+#define	ORCHLUA_MATCHBUFHANDLE	"orchlua_matchbuf"
+#define	ORCHLUA_PROCESSHANDLE	"orchlua_process"
+
+/* Longest error message from the child that we'll hang on to. */
+#define	ORCH_ERRMSG_MAX		256
+
+/*
+ * How long, in seconds, we'll keep reading output after the child exits if its
+ * pty hasn't reported EOF, e.g., because it left children behind.
+ */
+#define	ORCH_EXIT_GRACE		0.25
+
+/* Default size of a process's log buffer. */
+#define	ORCH_LOG_BUFSZ		(64 * 1024)
+
+/* Default limit on how much output we'll batch up per read() callback. */
+#define	ORCH_READ_HIWAT		(64 * 1024)
+
 struct orch_ipc_msg;
 typedef struct orch_ipc *orch_ipc_t;
 
@@ -36,19 +57,54 @@ enum orch_ipc_tag {
 	IPC_LAST,
 };
 
+struct orch_matchbuf {
+	char			*data;
+	size_t			 head;
+	size_t			 tail;
+	size_t			 cap;
+	uint64_t		 base;	/* Bytes consumed over our lifetime */
+};
+
+struct orch_filter;
+struct orch_log;
+struct orch_record;
+struct orch_replay;
+
 struct orch_process {
 	lua_State		*L;
 	struct orch_term	*term;
+	struct orch_log		*log;		/* Transcript, if any */
+	struct orch_filter	*filter;	/* Output filters, if any */
+	struct orch_filter	*errfilter;	/* ... and for errfd */
+	struct orch_record	*rec;		/* Recording, if any */
+	struct orch_replay	*replay;	/* Expected input, if replaying */
 	orch_ipc_t		 ipc;
+	struct orch_matchbuf	*buffer;
+	size_t			 read_hiwat;
+	size_t			 scrollback;	/* Buffer limit, or 0 */
+	struct termios		 child_term;	/* As reported at spawn */
+	char			 errmsg[ORCH_ERRMSG_MAX];	/* From the child */
 	int			 cmdsock;
+	int			 reapfd;	/* Readable on exit */
+	int			 errfd;		/* stderr pipe, or -1 */
+	int			 infd;		/* stdin pipe, or -1 */
 	pid_t			 pid;
 	int			 status;
-	int			 termctl;
+	struct rusage		 rusage;	/* Valid once reaped */
+	struct timespec		 started;
+	struct timespec		 exited;	/* Valid once reaped */
+	struct timespec		 exitgrace;	/* ... and ORCH_EXIT_GRACE later */
+	struct orch_matchbuf	 errbuf;	/* stderr, if kept separate */
+	int			 termctl;	/* pty, or stdout pipe */
 	bool			 raw;
 	bool			 released;
 	bool			 eof;
 	bool			 buffered;
 	bool			 error;
+	bool			 child_term_valid;
+	bool			 status_valid;	/* Reaped by us, not elsewhere */
+	bool			 pipe;		/* No pty */
+	bool			 errsep;	/* stderr goes to errbuf */
 };
 
 struct orch_term {
@@ -57,6 +113,80 @@ struct orch_term {
 	bool			initialized;
 };
 
+struct orch_termflags {
+	tcflag_t		 set;
+	tcflag_t		 unset;
+};
+
+/* Terminal settings to apply in the child before it reports in. */
+struct orch_termmask {
+	struct orch_termflags	 iflag;
+	struct orch_termflags	 oflag;
+	struct orch_termflags	 lflag;
+	cc_t			 cc[NCCS];
+	bool			 cc_set[NCCS];
+};
+
+enum orch_spawn_method {
+	ORCH_SPAWN_DEFAULT = 0,
+	ORCH_SPAWN_FORK,
+	ORCH_SPAWN_POSIX,	/* posix_spawn(3) via orch-spawn-helper */
+};
+
+/* Output filters; see orch_filter.c. */
+enum orch_filter_type {
+	ORCH_FILTER_ANSI = 0,	/* Strip escape sequences */
+	ORCH_FILTER_CRLF,	/* CRLF -> LF */
+	ORCH_FILTER_NUL,	/* Drop NULs */
+	ORCH_FILTER_UTF8,	/* Replace invalid UTF-8 with U+FFFD */
+	ORCH_FILTER_LAST,
+};
+
+#define	ORCH_FILTER_MAX		8	/* Stages in a chain */
+
+/* When a process's log buffer is written out. */
+enum orch_log_flush {
+	ORCH_LOG_FULL = 0,	/* Only when the buffer fills, or on close */
+	ORCH_LOG_BATCH,		/* Whenever control returns to the script */
+	ORCH_LOG_ALWAYS,	/* Unbuffered */
+};
+
+/* Event types in a recording; see orch_record.c for the format. */
+enum orch_record_event {
+	ORCH_REC_OUTPUT = 1,
+	ORCH_REC_INPUT,
+	ORCH_REC_STDERR,
+	ORCH_REC_EOF,
+};
+
+#define	ORCH_REC_MAGIC		"ORCHREC\001"
+#define	ORCH_REC_MAGICSZ	8
+#define	ORCH_REC_HDRSZ		(ORCH_REC_MAGICSZ + 8)
+#define	ORCH_REC_EVHDRSZ	(1 + 8 + 4)
+
+struct orch_replay_event {
+	enum orch_record_event	 type;
+	uint64_t		 time;		/* ns since session start */
+	uint32_t		 len;
+	off_t			 dataoff;	/* Offset of the data in the file */
+};
+
+/* Where a pipe-mode child's stderr goes. */
+enum orch_spawn_stderr {
+	ORCH_STDERR_MERGE = 0,	/* Its own pipe, read into the match buffer */
+	ORCH_STDERR_SEPARATE,	/* Its own pipe, read into a separate buffer */
+	ORCH_STDERR_NULL,	/* /dev/null */
+};
+
+struct orch_spawn_opts {
+	struct orch_termmask	 termmask;
+	struct orch_replay	*replay;	/* Play this back, don't exec */
+	enum orch_spawn_method	 method;
+	enum orch_spawn_stderr	 pipe_stderr;
+	bool			 pipe;		/* stdio on pipes, not a pty */
+	bool			 pipe_stdin;	/* else stdin is /dev/null */
+};
+
 struct orchlua_tty_cntrl {
 	int		 cntrl_idx;
 	const char	*cntrl_name;
@@ -73,9 +203,48 @@ struct orchlua_tty_mode {
 #define	CNTRL_BOTH	0x03
 #define	CNTRL_LITERAL	0x04
 
+/* orch_ac.c */
+int orchlua_setup_multimatch(lua_State *);
+
+/* orch_buffer.c */
+int orch_matchbuf_append(struct orch_matchbuf *, const char *, size_t);
+void orch_matchbuf_commit(struct orch_matchbuf *, size_t);
+void orch_matchbuf_consume(struct orch_matchbuf *, size_t);
+const char *orch_matchbuf_data(const struct orch_matchbuf *, size_t *);
+void orch_matchbuf_free(struct orch_matchbuf *);
+int orch_matchbuf_reserve(struct orch_matchbuf *, size_t, char **);
+size_t orch_matchbuf_space(const struct orch_matchbuf *);
+size_t orch_matchbuf_trim(struct orch_matchbuf *, size_t);
+const char *orchlua_checksubject(lua_State *, int, size_t *);
+int orchlua_matchbuf(lua_State *);
+struct orch_matchbuf *orchlua_matchbuf_alloc(lua_State *);
+size_t orchlua_optindex(lua_State *, int, size_t);
+int orchlua_setup_matchbuf(lua_State *);
+
+/* orch_clock.c */
+void orch_clock_add(struct timespec *, double);
+void orch_clock_now(struct timespec *);
+double orch_clock_seconds(void);
+void orch_deadline_init(struct timespec *, double);
+double orch_deadline_remaining(const struct timespec *);
+bool orch_deadline_expired(const struct timespec *);
+const struct timespec *orch_deadline_min(const struct timespec *,
+    const struct timespec *);
+int orch_deadline_poll_ms(const struct timespec *);
+
+/* orch_dfa.c */
+int orchlua_setup_dfa(lua_State *);
+
+/* orch_filter.c */
+struct orch_filter *orch_filter_alloc(const enum orch_filter_type *, size_t);
+void orch_filter_free(struct orch_filter *);
+ssize_t orch_filter_run(struct orch_filter *, const char *, size_t, bool,
+    const char **);
+
 /* orch_ipc.c */
 typedef int (orch_ipc_handler)(orch_ipc_t, struct orch_ipc_msg *, void *);
 int orch_ipc_close(orch_ipc_t);
+int orch_ipc_fd(orch_ipc_t);
 orch_ipc_t orch_ipc_open(int);
 bool orch_ipc_okay(orch_ipc_t);
 int orch_ipc_recv(orch_ipc_t, struct orch_ipc_msg **);
@@ -88,12 +257,51 @@ int orch_ipc_send(orch_ipc_t, struct orch_ipc_msg *);
 int orch_ipc_send_nodata(orch_ipc_t, enum orch_ipc_tag);
 int orch_ipc_wait(orch_ipc_t, bool *);
 
+/* orch_log.c */
+int orch_log_close(struct orch_log *);
+int orch_log_flush(struct orch_log *);
+struct orch_log *orch_log_open(int, enum orch_log_flush, size_t);
+int orch_log_sync(struct orch_log *);
+int orch_log_write(struct orch_log *, const char *, size_t);
+
+/* orch_poll.c */
+int orchlua_setup_poll(lua_State *);
+
+/* orch_reap.c */
+int orch_reap_open(pid_t);
+void orch_reap_close(int);
+void orch_reap_ack(int);
+bool orch_reap_check(struct orch_process *);
+bool orch_reap_wait(struct orch_process *, const struct timespec *);
+
+/* orch_record.c */
+int orch_record_close(struct orch_record *);
+int orch_record_event(struct orch_record *, enum orch_record_event,
+    const char *, size_t);
+struct orch_record *orch_record_open(int, enum orch_log_flush, size_t);
+int orch_record_sync(struct orch_record *);
+
+/* orch_replay.c */
+void orch_replay_close(struct orch_replay *);
+int orch_replay_expect(struct orch_replay *, const char *, size_t,
+    uint64_t *);
+int orch_replay_movefd(struct orch_replay *, int);
+int orch_replay_next(struct orch_replay *, struct orch_replay_event *);
+struct orch_replay *orch_replay_open(int, int, double);
+int orch_replay_play(struct orch_replay *, int, int, int);
+
 /* orch_spawn.c */
 int orch_release(orch_ipc_t);
-int orch_spawn(int, const char *[], struct orch_process *, orch_ipc_handler *);
+int orch_release_exec(orch_ipc_t);
+int orch_spawn(int, const char *[], struct orch_process *,
+    const struct orch_spawn_opts *, orch_ipc_handler *);
+int orch_spawn_helper(int, const char *[]);
+enum orch_spawn_method orch_spawn_method_get(void);
+void orch_spawn_method_set(enum orch_spawn_method);
 
 /* orch_tty.c */
 int orchlua_setup_tty(lua_State *);
+int orchlua_tty_checkmask(lua_State *, int, struct orch_termmask *);
 int orchlua_tty_alloc(lua_State *, const struct orch_term *,
     struct orch_term **);
 
@@ -0,0 +1,22 @@
+/*-
+ * Copyright (c) 2024 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "orch.h"
+#include "orch_lib.h"
+
+/*
+ * orch-spawn-helper fd command [argument ...]
+ *
+ * Exec'd by orch.core's posix_spawn path with the new pts as its stdio and the
+ * IPC socket at `fd`.  It does the bits of child setup that posix_spawn(3)
+ * can't, then waits to be released before exec'ing `command`.
+ */
+int
+main(int argc, const char *argv[])
+{
+
+	return (orch_spawn_helper(argc, argv));
+}
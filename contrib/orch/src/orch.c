@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <err.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -25,7 +26,9 @@ usage(const char *name, int error)
 	else
 		f = stderr;
 
-	fprintf(f, "usage: %s [-f file] [command [argument ...]]\n", name);
+	fprintf(f,
+	    "usage: %s [-f file] [-r recording [-s speed]] [command [argument ...]]\n",
+	    name);
 	exit(error);
 }
 
@@ -34,13 +37,24 @@ main(int argc, char *argv[])
 {
 	const char *invoke_path = argv[0];
 	const char *scriptf = "-";	/* stdin */
+	const char *replayf = NULL;
+	char *end;
+	double speed = 1;
 	int ch;
 
-	while ((ch = getopt(argc, argv, "f:h")) != -1) {
+	while ((ch = getopt(argc, argv, "f:hr:s:")) != -1) {
 		switch (ch) {
 		case 'f':
 			scriptf = optarg;
 			break;
+		case 'r':
+			replayf = optarg;
+			break;
+		case 's':
+			speed = strtod(optarg, &end);
+			if (*optarg == '\0' || *end != '\0' || speed < 0)
+				errx(1, "invalid speed '%s'", optarg);
+			break;
 		case 'h':
 			usage(invoke_path, 0);
 		default:
@@ -56,6 +70,6 @@ main(int argc, char *argv[])
 	 * simplify things.  If we didn't, then the script just needs to make sure
 	 * that it spawns something before a match/one block.
 	 */
-	return (orch_interp(scriptf, invoke_path, argc,
+	return (orch_interp(scriptf, invoke_path, replayf, speed, argc,
 	    (const char * const *)argv));
 }
@@ -9,4 +9,5 @@
 #include <lua.h>
 
 /* orch_interp.c */
-int orch_interp(const char *, const char *, int, const char * const []);
+int orch_interp(const char *, const char *, const char *, double, int,
+    const char * const []);
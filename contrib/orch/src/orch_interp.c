@@ -80,7 +80,7 @@ orch_interp_error(lua_State *L)
 
 int
 orch_interp(const char *scriptf, const char *orch_invoke_path,
-    int argc, const char * const argv[])
+    const char *replayf, double speed, int argc, const char * const argv[])
 {
 	lua_State *L;
 	int status;
@@ -124,6 +124,17 @@ orch_interp(const char *scriptf, const char *orch_invoke_path,
 			lua_setfield(L, -2, "command");
 		}
 
+		if (replayf != NULL) {
+			/* config.replay */
+			lua_createtable(L, 0, 2);
+			lua_pushstring(L, replayf);
+			lua_setfield(L, -2, "path");
+			lua_pushnumber(L, speed);
+			lua_setfield(L, -2, "speed");
+
+			lua_setfield(L, -2, "replay");
+		}
+
 		if (lua_pcall(L, 2, 1, 0) == LUA_OK)
 			status = lua_toboolean(L, -1) ? 0 : 1;
 		else
@@ -16,6 +16,12 @@ fi
 
 orchdir="$(dirname "$orchbin")"
 
+if [ -n "$ORCH_LIBTEST" ]; then
+	libtest="$ORCH_LIBTEST"
+else
+	libtest="$orchdir/../tests/orch-libtest"
+fi
+
 if [ -n "$ORCHLUA_PATH" ]; then
 	cd "$ORCHLUA_PATH"
 fi
@@ -29,12 +35,16 @@ if [ $# -ge 1 ]; then
 	tests=""
 
 	for test in "$@"; do
-		tests="$tests $scriptdir/$test.orch"
+		if [ -f "$scriptdir/$test.lua" ]; then
+			tests="$tests $scriptdir/$test.lua"
+		else
+			tests="$tests $scriptdir/$test.orch"
+		fi
 	done
 
 	set -- $tests
 else
-	set -- "$scriptdir"/*.orch
+	set -- "$scriptdir"/*.orch "$scriptdir"/*.lua
 fi
 
 echo "1..$#"
@@ -54,12 +64,26 @@ not_ok()
 	fails=$((fails + 1))
 }
 
-for f in "$@" ;do
-	f=$(basename "$f" .orch)
-	testf="$scriptdir/$f.orch"
+for testf in "$@" ;do
+	case "$testf" in
+	*.lua)
+		f=$(basename "$testf" .lua)
+		;;
+	*)
+		f=$(basename "$testf" .orch)
+		;;
+	esac
+
 	expected_rc=0
+	orchargs=""
+	expected_error=$(sed -n 's/^-- ERROR: //p' "$testf")
 	spawn="cat"
 
+	# Tests expected to fail with a specific error.
+	if [ -n "$expected_error" ]; then
+		expected_rc=1
+	fi
+
 	case "$f" in
 	timeout_*)
 		expected_rc=1
@@ -72,17 +96,33 @@ for f in "$@" ;do
 	spawn_*)
 		spawn=""
 		;;
+	replay_*)
+		# cat(1) is played back from replay.rec instead, without delays.
+		orchargs="-r $scriptdir/replay.rec -s 0"
+		;;
 	esac
 
+	errf=$(mktemp -t orch_test.XXXXXX)
+
 	start=$(date +"%s")
 	if [ -x "$testf" ]; then
 		env PATH="$orchdir":"$PATH" "$testf"
+	elif [ "${testf%.lua}" != "$testf" ]; then
+		"$libtest" "$testf"
 	else
-		"$orchbin" -f "$testf" -- $spawn
-	fi
+		"$orchbin" $orchargs -f "$testf" -- $spawn
+	fi 2> "$errf"
 	rc="$?"
 	end=$(date +"%s")
 
+	1>&2 cat "$errf"
+	if [ -n "$expected_error" ] && ! grep -qF "$expected_error" "$errf"; then
+		rm -f "$errf"
+		not_ok "expected error '$expected_error'"
+		continue
+	fi
+
+	rm -f "$errf"
 	if [ "$rc" -ne "$expected_rc" ]; then
 		not_ok "expected $expected_rc, exited with $rc"
 		continue
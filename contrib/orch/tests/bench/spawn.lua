@@ -0,0 +1,38 @@
+-- Time spawning true(1) with each launch method from a parent with a large,
+-- touched heap, which is what fork() has to duplicate and posix_spawn() avoids.
+-- The heap size (in MB) and number of spawns may be set in the environment as
+-- ORCH_BENCH_HEAP and ORCH_BENCH_SPAWNS.
+local core = require("orch.core")
+
+local heapmb = tonumber(os.getenv("ORCH_BENCH_HEAP") or 1024)
+local nspawns = tonumber(os.getenv("ORCH_BENCH_SPAWNS") or 200)
+
+-- string.rep() writes out every byte, so the pages are all resident.
+local heap = string.rep("x", heapmb * 1024 * 1024)
+
+local function spawn_one(method)
+	local proc = assert(core.spawn({ method = method }, "true"))
+	local eof = false
+
+	assert(proc:release())
+	while not eof do
+		assert(proc:read(function(nbytes)
+			if not nbytes then
+				eof = true
+			end
+		end))
+	end
+
+	assert(proc:close())
+end
+
+for _, method in ipairs({ "fork", "posix_spawn" }) do
+	local start = core.time()
+
+	for _ = 1, nspawns do
+		spawn_one(method)
+	end
+
+	print(string.format("%d MB heap, %s: %.2f ms/spawn", #heap >> 20,
+	    method, (core.time() - start) * 1000 / nspawns))
+end
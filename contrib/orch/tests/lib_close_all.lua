@@ -0,0 +1,39 @@
+local core = require("orch.core")
+local orch = require("orch")
+
+local stubborn = "trap '' USR1; echo ready; while :; do sleep 0.1; done"
+
+local function spawn_ready(script)
+	local proc = orch.spawn("sh", "-c", script)
+
+	assert(proc:match("ready"))
+	return proc
+end
+
+-- Both of these ignore the first signal, so they have to be escalated to
+-- SIGKILL; the grace period should only be waited out once for the pair.
+local a, b = spawn_ready(stubborn), spawn_ready(stubborn)
+local start = core.time()
+local ok, err = orch.close_all({ a, b }, {
+	signals = { "USR1", "KILL" },
+	grace = 2,
+})
+local elapsed = core.time() - start
+
+assert(not ok, "close_all() didn't report the escalation")
+assert(err == "could not kill process with SIGUSR1", err)
+assert(elapsed >= 1.9, "grace period cut short: " .. elapsed)
+assert(elapsed < 3.5, "grace periods weren't concurrent: " .. elapsed)
+
+-- These go quietly on the first signal.
+a, b = spawn_ready("echo ready; sleep 10"), spawn_ready("echo ready; sleep 10")
+assert(orch.close_all({ a, b }, { signals = { "TERM" } }))
+
+-- The wrappers are torn down, but what the core collected sticks around.
+assert(a:rusage())
+assert(b:rusage())
+
+-- A single process escalates the same way, though close() raises it.
+a = spawn_ready(stubborn)
+ok, err = pcall(a.close, a, { signals = { "USR1", "KILL" }, grace = 0.5 })
+assert(not ok and err == "could not kill process with SIGUSR1", err)
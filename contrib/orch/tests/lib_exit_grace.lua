@@ -0,0 +1,33 @@
+local core = require("orch.core")
+local orch = require("orch")
+
+-- All of seq(1)'s output fits in the pipe, so it's long gone by the time we
+-- read any of it.  Each batch then takes longer to handle than the exit grace
+-- period, but we should still get all of it before EOF.
+local proc = orch.spawn({ pipe = true }, "seq", "1", "10000")
+local handle = proc._process._process
+
+handle:batch(16 * 1024)
+proc:release()
+core.sleep(0.5)
+
+local batches, eof = 0, false
+assert(handle:read(function(count)
+	if count == nil then
+		eof = true
+		return true
+	end
+
+	batches = batches + 1
+	core.sleep(0.3)
+	return false
+end, 30))
+
+assert(eof, "read() finished without EOF")
+assert(batches > 1, "expected more than one batch, got " .. batches)
+
+local contents = handle:buffer():contents()
+assert(contents:sub(-7) == "\n10000\n", "output cut short at " .. #contents ..
+    " bytes")
+
+assert(proc:close())
@@ -0,0 +1,73 @@
+local orch = require("orch")
+
+local path = os.tmpname()
+
+-- "hello" arrives in two pieces, so that find() has to look across events.
+local proc = orch.spawn({ pipe = true }, "sh", "-c",
+    "printf hel; sleep 0.3; printf lo; read x; echo \"got $x\"")
+assert(proc:record(path))
+assert(proc:match("hello"))
+proc:write("in\n")
+assert(proc:match("got in"))
+assert(proc:eof(5))
+assert(proc:close())
+
+local function open()
+	return assert(orch.open_recording(path))
+end
+
+local expected = {
+	{ kind = "session", offset = 0 },
+	{ kind = "output", offset = 0, data = "hel" },
+	{ kind = "output", offset = 3, data = "lo" },
+	{ kind = "input", offset = 0, data = "in\n" },
+	{ kind = "output", offset = 5, data = "got in\n" },
+	{ kind = "eof" },
+}
+
+local reader = open()
+local last, lo_time = 0, nil
+for idx, want in ipairs(expected) do
+	local event = reader:next()
+
+	assert(event, "recording ended early at event " .. idx)
+	assert(event.kind == want.kind, "event " .. idx .. " is " .. event.kind)
+	assert(want.offset == nil or event.offset == want.offset,
+	    "event " .. idx .. " at offset " .. event.offset)
+	assert(want.data == nil or event.data == want.data,
+	    "event " .. idx .. " has data '" .. event.data .. "'")
+	assert(event.time >= last, "event " .. idx .. " went back in time")
+
+	if want.data == "lo" then
+		lo_time = event.time
+		assert(event.delta >= 0.25, "delta too short: " .. event.delta)
+	end
+
+	last = event.time
+end
+assert(reader:next() == nil, "extra events in the recording")
+reader:close()
+
+-- The match starts in the first event, but it's only complete with the second.
+reader = open()
+local offset, time = reader:find("hello")
+assert(offset == 0, "hello found at " .. tostring(offset))
+assert(time == lo_time, "hello completed at " .. tostring(time))
+assert(reader:find("got") == 5)
+assert(reader:find("hello") == nil)
+reader:close()
+
+reader = open()
+assert(reader:find("in\n", "input") == 0)
+reader:close()
+
+reader = open()
+local found = false
+for _, event in ipairs(reader:gaps(0.25)) do
+	assert(event.data ~= "hel", "unexpected gap before the first output")
+	found = found or event.data == "lo"
+end
+assert(found, "the stall before 'lo' wasn't reported")
+reader:close()
+
+os.remove(path)
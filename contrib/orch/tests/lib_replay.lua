@@ -0,0 +1,48 @@
+local core = require("orch.core")
+local orch = require("orch")
+
+-- replay.rec lives alongside us.
+local path = debug.getinfo(1, "S").source:match("^@(.*/)") .. "replay.rec"
+
+local function drain(proc)
+	local eof = false
+
+	while not eof do
+		assert(proc:read(function(nbytes)
+			if not nbytes then
+				eof = true
+			end
+		end, 5))
+	end
+end
+
+-- The recording holds off on its output for five seconds, so this is only
+-- quick with the delays dropped.
+local start = core.time()
+local proc = assert(core.replay(path, { speed = 0 }))
+assert(proc:release())
+local buffer = proc:buffer()
+assert(proc:write("world\n"))
+drain(proc)
+assert(buffer:contents() == "hello\ngot world\n", buffer:contents())
+assert(core.time() - start < 2, "replay didn't skip the delays")
+assert(proc:close())
+
+-- Input that doesn't match the recording fails at the write.
+proc = assert(core.replay(path, { speed = 0 }))
+assert(proc:release())
+local ok, err = proc:write("worst\n")
+assert(not ok and err == "input diverges from the recording at offset 3", err)
+assert(proc:close())
+
+-- Sessions past the end of the recording don't exist.
+ok, err = core.replay(path, { session = 2 })
+assert(not ok and err == path .. ": no session 2 in recording", err)
+
+-- The library's wrapper matches like any other process.
+proc = orch.replay(path, { speed = 0 })
+assert(proc:match("hello"))
+proc:write("world\n")
+assert(proc:match("got world"))
+assert(proc:eof(5))
+assert(proc:close())
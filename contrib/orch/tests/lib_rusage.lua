@@ -0,0 +1,21 @@
+local orch = require("orch")
+
+local proc = orch.spawn("sh", "-c", "echo ready; sleep 0.3")
+assert(proc:match("ready"))
+
+-- Nothing to report until it's exited.
+local ru, err = proc:rusage()
+assert(not ru and err, "rusage() succeeded for a running process")
+
+assert(proc:eof(5))
+assert(proc:close())
+
+-- ... and it sticks around after close().
+ru = assert(proc:rusage())
+for _, field in ipairs({ "utime", "stime", "maxrss", "nvcsw", "nivcsw",
+    "wall" }) do
+	assert(type(ru[field]) == "number", field .. " is " .. type(ru[field]))
+end
+
+assert(ru.wall >= 0.25, "wall time too short: " .. ru.wall)
+assert(ru.maxrss > 0, "no maxrss reported")
@@ -0,0 +1,39 @@
+local core = require("orch.core")
+local tty = core.tty
+
+-- The initial terminal settings are applied by the child before it reports in,
+-- so they're in effect both for what we see and for what the command sees.
+local proc = assert(core.spawn({
+	term = {
+		lflag = { unset = tty.lflag.ECHO },
+		cc = { VEOF = "^F" },
+	},
+}, "stty", "-a"))
+
+local term = assert(proc:term())
+local lflag, cc = term:fetch("lflag", "cc")
+assert(lflag & tty.lflag.ECHO == 0, "ECHO still set in the reported termios")
+assert(cc.VEOF == "^F", "VEOF is " .. tostring(cc.VEOF))
+
+assert(proc:release())
+
+local buffer = proc:buffer()
+local eof = false
+while not eof do
+	assert(proc:read(function(nbytes)
+		if not nbytes then
+			eof = true
+		end
+	end, 5))
+end
+
+local output = buffer:contents()
+assert(output:find("%-echo%s"), "child's terminal still echoes:\n" .. output)
+assert(output:find("eof = %^F"),
+    "child's VEOF wasn't remapped:\n" .. output)
+
+-- The settings have nothing to apply to in pipe mode.
+local ok, err = core.spawn({ pipe = true, term = {} }, "true")
+assert(not ok and err, "term accepted for a pipe-mode spawn")
+
+assert(proc:close())
@@ -0,0 +1,35 @@
+local core = require("orch.core")
+local orch = require("orch")
+
+local quick = orch.spawn("sh", "-c", "echo quick; sleep 10")
+local slow = orch.spawn("sh", "-c", "sleep 10")
+
+quick:release()
+slow:release()
+
+-- Only the process with output pending should be reported.
+local ready = assert(orch.wait_any({ quick, slow }, 5))
+assert(#ready == 1, "expected one process ready, got " .. #ready)
+assert(ready[1] == quick, "expected the quick process to be ready")
+assert(quick:match("quick"))
+
+-- ... and nothing at all if we time out.
+local start = core.time()
+ready = assert(orch.wait_any({ slow }, 0.5))
+assert(#ready == 0, "expected a timeout, got " .. #ready .. " ready")
+assert(core.time() - start >= 0.4, "wait_any returned early")
+
+-- Nothing to wait on still takes the whole timeout, or fails without one.
+start = core.time()
+ready = assert(orch.wait_any({}, 0.5))
+assert(#ready == 0, "expected nothing ready, got " .. #ready)
+assert(core.time() - start >= 0.4, "empty wait_any returned early")
+
+local ok, err = orch.wait_any({})
+assert(not ok and err == "nothing to wait on", err)
+
+-- Bad input is reported without leaking the pollfds that were set up for it.
+ok, err = core.wait_any({ {} })
+assert(not ok and err == "element 1 is not a process", err)
+
+assert(orch.close_all({ quick, slow }, { signals = { "KILL" } }))
@@ -0,0 +1,243 @@
+/*-
+ * Copyright (c) 2024 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "orch.h"
+#include "orch_lib.h"
+
+/*
+ * The peer starts sending us a frame much larger than the socket buffer, but
+ * won't finish it until it has read all of the one that we're sending it, as
+ * if it were stuck in its own send.  We have to hold on to the part of its
+ * frame that we've seen and get back to sending, or neither of us will ever
+ * make progress and the alarm fires.
+ */
+#define	FRAMESZ		(60 * 1024)
+#define	PARTIALSZ	1024
+#define	SOCKBUFSZ	(8 * 1024)
+#define	TEST_TIMEOUT	30
+
+static void
+fill(unsigned char *data, int side)
+{
+
+	for (size_t i = 0; i < FRAMESZ; i++)
+		data[i] = (unsigned char)(side * 131 + i);
+}
+
+static void
+nonblock(int fd)
+{
+
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+		err(1, "fcntl");
+}
+
+static struct orch_ipc_msg *
+frame_alloc(int side)
+{
+	struct orch_ipc_msg *msg;
+	unsigned char *data;
+
+	msg = orch_ipc_msg_alloc(IPC_ERROR, FRAMESZ, (void **)&data);
+	if (msg == NULL)
+		err(1, "orch_ipc_msg_alloc");
+
+	fill(data, side);
+	return (msg);
+}
+
+/*
+ * Grab the peer's frame as it would appear on the wire by sending it over a
+ * socket with plenty of room for it.
+ */
+static unsigned char *
+frame_serialize(int side, size_t *framesz)
+{
+	struct orch_ipc_msg *msg;
+	unsigned char *frame;
+	orch_ipc_t ipc;
+	ssize_t readsz;
+	size_t cap, len;
+	int bufsz, fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+		err(1, "socketpair");
+
+	bufsz = 4 * FRAMESZ;
+	(void)setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &bufsz, sizeof(bufsz));
+	(void)setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(bufsz));
+	for (int i = 0; i < 2; i++)
+		nonblock(fds[i]);
+
+	ipc = orch_ipc_open(fds[0]);
+	if (ipc == NULL)
+		err(1, "orch_ipc_open");
+
+	msg = frame_alloc(side);
+	if (orch_ipc_send(ipc, msg) != 0)
+		err(1, "serialize: send");
+	orch_ipc_msg_free(msg);
+
+	cap = 2 * FRAMESZ;
+	frame = malloc(cap);
+	if (frame == NULL)
+		err(1, "malloc");
+
+	/* It all went out in one go, so it's all there to read. */
+	len = 0;
+	while ((readsz = read(fds[1], &frame[len], cap - len)) > 0)
+		len += readsz;
+	if (readsz == -1 && errno != EAGAIN)
+		err(1, "serialize: read");
+	if (len <= FRAMESZ || len == cap)
+		errx(1, "serialize: unexpected frame size %zu", len);
+
+	/* orch_ipc_close() waits for us to hang up. */
+	close(fds[1]);
+	orch_ipc_close(ipc);
+	*framesz = len;
+	return (frame);
+}
+
+static void
+writeall(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t writesz;
+
+	while (len != 0) {
+		writesz = write(fd, buf, len);
+		if (writesz == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "peer: write");
+		}
+
+		buf += writesz;
+		len -= writesz;
+	}
+}
+
+static int
+peer(int fd, const unsigned char *frame, size_t framesz)
+{
+	unsigned char *inbuf;
+	ssize_t readsz;
+	size_t len;
+
+	inbuf = malloc(framesz);
+	if (inbuf == NULL)
+		err(1, "malloc");
+
+	/* Our frames are the same size, so we know how much to expect. */
+	writeall(fd, frame, PARTIALSZ);
+	for (len = 0; len < framesz; len += readsz) {
+		readsz = read(fd, &inbuf[len], framesz - len);
+		if (readsz == -1 && errno == EINTR) {
+			readsz = 0;
+			continue;
+		}
+		if (readsz <= 0)
+			err(1, "peer: read");
+	}
+
+	writeall(fd, &frame[PARTIALSZ], framesz - PARTIALSZ);
+
+	/* Wait for the other side to hang up. */
+	while (read(fd, inbuf, framesz) > 0)
+		continue;
+
+	free(inbuf);
+	return (0);
+}
+
+int
+main(void)
+{
+	struct orch_ipc_msg *msg;
+	unsigned char *data, *expected, *frame;
+	orch_ipc_t ipc;
+	size_t datasz, framesz;
+	pid_t pid;
+	int bufsz, fds[2], status;
+
+	frame = frame_serialize(1, &framesz);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+		err(1, "socketpair");
+
+	bufsz = SOCKBUFSZ;
+	for (int i = 0; i < 2; i++) {
+		(void)setsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &bufsz,
+		    sizeof(bufsz));
+		(void)setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &bufsz,
+		    sizeof(bufsz));
+	}
+
+	pid = fork();
+	if (pid == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		close(fds[0]);
+		alarm(TEST_TIMEOUT);
+		_exit(peer(fds[1], frame, framesz));
+	}
+
+	close(fds[1]);
+	alarm(TEST_TIMEOUT);
+
+	nonblock(fds[0]);
+	ipc = orch_ipc_open(fds[0]);
+	if (ipc == NULL)
+		err(1, "orch_ipc_open");
+
+	msg = frame_alloc(0);
+	if (orch_ipc_send(ipc, msg) != 0)
+		err(1, "send");
+	orch_ipc_msg_free(msg);
+
+	msg = NULL;
+	while (msg == NULL) {
+		if (orch_ipc_wait(ipc, NULL) == -1 ||
+		    orch_ipc_recv(ipc, &msg) != 0)
+			err(1, "recv");
+		if (msg == NULL && !orch_ipc_okay(ipc))
+			errx(1, "EOF before the peer's frame");
+	}
+
+	expected = malloc(FRAMESZ);
+	if (expected == NULL)
+		err(1, "malloc");
+
+	fill(expected, 1);
+	data = orch_ipc_msg_payload(msg, &datasz);
+	if (datasz != FRAMESZ || memcmp(data, expected, FRAMESZ) != 0)
+		errx(1, "peer's frame corrupted");
+
+	orch_ipc_msg_free(msg);
+	orch_ipc_close(ipc);
+
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		errx(1, "peer failed with status %#x", status);
+
+	free(expected);
+	free(frame);
+	printf("ok - partial ipc frame held while sending\n");
+	return (0);
+}
@@ -0,0 +1,63 @@
+/*-
+ * Copyright (c) 2024 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "orch.h"
+
+#include <lauxlib.h>
+#include <lualib.h>
+
+/*
+ * A minimal interpreter for the tests that exercise the orch Lua library
+ * directly rather than through orch(1): orch.core is preloaded, and the .lua
+ * modules are found via $ORCHLUA_PATH.  The script fails the test by raising
+ * an error.
+ */
+int
+main(int argc, char *argv[])
+{
+	const char *path;
+	lua_State *L;
+	int status;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s script\n", argv[0]);
+		return (1);
+	}
+
+	L = luaL_newstate();
+	if (L == NULL)
+		errx(1, "luaL_newstate: out of memory");
+
+	luaL_openlibs(L);
+
+	luaL_requiref(L, ORCHLUA_MODNAME, luaopen_orch_core, 0);
+	lua_pop(L, 1);
+
+	path = getenv("ORCHLUA_PATH");
+	if (path != NULL && path[0] != '\0') {
+		lua_getglobal(L, "package");
+		lua_getfield(L, -1, "path");
+		lua_pushfstring(L, "%s/?.lua;%s", path, lua_tostring(L, -1));
+		lua_setfield(L, -3, "path");
+		lua_pop(L, 2);
+	}
+
+	status = 0;
+	if (luaL_dofile(L, argv[1]) != LUA_OK) {
+		const char *msg;
+
+		msg = lua_tostring(L, -1);
+		fprintf(stderr, "%s\n", msg != NULL ? msg : "unknown");
+		status = 1;
+	}
+
+	lua_close(L);
+	return (status);
+}